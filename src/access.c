@@ -0,0 +1,282 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (c) 1998-2006 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *                 All Rights Reserved
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   In addition, as a special exception, Michal Trojnara gives
+ *   permission to link the code of this program with the OpenSSL
+ *   library (or with modified versions of OpenSSL that use the same
+ *   license as OpenSSL), and distribute linked combinations including
+ *   the two.  You must obey the GNU General Public License in all
+ *   respects for all of the code used other than OpenSSL.  If you modify
+ *   this file, you may extend this exception to your version of the
+ *   file, but you are not obligated to do so.  If you do not wish to
+ *   do so, delete this exception statement from your version.
+ */
+
+/* One JSON object per line and connection is appended to the 'accessLog'
+ * file.  Records are collected in access_buffer and written in chunks:
+ * when the buffer is full, by the log writer thread (PTHREAD) or by the
+ * scheduler before poll() (UCONTEXT).  Each FORK child writes its own
+ * record on exit.  Several processes may append to the same file, so the
+ * file is reopened whenever its name no longer refers to our descriptor. */
+
+#include "common.h"
+#include "prototypes.h"
+
+#ifndef USE_WIN32
+
+#define ACCESS_BUFFER 65536 /* bytes buffered before a write() */
+#define ACCESS_RECORD 1024 /* longest record */
+#define ACCESS_STRING 128 /* longest quoted string in a record */
+
+static DISK_FILE *access_file=NULL; /* access log disabled by default */
+static char *access_buffer=NULL;
+static int access_used=0; /* bytes in access_buffer */
+static int access_check=1; /* watch the file for size and rotation */
+
+static int access_record(char *, CLI *, int);
+static void json_string(char *, const char *);
+static char *close_reason(CLI *, int);
+static void access_write(void);
+static void access_rotate(void);
+static void access_reopen(void);
+
+void access_open(void) {
+    if(!options.access_log)
+        return;
+    access_file=file_open(options.access_log, 1);
+    access_buffer=malloc(ACCESS_BUFFER);
+    if(!access_file || !access_buffer) {
+        s_log(LOG_ERR, "Unable to open access log: %s", options.access_log);
+        exit(1);
+    }
+}
+
+void access_close(void) {
+    if(!access_file)
+        return;
+    access_flush();
+    file_close(access_file);
+    access_file=NULL;
+    free(access_buffer);
+    access_buffer=NULL;
+}
+
+void access_log(CLI *c, int error) {
+    char record[ACCESS_RECORD];
+    int len;
+
+    if(!access_file)
+        return;
+    len=access_record(record, c, error);
+    enter_critical_section(CRIT_ACCESS);
+    if(access_used+len>ACCESS_BUFFER)
+        access_write();
+    memcpy(access_buffer+access_used, record, len);
+    access_used+=len;
+#ifdef USE_FORK
+    access_write(); /* nothing to batch with in a child process */
+#endif
+    leave_critical_section(CRIT_ACCESS);
+}
+
+void access_flush(void) {
+    if(!access_file)
+        return;
+    enter_critical_section(CRIT_ACCESS);
+    if(access_used)
+        access_write();
+    leave_critical_section(CRIT_ACCESS);
+}
+
+    /* format the record of a finished connection, returns its length */
+static int access_record(char *line, CLI *c, int error) {
+    char service[ACCESS_STRING], peer[ACCESS_STRING],
+        backend[ACCESS_STRING], cipher[ACCESS_STRING];
+    char connect_ms[32], handshake_ms[32];
+    SSL_CIPHER *current;
+    double now;
+
+    now=stats_time();
+    json_string(service, c->opt->servname);
+    json_string(peer, c->accepting_address);
+    json_string(backend, c->connecting_address[0] ?
+        c->connecting_address : NULL);
+    current=c->ssl && c->time_handshake>=0 ?
+        (SSL_CIPHER *)SSL_get_current_cipher(c->ssl) : NULL;
+    json_string(cipher, current ? SSL_CIPHER_get_name(current) : NULL);
+    if(c->time_connect>=0)
+        sprintf(connect_ms, "%.3f", 1000*c->time_connect);
+    else
+        strcpy(connect_ms, "null");
+    if(c->time_handshake>=0)
+        sprintf(handshake_ms, "%.3f", 1000*c->time_handshake);
+    else
+        strcpy(handshake_ms, "null");
+    sprintf(line, "{\"start\":%.3f,\"service\":%s,\"peer\":%s,"
+        "\"backend\":%s,\"cipher\":%s,\"resumed\":%s,"
+        "\"connect_ms\":%s,\"handshake_ms\":%s,\"duration_ms\":%.3f,"
+        "\"bytes_to_ssl\":%lu,\"bytes_to_sock\":%lu,\"close\":\"%s\"}\n",
+        c->time_start, service, peer, backend, cipher,
+        current && SSL_session_reused(c->ssl) ? "true" : "false",
+        connect_ms, handshake_ms, 1000*(now-c->time_start),
+        c->ssl_bytes, c->sock_bytes, close_reason(c, error));
+    return strlen(line);
+}
+
+    /* quote and escape a JSON string, NULL -> null */
+static void json_string(char *out, const char *in) {
+    char *end=out+ACCESS_STRING-8; /* room for an escape and the quote */
+
+    if(!in) {
+        strcpy(out, "null");
+        return;
+    }
+    *out++='"';
+    for(; *in && out<end; in++) {
+        if(*in=='"' || *in=='\\') {
+            *out++='\\';
+            *out++=*in;
+        } else if((unsigned char)*in<0x20) {
+            sprintf(out, "\\u%04x", (unsigned char)*in);
+            out+=6;
+        } else
+            *out++=*in;
+    }
+    *out++='"';
+    *out='\0';
+}
+
+static char *close_reason(CLI *c, int error) {
+    /* the last stats_flush() was before the timeout that ended the
+     * connection, so its counter is still in c->stats */
+    if(c->stats.timeouts[TIMEOUT_CONNECT])
+        return "timeout_connect";
+    if(c->stats.timeouts[TIMEOUT_BUSY])
+        return "timeout_busy";
+    if(c->stats.timeouts[TIMEOUT_IDLE])
+        return "timeout_idle";
+    if(c->stats.timeouts[TIMEOUT_CLOSE])
+        return "timeout_close";
+    if(!error)
+        return "closed";
+    switch(c->state) {
+    case CLI_INIT_LOCAL:
+        return "refused";
+    case CLI_INIT_REMOTE:
+        return "connect_failed";
+    case CLI_NEGOTIATE:
+        return "protocol_error";
+    case CLI_INIT_SSL:
+    case CLI_EARLY_DATA:
+    case CLI_HANDSHAKE:
+        return "handshake_failed";
+    default:
+        return "reset";
+    }
+}
+
+    /* write the buffered records, called in CRIT_ACCESS */
+static void access_write(void) {
+    int num, done=0;
+    struct stat path_st, file_st;
+
+    while(done<access_used) {
+        num=write(access_file->fd, access_buffer+done, access_used-done);
+        if(num<0) {
+            if(errno==EINTR)
+                continue;
+            ioerror(options.access_log);
+            s_log(LOG_ERR, "%d byte(s) of access log records lost",
+                access_used-done);
+            break;
+        }
+        done+=num;
+    }
+    access_used=0;
+
+    if(!access_check)
+        return;
+    if(fstat(access_file->fd, &file_st)) {
+        ioerror("access_write: fstat");
+        return;
+    }
+    if(stat(options.access_log, &path_st) ||
+            path_st.st_dev!=file_st.st_dev || path_st.st_ino!=file_st.st_ino)
+        access_reopen(); /* rotated by another process */
+    else if(options.access_log_size &&
+            (unsigned long)file_st.st_size>=options.access_log_size)
+        access_rotate();
+}
+
+    /* rename the file to name.YYYYMMDDhhmmss.pid[.n] and start a new one */
+static void access_rotate(void) {
+    time_t now;
+    struct tm *timeptr;
+#if defined(HAVE_LOCALTIME_R) && defined(_REENTRANT)
+    struct tm timestruct;
+#endif
+    char *name;
+    struct stat st;
+    int len, i;
+
+    name=malloc(strlen(options.access_log)+48);
+    if(!name) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        return;
+    }
+    time(&now);
+#if defined(HAVE_LOCALTIME_R) && defined(_REENTRANT)
+    timeptr=localtime_r(&now, &timestruct);
+#else
+    timeptr=localtime(&now);
+#endif
+    /* the pid keeps two processes rotating at once from colliding */
+    sprintf(name, "%s.%04d%02d%02d%02d%02d%02d.%lu", options.access_log,
+        timeptr->tm_year+1900, timeptr->tm_mon+1, timeptr->tm_mday,
+        timeptr->tm_hour, timeptr->tm_min, timeptr->tm_sec,
+        (unsigned long)getpid());
+    len=strlen(name);
+    for(i=1; !stat(name, &st); i++) /* rotated more than once a second */
+        sprintf(name+len, ".%d", i);
+    if(rename(options.access_log, name) && errno!=ENOENT) {
+        ioerror(name);
+        access_check=0;
+    } else {
+        s_log(LOG_NOTICE, "Access log rotated to %s", name);
+        access_reopen();
+    }
+    free(name);
+}
+
+static void access_reopen(void) {
+    DISK_FILE *df;
+
+    df=file_open(options.access_log, 1);
+    if(!df) { /* e.g. the path is not valid after chroot */
+        s_log(LOG_ERR, "Access log rotation disabled");
+        access_check=0;
+        return; /* keep appending to the old file */
+    }
+    file_close(access_file);
+    access_file=df;
+}
+
+#endif /* !defined USE_WIN32 */
+
+/* End of access.c */
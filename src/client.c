@@ -56,24 +56,42 @@ static unsigned char *sid_ctx=(unsigned char *)"stunnel SID";
     /* const allowed here */
 #endif
 
-static void do_client(CLI *);
+static int do_client(CLI *);
+static int client_step(CLI *);
 static void run_client(CLI *);
-static void init_local(CLI *);
-static void init_remote(CLI *);
-static void init_ssl(CLI *);
-static void transfer(CLI *);
-static void parse_socket_error(CLI *, const char *);
+static int init_local(CLI *);
+static int init_remote(CLI *);
+static int init_ssl(CLI *);
+static int handshake(CLI *);
+static void handshake_fds(CLI *, int);
+static int handshake_result(CLI *, int);
+#ifdef HAVE_EARLY_DATA
+static int early_write(CLI *);
+static int early_read(CLI *);
+#endif
+static int transfer(CLI *);
+static void transfer_fds(CLI *);
+static int transfer_ready(CLI *);
+static int record_size(CLI *);
+static void record_nodelay(CLI *);
+static int would_block(void);
+static int parse_socket_error(CLI *, const char *);
 
 static void print_cipher(CLI *);
-static void auth_libwrap(CLI *);
-static void auth_user(CLI *);
+static int auth_libwrap(CLI *);
+static int auth_user(CLI *);
 static int connect_local(CLI *);
 #ifndef USE_WIN32
-static void make_sockets(CLI *, int [2]);
+static int make_sockets(CLI *, int [2]);
 #endif
 static int connect_remote(CLI *);
-static void connect_wait(CLI *);
+static int connect_wait(CLI *);
+static void connect_fds(CLI *);
+static int connect_result(CLI *, int);
 static void reset(int, char *);
+#ifdef USE_UCONTEXT
+static void stack_sample(LOCAL_OPTIONS *);
+#endif
 
 int max_clients;
 #ifndef USE_WIN32
@@ -90,6 +108,9 @@ void *alloc_client_session(LOCAL_OPTIONS *opt, int rfd, int wfd) {
         return NULL;
     }
     c->opt=opt;
+#ifndef USE_FORK
+    section_hold(opt); /* kept until the end of client() after a reload */
+#endif
     c->local_rfd.fd=rfd;
     c->local_wfd.fd=wfd;
     return c;
@@ -120,6 +141,12 @@ void *client(void *arg) {
                 return NULL;
         run_client(c);
     }
+#ifdef USE_UCONTEXT
+    stack_sample(c->opt);
+#endif
+#ifndef USE_FORK
+    section_release(c->opt);
+#endif
     free(c);
 #ifdef DEBUG_STACK_SIZE
     stack_info(0); /* display computed value */
@@ -140,16 +167,32 @@ static void run_client(CLI *c) {
 
     c->remote_fd.fd=-1;
     c->fd=-1;
+    c->line_fd=-1;
     c->ssl=NULL;
     c->sock_bytes=c->ssl_bytes=0;
-
-    error=setjmp(c->err);
-    if(!error)
-        do_client(c);
+    c->sock_ptr=c->ssl_ptr=0; /* 0-RTT data may be buffered before transfer() */
+    c->early_sent=c->early_read=0;
+    c->record_limit=0;
+    c->record_time=c->record_burst=0.0;
+    c->time_start=stats_time();
+    c->time_connect=c->time_handshake=-1; /* not yet */
+    c->state=CLI_INIT_LOCAL;
+    c->stats.connections_total++;
+    c->stats.connections_active++;
+    stats_flush(c);
+
+    error=do_client(c);
 
     s_log(LOG_NOTICE,
-        "Connection %s: %d bytes sent to SSL, %d bytes sent to socket",
+        "Connection %s: %lu bytes sent to SSL, %lu bytes sent to socket",
          error ? "reset" : "closed", c->ssl_bytes, c->sock_bytes);
+#ifndef USE_WIN32
+    access_log(c, error);
+#endif
+    c->stats.connections_active--;
+    if(error)
+        c->stats.connections_reset++;
+    stats_flush(c);
 
         /* Cleanup IDENT socket */
     if(c->fd>=0)
@@ -193,21 +236,108 @@ static void run_client(CLI *c) {
 #endif
 }
 
-static void do_client(CLI *c) {
-    init_local(c);
-    if(!c->opt->option.client && !c->opt->protocol) {
-        /* Server mode and no protocol negotiation needed */
-        init_ssl(c);
-        init_remote(c);
-    } else {
-        init_remote(c);
-        negotiate(c);
-        init_ssl(c);
+    /* drive the connection through its stages
+     * a stage waiting for its descriptors returns CLI_WAIT after it set up
+     * c->fds and c->wait_timeout, and it is called again with c->resumed
+     * once s_poll_wait() returned, so the stages keep no state on the stack
+     * still waiting inside their stage: negotiate(), the ident lookup of
+     * auth_user() and connect_local() of 'exec' services
+     * returns non-zero on error and the connection is reset */
+static int do_client(CLI *c) {
+    int rc;
+
+    c->resumed=0;
+    while((rc=client_step(c))==CLI_WAIT) {
+        c->wait_result=s_poll_wait(&c->fds, c->wait_timeout);
+        c->resumed=1;
     }
-    transfer(c);
+    return rc;
 }
 
-static void init_local(CLI *c) {
+    /* run the stages until the connection is finished or a stage waits
+     * returns 0 when finished, CLI_WAIT or -1 on error */
+static int client_step(CLI *c) {
+    int ssl_first; /* server mode and no protocol negotiation needed */
+    int rc;
+
+    ssl_first=!c->opt->option.client && !c->opt->protocol;
+    while(c->state!=CLI_DONE) {
+        switch(c->state) {
+        case CLI_INIT_LOCAL:
+            if(init_local(c))
+                return -1;
+            c->state=ssl_first ? CLI_INIT_SSL : CLI_INIT_REMOTE;
+            break;
+        case CLI_INIT_REMOTE:
+            if(!c->resumed)
+                c->connect_start=stats_time();
+            rc=init_remote(c);
+            if(rc)
+                return rc;
+            c->time_connect=stats_time()-c->connect_start;
+            if(c->early_read) /* 0-RTT data waits for the connection */
+                c->state=CLI_EARLY_DATA;
+            else
+                c->state=ssl_first ? CLI_TRANSFER : CLI_NEGOTIATE;
+            break;
+        case CLI_NEGOTIATE:
+            if(negotiate(c))
+                return -1;
+            c->state=CLI_INIT_SSL;
+            break;
+        case CLI_INIT_SSL:
+            c->handshake_start=stats_time();
+            if(init_ssl(c)) {
+                c->stats.handshakes_failed++;
+                return -1;
+            }
+#ifdef HAVE_EARLY_DATA
+            c->state=CLI_EARLY_DATA;
+#else
+            c->state=CLI_HANDSHAKE;
+#endif
+            break;
+#ifdef HAVE_EARLY_DATA
+        case CLI_EARLY_DATA:
+            rc=c->opt->option.client ? early_write(c) : early_read(c);
+            if(rc<0)
+                c->stats.handshakes_failed++;
+            if(rc)
+                return rc;
+            /* 0-RTT data received before the remote host was connected */
+            c->state=c->early_read ? CLI_INIT_REMOTE : CLI_HANDSHAKE;
+            break;
+#endif
+        case CLI_HANDSHAKE:
+            rc=handshake(c);
+            if(rc<0)
+                c->stats.handshakes_failed++;
+            if(rc)
+                return rc;
+            c->time_handshake=stats_time()-c->handshake_start;
+            stats_handshake(&c->stats, c->time_handshake,
+                SSL_session_reused(c->ssl));
+            stats_flush(c);
+            c->state=ssl_first && c->remote_fd.fd<0 ?
+                CLI_INIT_REMOTE : CLI_TRANSFER;
+            break;
+        case CLI_TRANSFER:
+            rc=transfer(c);
+            if(rc)
+                return rc;
+            c->state=CLI_DONE;
+            break;
+        default:
+            s_log(LOG_ERR, "INTERNAL ERROR: Unknown client state %d",
+                c->state);
+            return -1;
+        }
+        c->resumed=0; /* the next stage starts from the beginning */
+    }
+    return 0; /* OK */
+}
+
+static int init_local(CLI *c) {
     SOCKADDR_UNION addr;
     socklen_t addrlen;
 
@@ -222,7 +352,7 @@ static void init_local(CLI *c) {
         if(c->opt->option.transparent || get_last_socket_error()!=ENOTSOCK) {
 #endif
             sockerror("getpeerbyname");
-            longjmp(c->err, 1);
+            return -1;
         }
         /* Ignore ENOTSOCK error so 'local' doesn't have to be a socket */
     } else { /* success */
@@ -234,42 +364,53 @@ static void init_local(CLI *c) {
         c->local_wfd.is_socket=1; /* TODO: It's not always true */
         /* It's a socket: lets setup options */
         if(set_socket_options(c->local_rfd.fd, 1)<0)
-            longjmp(c->err, 1);
-        auth_libwrap(c);
-        auth_user(c);
+            return -1;
+        if(auth_libwrap(c) || auth_user(c))
+            return -1;
         s_log(LOG_NOTICE, "%s connected from %s",
             c->opt->servname, c->accepting_address);
     }
+    return 0; /* OK */
 }
 
-static void init_remote(CLI *c) {
+    /* returns CLI_WAIT while a non-blocking connect is in progress */
+static int init_remote(CLI *c) {
+    int rc;
+
     /* create connection to host/service */
-    if(c->opt->source_addr.num)
-        memcpy(&c->bind_addr, &c->opt->source_addr, sizeof(SOCKADDR_LIST));
+    if(!c->resumed) { /* not set again while connecting */
+        if(c->opt->source_addr.num)
+            memcpy(&c->bind_addr, &c->opt->source_addr, sizeof(SOCKADDR_LIST));
 #ifndef USE_WIN32
-    else if(c->opt->option.transparent)
-        memcpy(&c->bind_addr, &c->peer_addr, sizeof(SOCKADDR_LIST));
+        else if(c->opt->option.transparent)
+            memcpy(&c->bind_addr, &c->peer_addr, sizeof(SOCKADDR_LIST));
 #endif
-    else {
-        c->bind_addr.num=0; /* don't bind connecting socket */
+        else {
+            c->bind_addr.num=0; /* don't bind connecting socket */
+        }
     }
 
     /* setup c->remote_fd, now */
     if(c->opt->option.remote) {
-        c->remote_fd.fd=connect_remote(c);
+        rc=connect_remote(c);
+        if(rc) /* error or CLI_WAIT */
+            return rc;
     } else /* NOT in remote mode */
         c->remote_fd.fd=connect_local(c);
+    if(c->remote_fd.fd<0)
+        return -1;
     c->remote_fd.is_socket=1; /* Always! */
 #ifndef USE_WIN32
     if(c->remote_fd.fd>=max_fds) {
         s_log(LOG_ERR, "Remote file descriptor out of range (%d>=%d)",
             c->remote_fd.fd, max_fds);
-        longjmp(c->err, 1);
+        return -1;
     }
 #endif
     s_log(LOG_DEBUG, "Remote FD=%d initialized", c->remote_fd.fd);
     if(set_socket_options(c->remote_fd.fd, 2)<0)
-        longjmp(c->err, 1);
+        return -1;
+    return 0; /* OK */
 }
 
 static char *get_cfg_name(CLI *c) {
@@ -358,8 +499,14 @@ static int post_connection_check(CLI *c) {
 
     cfg_name = get_cfg_name(c);
     s_log(LOG_INFO, "Post check: Config hostname: %s", cfg_name);
-    if(cfg_name && verify_cert_hostname(cert, cfg_name))
-        ok = 1;
+    if(cfg_name) {
+        ok = verify_cache_hostname(c, cfg_name);
+        if(ok < 0) { /* not checked for this certificate chain yet */
+            ok = verify_cert_hostname(cert, cfg_name);
+            verify_cache_set_hostname(c, cfg_name, ok);
+        } else
+            s_log(LOG_INFO, "Post check: cached result for this peer");
+    }
 
     if(cfg_name) free(cfg_name);
     X509_free(cert);
@@ -370,13 +517,13 @@ static int post_connection_check(CLI *c) {
         return X509_V_ERR_APPLICATION_VERIFICATION;
 }
 
-static void init_ssl(CLI *c) {
-    int i, err;
-    SSL_SESSION *old_session;
-
-    if(!(c->ssl=SSL_new(c->opt->ctx))) {
+static int init_ssl(CLI *c) {
+    enter_critical_section(CRIT_CTX); /* replaced by context_check() */
+    c->ssl=SSL_new(c->opt->ctx);
+    leave_critical_section(CRIT_CTX);
+    if(!c->ssl) {
         sslerror("SSL_new");
-        longjmp(c->err, 1);
+        return -1;
     }
     SSL_set_ex_data(c->ssl, cli_index, c); /* for verify callback */
 #if SSLEAY_VERSION_NUMBER >= 0x0922
@@ -386,6 +533,14 @@ static void init_ssl(CLI *c) {
         if(c->opt->session) {
             enter_critical_section(CRIT_SESSION);
             SSL_set_session(c->ssl, c->opt->session);
+#ifdef HAVE_EARLY_DATA
+            if(c->opt->option.early_data &&
+                    SSL_SESSION_get_max_early_data(c->opt->session)) {
+                /* a ticket is only good for one 0-RTT attempt */
+                SSL_SESSION_free(c->opt->session);
+                c->opt->session=NULL;
+            }
+#endif
             leave_critical_section(CRIT_SESSION);
         }
         SSL_set_fd(c->ssl, c->remote_fd.fd);
@@ -411,7 +566,15 @@ static void init_ssl(CLI *c) {
         c->ssl_rfd=&(c->local_rfd);
         c->ssl_wfd=&(c->local_wfd);
     }
+    return 0; /* OK: 0-RTT data or the handshake is the next stage */
+}
+
+    /* returns CLI_WAIT until SSL_connect() or SSL_accept() is finished */
+static int handshake(CLI *c) {
+    int i, err;
 
+    if(c->resumed && handshake_result(c, c->wait_result))
+        return -1;
     while(1) {
         if(c->opt->option.client)
             i=SSL_connect(c->ssl);
@@ -421,29 +584,14 @@ static void init_ssl(CLI *c) {
         if(err==SSL_ERROR_NONE) {
             if(post_connection_check(c) != X509_V_OK) {
                 s_log(LOG_NOTICE, "Post connection cert verification failed");
-                longjmp(c->err, 1); // bail
+                return -1; /* bail */
             }
             break; /* ok -> done */
         }
         if(err==SSL_ERROR_WANT_READ || err==SSL_ERROR_WANT_WRITE) {
-            s_poll_zero(&c->fds);
-            s_poll_add(&c->fds, c->ssl_rfd->fd,
-                err==SSL_ERROR_WANT_READ,
-                err==SSL_ERROR_WANT_WRITE);
-            switch(s_poll_wait(&c->fds, c->opt->timeout_busy)) {
-            case -1:
-                sockerror("init_ssl: s_poll_wait");
-                longjmp(c->err, 1);
-            case 0:
-                s_log(LOG_INFO, "init_ssl: s_poll_wait timeout");
-                longjmp(c->err, 1);
-            case 1:
-                break; /* OK */
-            default:
-                s_log(LOG_ERR, "init_ssl: s_poll_wait unknown result");
-                longjmp(c->err, 1);
-            }
-            continue; /* ok -> retry */
+            handshake_fds(c, err);
+            c->wait_timeout=c->opt->timeout_busy;
+            return CLI_WAIT; /* retry when ready */
         }
         if(err==SSL_ERROR_SYSCALL) {
             switch(get_last_socket_error()) {
@@ -456,38 +604,162 @@ static void init_ssl(CLI *c) {
             sslerror("SSL_connect");
         else
             sslerror("SSL_accept");
-        longjmp(c->err, 1);
+        return -1;
     }
+#ifdef HAVE_EARLY_DATA
+    if(c->early_sent) {
+        if(SSL_get_early_data_status(c->ssl)==SSL_EARLY_DATA_ACCEPTED) {
+            s_log(LOG_INFO, "0-RTT data accepted: %d byte(s)", c->early_sent);
+            memmove(c->sock_buff, c->sock_buff+c->early_sent,
+                c->sock_ptr-c->early_sent);
+            c->sock_ptr-=c->early_sent;
+            c->ssl_bytes+=c->early_sent;
+        } else /* sent again by transfer() */
+            s_log(LOG_INFO, "0-RTT data rejected: %d byte(s)", c->early_sent);
+        c->early_sent=0;
+    }
+#endif
     if(SSL_session_reused(c->ssl)) {
         s_log(LOG_INFO, "SSL %s: previous session reused",
             c->opt->option.client ? "connected" : "accepted");
     } else { /* a new session was negotiated */
-        if(c->opt->option.client) {
-            s_log(LOG_INFO, "SSL connected: new session negotiated");
-            enter_critical_section(CRIT_SESSION);
-            old_session=c->opt->session;
-            c->opt->session=SSL_get1_session(c->ssl); /* store it */
-            if(old_session)
-                SSL_SESSION_free(old_session); /* release the old one */
-            leave_critical_section(CRIT_SESSION);
-        } else
-            s_log(LOG_INFO, "SSL accepted: new session negotiated");
+        /* new client sessions are stored by new_session_cb() */
+        s_log(LOG_INFO, "SSL %s: new session negotiated",
+            c->opt->option.client ? "connected" : "accepted");
         print_cipher(c);
     }
+    return 0; /* OK */
+}
+
+static void handshake_fds(CLI *c, int err) {
+    s_poll_zero(&c->fds);
+    s_poll_add(&c->fds, c->ssl_rfd->fd,
+        err==SSL_ERROR_WANT_READ,
+        err==SSL_ERROR_WANT_WRITE);
+}
+
+static int handshake_result(CLI *c, int result) {
+    switch(result) {
+    case -1:
+        sockerror("init_ssl: s_poll_wait");
+        return -1;
+    case 0:
+        s_log(LOG_INFO, "init_ssl: s_poll_wait timeout");
+        c->stats.timeouts[TIMEOUT_BUSY]++;
+        return -1;
+    case 1:
+        return 0; /* OK */
+    default:
+        s_log(LOG_ERR, "init_ssl: s_poll_wait unknown result");
+        return -1;
+    }
 }
 
+#ifdef HAVE_EARLY_DATA
+
+    /* send the data the local client has already written as 0-RTT data
+     * without waiting for more
+     * returns CLI_WAIT until SSL_write_early_data() is finished */
+static int early_write(CLI *c) {
+    SSL_SESSION *session;
+    size_t max, num;
+    int i, err;
+
+    if(c->resumed) {
+        if(handshake_result(c, c->wait_result))
+            return -1;
+    } else {
+        session=SSL_get_session(c->ssl);
+        if(!c->opt->option.early_data || !session ||
+                !SSL_SESSION_get_max_early_data(session))
+            return 0; /* OK: no session allowing 0-RTT data is resumed */
+        s_poll_zero(&c->fds);
+        s_poll_add(&c->fds, c->sock_rfd->fd, 1, 0);
+        if(s_poll_wait(&c->fds, 0)>0) {
+            i=readsocket(c->sock_rfd->fd, c->sock_buff, BUFFSIZE);
+            if(i>0) /* errors and EOF are left for transfer() */
+                c->sock_ptr=i;
+        }
+    }
+    if(!c->sock_ptr)
+        return 0; /* OK: nothing to send yet */
+    max=SSL_SESSION_get_max_early_data(SSL_get_session(c->ssl));
+    if(!SSL_write_early_data(c->ssl, c->sock_buff,
+            (size_t)c->sock_ptr<max ? (size_t)c->sock_ptr : max, &num)) {
+        err=SSL_get_error(c->ssl, 0);
+        if(err!=SSL_ERROR_WANT_READ && err!=SSL_ERROR_WANT_WRITE) {
+            sslerror("SSL_write_early_data");
+            return -1;
+        }
+        handshake_fds(c, err);
+        c->wait_timeout=c->opt->timeout_busy;
+        return CLI_WAIT; /* retry when ready */
+    }
+    c->early_sent=num;
+    return 0; /* OK */
+}
+
+    /* pass 0-RTT data to the remote host until the client finished it
+     * sets c->early_read when the remote host is not connected yet
+     * returns CLI_WAIT until SSL_read_early_data() is finished */
+static int early_read(CLI *c) {
+    size_t num;
+    int i, err;
+
+    if(!c->opt->option.early_data)
+        return 0; /* OK: the handshake is the next stage */
+    if(c->resumed && handshake_result(c, c->wait_result))
+        return -1;
+    c->early_read=0;
+    while(1) {
+        if(c->ssl_ptr) { /* forward the data received so far */
+            if(c->remote_fd.fd<0) { /* not connected before the handshake */
+                c->early_read=1;
+                return 0; /* OK: connect the remote host first */
+            }
+            i=writesocket(c->sock_wfd->fd, c->ssl_buff, c->ssl_ptr);
+            if(i<0) {
+                if(!would_block() && parse_socket_error(c, "writesocket"))
+                    return -1;
+                s_poll_zero(&c->fds);
+                s_poll_add(&c->fds, c->sock_wfd->fd, 0, 1);
+                c->wait_timeout=c->opt->timeout_busy;
+                return CLI_WAIT; /* retry when ready */
+            }
+            memmove(c->ssl_buff, c->ssl_buff+i, c->ssl_ptr-i);
+            c->ssl_ptr-=i;
+            c->sock_bytes+=i;
+            continue;
+        }
+        switch(SSL_read_early_data(c->ssl, c->ssl_buff, BUFFSIZE, &num)) {
+        case SSL_READ_EARLY_DATA_SUCCESS:
+            if(num)
+                s_log(LOG_DEBUG, "0-RTT data received: %d byte(s)", (int)num);
+            c->ssl_ptr=num;
+            break;
+        case SSL_READ_EARLY_DATA_FINISH:
+            return 0; /* OK: the handshake is the next stage */
+        default: /* SSL_READ_EARLY_DATA_ERROR */
+            err=SSL_get_error(c->ssl, 0);
+            if(err!=SSL_ERROR_WANT_READ && err!=SSL_ERROR_WANT_WRITE) {
+                sslerror("SSL_read_early_data");
+                return -1;
+            }
+            handshake_fds(c, err);
+            c->wait_timeout=c->opt->timeout_busy;
+            return CLI_WAIT; /* retry when ready */
+        }
+    }
+}
+
+#endif /* HAVE_EARLY_DATA */
+
 /****************************** some defines for transfer() */
 /* is socket/SSL open for read/write? */
 #define sock_rd (c->sock_rfd->rd)
 #define sock_wr (c->sock_wfd->wr)
 #define ssl_rd  (c->ssl_rfd->rd)
 #define ssl_wr  (c->ssl_wfd->wr)
-
-/* is socket/SSL ready for read/write? */
-#define sock_can_rd (s_poll_canread(&c->fds, c->sock_rfd->fd))
-#define sock_can_wr (s_poll_canwrite(&c->fds, c->sock_wfd->fd))
-#define ssl_can_rd  (s_poll_canread(&c->fds, c->ssl_rfd->fd))
-#define ssl_can_wr  (s_poll_canwrite(&c->fds, c->ssl_wfd->fd))
 /* NOTE: above defines are related to the logical data stream,
  * no longer to the underlying file descriptors */
 
@@ -495,127 +767,208 @@ static void init_ssl(CLI *c) {
 #define want_rd     (SSL_want_read(c->ssl))
 #define want_wr     (SSL_want_write(c->ssl))
 
+/* progress of c->ssl_closing */
+enum {CL_OPEN, CL_INIT, CL_RETRY, CL_CLOSED};
+
+/****************************** dynamic record sizing */
+/* records fitting in a single TCP segment until RECORD_BURST bytes
+ * were sent without RECORD_IDLE seconds of silence, then full records */
+#define RECORD_SMALL 1400
+#define RECORD_BURST 1048576
+#define RECORD_IDLE 1.0
+
 /****************************** transfer data */
-static void transfer(CLI *c) {
+/* bytes written in both directions before polling again, so that
+ * a bulk stream doesn't starve other connections of the same thread */
+#define TRANSFER_BUDGET (16*BUFFSIZE)
+
+    /* move the data until both directions are closed
+     * returns CLI_WAIT after each pass for s_poll_wait() on c->fds */
+static int transfer(CLI *c) {
+    int rc;
+
+    if(!c->resumed) { /* the first pass */
+        sock_rd=sock_wr=ssl_rd=ssl_wr=1;
+        c->ssl_closing=CL_OPEN;
+        c->watchdog=0; /* a counter to detect an infinite loop */
+        if(c->opt->record_size<BUFFSIZE) /* dynamic or a small limit */
+            record_nodelay(c);
+    } else {
+        rc=transfer_ready(c);
+        if(rc<=0) /* error or finished */
+            return rc;
+    }
+    transfer_fds(c);
+    return CLI_WAIT;
+}
+
+    /* set up c->fds and c->wait_timeout for the next pass */
+static void transfer_fds(CLI *c) {
+    /****************************** setup c->fds structure */
+    s_poll_zero(&c->fds); /* Initialize the structure */
+    if(sock_rd && c->sock_ptr<BUFFSIZE) /* socket input buffer not full*/
+        s_poll_add(&c->fds, c->sock_rfd->fd, 1, 0);
+    if((ssl_rd && c->ssl_ptr<BUFFSIZE) || /* SSL input buffer not full */
+            ((c->sock_ptr || c->ssl_closing==CL_RETRY) && want_rd))
+            /* want to SSL_write or SSL_shutdown but read from the
+             * underlying socket needed for the SSL protocol */
+        s_poll_add(&c->fds, c->ssl_rfd->fd, 1, 0);
+    if(c->ssl_ptr) /* SSL input buffer not empty */
+        s_poll_add(&c->fds, c->sock_wfd->fd, 0, 1);
+    if(c->sock_ptr || /* socket input buffer not empty */
+            c->ssl_closing==CL_INIT /* need to send close_notify */ ||
+            ((c->ssl_ptr<BUFFSIZE || c->ssl_closing==CL_RETRY) && want_wr))
+            /* want to SSL_read or SSL_shutdown but write to the
+             * underlying socket needed for the SSL protocol */
+        s_poll_add(&c->fds, c->ssl_wfd->fd, 0, 1);
+
+    /****************************** timeout of the wait */
+    c->wait_timeout=(sock_rd && ssl_rd) /* both peers open */ ||
+        c->ssl_ptr /* data buffered to write to socket */ ||
+        c->sock_ptr /* data buffered to write to SSL */ ?
+        c->opt->timeout_idle : c->opt->timeout_close;
+}
+
+    /* one pass over the descriptors reported by s_poll_wait()
+     * returns 1 to continue, 0 when finished or -1 on error */
+static int transfer_ready(CLI *c) {
     int num, err;
     int check_SSL_pending;
-    enum {CL_OPEN, CL_INIT, CL_RETRY, CL_CLOSED} ssl_closing=CL_OPEN;
-    int watchdog=0; /* a counter to detect an infinite loop */
-
-    c->sock_ptr=c->ssl_ptr=0;
-    sock_rd=sock_wr=ssl_rd=ssl_wr=1;
-
-    do { /* main loop */
-        /* set flag to try and read any buffered SSL data
-         * if we made room in the buffer by writing to the socket */
-        check_SSL_pending=0;
-
-        /****************************** setup c->fds structure */
-        s_poll_zero(&c->fds); /* Initialize the structure */
-        if(sock_rd && c->sock_ptr<BUFFSIZE) /* socket input buffer not full*/
-            s_poll_add(&c->fds, c->sock_rfd->fd, 1, 0);
-        if((ssl_rd && c->ssl_ptr<BUFFSIZE) || /* SSL input buffer not full */
-                ((c->sock_ptr || ssl_closing==CL_RETRY) && want_rd))
-                /* want to SSL_write or SSL_shutdown but read from the
-                 * underlying socket needed for the SSL protocol */
-            s_poll_add(&c->fds, c->ssl_rfd->fd, 1, 0);
-        if(c->ssl_ptr) /* SSL input buffer not empty */
-            s_poll_add(&c->fds, c->sock_wfd->fd, 0, 1);
-        if(c->sock_ptr || /* socket input buffer not empty */
-                ssl_closing==CL_INIT /* need to send close_notify */ ||
-                ((c->ssl_ptr<BUFFSIZE || ssl_closing==CL_RETRY) && want_wr))
-                /* want to SSL_read or SSL_shutdown but write to the
-                 * underlying socket needed for the SSL protocol */
-            s_poll_add(&c->fds, c->ssl_wfd->fd, 0, 1);
-
-        /****************************** wait for an event */
-        err=s_poll_wait(&c->fds, (sock_rd && ssl_rd) /* both peers open */ ||
-            c->ssl_ptr /* data buffered to write to socket */ ||
-            c->sock_ptr /* data buffered to write to SSL */ ?
-            c->opt->timeout_idle : c->opt->timeout_close);
-        switch(err) {
-        case -1:
-            sockerror("transfer: s_poll_wait");
-            longjmp(c->err, 1);
-        case 0: /* timeout */
-            if((sock_rd && ssl_rd) || c->ssl_ptr || c->sock_ptr) {
-                s_log(LOG_INFO, "s_poll_wait timeout: connection reset");
-                longjmp(c->err, 1);
-            } else { /* already closing connection */
-                s_log(LOG_INFO, "s_poll_wait timeout: connection close");
-                return; /* OK */
-            }
-        }
-        if(!(sock_can_rd || sock_can_wr || ssl_can_rd || ssl_can_wr)) {
-            s_log(LOG_ERR, "INTERNAL ERROR: "
-                "s_poll_wait returned %d, but no descriptor is ready", err);
-            longjmp(c->err, 1);
+    int sock_can_rd, sock_can_wr, ssl_can_rd, ssl_can_wr; /* ready? */
+    int progress, budget;
+
+    /* set flag to try and read any buffered SSL data
+     * if we made room in the buffer by writing to the socket */
+    check_SSL_pending=0;
+
+    switch(c->wait_result) {
+    case -1:
+        sockerror("transfer: s_poll_wait");
+        return -1;
+    case 0: /* timeout */
+        if((sock_rd && ssl_rd) || c->ssl_ptr || c->sock_ptr) {
+            s_log(LOG_INFO, "s_poll_wait timeout: connection reset");
+            c->stats.timeouts[TIMEOUT_IDLE]++;
+            return -1;
+        } else { /* already closing connection */
+            s_log(LOG_INFO, "s_poll_wait timeout: connection close");
+            c->stats.timeouts[TIMEOUT_CLOSE]++;
+            return 0; /* OK */
         }
+    }
+    sock_can_rd=s_poll_canread(&c->fds, c->sock_rfd->fd);
+    sock_can_wr=s_poll_canwrite(&c->fds, c->sock_wfd->fd);
+    ssl_can_rd=s_poll_canread(&c->fds, c->ssl_rfd->fd);
+    ssl_can_wr=s_poll_canwrite(&c->fds, c->ssl_wfd->fd);
+    if(!(sock_can_rd || sock_can_wr || ssl_can_rd || ssl_can_wr)) {
+        s_log(LOG_ERR, "INTERNAL ERROR: "
+            "s_poll_wait returned %d, but no descriptor is ready",
+            c->wait_result);
+        return -1;
+    }
 
-        /****************************** send SSL close_notify message */
-        if(ssl_closing==CL_INIT || (ssl_closing==CL_RETRY &&
-                ((want_rd && ssl_can_rd) || (want_wr && ssl_can_wr)))) {
-            switch(SSL_shutdown(c->ssl)) { /* Send close_notify */
-            case 1: /* the shutdown was successfully completed */
-                s_log(LOG_INFO, "SSL_shutdown successfully sent close_notify");
-                ssl_closing=CL_CLOSED; /* done! */
-                break;
-            case 0: /* the shutdown is not yet finished */
-                s_log(LOG_DEBUG, "SSL_shutdown retrying");
-                ssl_closing=CL_RETRY; /* retry next time */
-                break;
-            case -1: /* a fatal error occurred */
-                sslerror("SSL_shutdown");
-                longjmp(c->err, 1);
-            }
+    /****************************** send SSL close_notify message */
+    if(c->ssl_closing==CL_INIT || (c->ssl_closing==CL_RETRY &&
+            ((want_rd && ssl_can_rd) || (want_wr && ssl_can_wr)))) {
+        switch(SSL_shutdown(c->ssl)) { /* Send close_notify */
+        case 1: /* the shutdown was successfully completed */
+            s_log(LOG_INFO, "SSL_shutdown successfully sent close_notify");
+            c->ssl_closing=CL_CLOSED; /* done! */
+            break;
+        case 0: /* the shutdown is not yet finished */
+            s_log(LOG_DEBUG, "SSL_shutdown retrying");
+            c->ssl_closing=CL_RETRY; /* retry next time */
+            break;
+        case -1: /* a fatal error occurred */
+            sslerror("SSL_shutdown");
+            return -1;
         }
+    }
+
+    /****************************** drain the ready descriptors */
+    /* keep going until EAGAIN/WANT_* or no buffer space is left
+     * instead of paying a s_poll_wait() round trip per buffer */
+    budget=TRANSFER_BUDGET;
+    do {
+        progress=0;
 
         /****************************** write to socket */
-        if(sock_wr && sock_can_wr) {
+        if(sock_wr && sock_can_wr && c->ssl_ptr) {
             num=writesocket(c->sock_wfd->fd, c->ssl_buff, c->ssl_ptr);
             switch(num) {
             case -1: /* error */
-                parse_socket_error(c, "writesocket");
+                if(!would_block() && parse_socket_error(c, "writesocket"))
+                    return -1;
+                sock_can_wr=0; /* wait for s_poll_wait() */
                 break;
             case 0:
-                s_log(LOG_DEBUG, "No data written to the socket: retrying");
+                s_log(LOG_DEBUG,
+                    "No data written to the socket: retrying");
+                sock_can_wr=0;
                 break;
             default:
                 memmove(c->ssl_buff, c->ssl_buff+num, c->ssl_ptr-num);
-                if(c->ssl_ptr==BUFFSIZE) /* buffer was previously full */
-                    check_SSL_pending=1; /* check for data buffered by SSL */
+                if(c->ssl_ptr==BUFFSIZE) { /* buffer was previously full */
+                    check_SSL_pending=1; /* check data buffered by SSL */
+                    ssl_can_rd=1; /* not polled: try SSL_read() */
+                }
+                if(num<c->ssl_ptr) /* kernel send buffer is full */
+                    sock_can_wr=0;
                 c->ssl_ptr-=num;
                 c->sock_bytes+=num;
-                watchdog=0; /* reset watchdog */
+                c->stats.bytes_to_sock+=num;
+                budget-=num;
+                progress=1;
+                c->watchdog=0; /* reset c->watchdog */
             }
         }
 
         /****************************** write to SSL */
         if(ssl_wr && c->sock_ptr && ( /* output buffer not empty */
                 ssl_can_wr || (want_rd && ssl_can_rd)
-                /* SSL_write wants to read from the underlying descriptor */
+                /* SSL_write wants to read from the underlying fd */
                 )) {
-            num=SSL_write(c->ssl, c->sock_buff, c->sock_ptr);
+            if(!c->record_limit) /* a retry needs the same length */
+                c->record_limit=record_size(c);
+            num=SSL_write(c->ssl, c->sock_buff,
+                c->sock_ptr<c->record_limit ?
+                c->sock_ptr : c->record_limit);
             switch(err=SSL_get_error(c->ssl, num)) {
             case SSL_ERROR_NONE:
                 memmove(c->sock_buff, c->sock_buff+num, c->sock_ptr-num);
+                if(c->sock_ptr==BUFFSIZE) /* not polled: try to read */
+                    sock_can_rd=1;
                 c->sock_ptr-=num;
                 c->ssl_bytes+=num;
-                watchdog=0; /* reset watchdog */
+                c->stats.bytes_to_ssl+=num;
+                if(c->record_limit==RECORD_SMALL)
+                    c->stats.records_small++;
+                else
+                    c->stats.records_full++;
+                c->record_burst+=num;
+                c->record_limit=0;
+                budget-=num;
+                progress=1;
+                c->watchdog=0; /* reset c->watchdog */
                 break;
             case SSL_ERROR_WANT_WRITE:
-                s_log(LOG_DEBUG, "SSL_write returned WANT_WRITE: retrying");
+                s_log(LOG_DEBUG,
+                    "SSL_write returned WANT_WRITE: retrying");
+                ssl_can_wr=0;
                 break;
             case SSL_ERROR_WANT_READ:
-                s_log(LOG_DEBUG, "SSL_write returned WANT_READ: retrying");
+                s_log(LOG_DEBUG,
+                    "SSL_write returned WANT_READ: retrying");
+                ssl_can_rd=0;
                 break;
             case SSL_ERROR_WANT_X509_LOOKUP:
                 s_log(LOG_DEBUG,
                     "SSL_write returned WANT_X509_LOOKUP: retrying");
                 break;
             case SSL_ERROR_SYSCALL: /* really an error */
-                if(num)
-                    parse_socket_error(c, "SSL_write");
+                if(num && parse_socket_error(c, "SSL_write"))
+                    return -1;
+                ssl_can_wr=0;
                 break;
             case SSL_ERROR_ZERO_RETURN: /* close_notify received */
                 s_log(LOG_DEBUG, "SSL closed on SSL_write");
@@ -623,49 +976,65 @@ static void transfer(CLI *c) {
                 break;
             case SSL_ERROR_SSL:
                 sslerror("SSL_write");
-                longjmp(c->err, 1);
+                return -1;
             default:
-                s_log(LOG_ERR, "SSL_write/SSL_get_error returned %d", err);
-                longjmp(c->err, 1);
+                s_log(LOG_ERR,
+                    "SSL_write/SSL_get_error returned %d", err);
+                return -1;
             }
         }
 
         /****************************** read from socket */
-        if(sock_rd && sock_can_rd) {
+        if(sock_rd && sock_can_rd && c->sock_ptr<BUFFSIZE) {
             num=readsocket(c->sock_rfd->fd,
                 c->sock_buff+c->sock_ptr, BUFFSIZE-c->sock_ptr);
             switch(num) {
             case -1:
-                parse_socket_error(c, "readsocket");
+                if(!would_block() && parse_socket_error(c, "readsocket"))
+                    return -1;
+                sock_can_rd=0; /* wait for s_poll_wait() */
                 break;
             case 0: /* close */
                 s_log(LOG_DEBUG, "Socket closed on read");
                 sock_rd=0;
                 break;
             default:
+                if(num<BUFFSIZE-c->sock_ptr) /* receive queue drained */
+                    sock_can_rd=0;
+                if(!c->sock_ptr) /* not polled: try SSL_write() */
+                    ssl_can_wr=1;
                 c->sock_ptr+=num;
-                watchdog=0; /* reset watchdog */
+                progress=1;
+                c->watchdog=0; /* reset c->watchdog */
             }
         }
 
         /****************************** read from SSL */
         if(ssl_rd && c->ssl_ptr<BUFFSIZE  && ( /* input buffer not full */
                 ssl_can_rd || (want_wr && ssl_can_wr) ||
-                /* SSL_read wants to write to the underlying descriptor */
+                /* SSL_read wants to write to the underlying fd */
                 (check_SSL_pending && SSL_pending(c->ssl))
                 /* write made space from full buffer */
                 )) {
-            num=SSL_read(c->ssl, c->ssl_buff+c->ssl_ptr, BUFFSIZE-c->ssl_ptr);
+            num=SSL_read(c->ssl,
+                c->ssl_buff+c->ssl_ptr, BUFFSIZE-c->ssl_ptr);
             switch(err=SSL_get_error(c->ssl, num)) {
             case SSL_ERROR_NONE:
+                if(!c->ssl_ptr) /* not polled: try to write */
+                    sock_can_wr=1;
                 c->ssl_ptr+=num;
-                watchdog=0; /* reset watchdog */
+                progress=1;
+                c->watchdog=0; /* reset c->watchdog */
                 break;
             case SSL_ERROR_WANT_WRITE:
-                s_log(LOG_DEBUG, "SSL_read returned WANT_WRITE: retrying");
+                s_log(LOG_DEBUG,
+                    "SSL_read returned WANT_WRITE: retrying");
+                ssl_can_wr=0;
                 break;
             case SSL_ERROR_WANT_READ:
-                s_log(LOG_DEBUG, "SSL_read returned WANT_READ: retrying");
+                s_log(LOG_DEBUG,
+                    "SSL_read returned WANT_READ: retrying");
+                ssl_can_rd=0;
                 break;
             case SSL_ERROR_WANT_X509_LOOKUP:
                 s_log(LOG_DEBUG,
@@ -677,13 +1046,14 @@ static void transfer(CLI *c) {
                         s_log(LOG_ERR,
                             "SSL socket closed with %d byte(s) in buffer",
                             c->sock_ptr);
-                        longjmp(c->err, 1); /* reset the socket */
+                        return -1; /* reset the socket */
                     }
                     s_log(LOG_DEBUG, "SSL socket closed on SSL_read");
-                    ssl_rd=ssl_wr=0; /* buggy or SSLv2 peer: no close_notify */
-                    ssl_closing=CL_CLOSED; /* don't try to send it back */
-                } else
-                    parse_socket_error(c, "SSL_read");
+                    ssl_rd=ssl_wr=0; /* buggy or SSLv2 peer */
+                    c->ssl_closing=CL_CLOSED; /* no close_notify to send */
+                } else if(parse_socket_error(c, "SSL_read"))
+                    return -1;
+                ssl_can_rd=0;
                 break;
             case SSL_ERROR_ZERO_RETURN: /* close_notify received */
                 s_log(LOG_DEBUG, "SSL closed on SSL_read");
@@ -691,85 +1061,127 @@ static void transfer(CLI *c) {
                 break;
             case SSL_ERROR_SSL:
                 sslerror("SSL_read");
-                longjmp(c->err, 1);
+                return -1;
             default:
-                s_log(LOG_ERR, "SSL_read/SSL_get_error returned %d", err);
-                longjmp(c->err, 1);
+                s_log(LOG_ERR,
+                    "SSL_read/SSL_get_error returned %d", err);
+                return -1;
             }
         }
+    } while(progress && budget>0);
 
-        /****************************** check write shutdown conditions */
-        if(sock_wr && !ssl_rd && !c->ssl_ptr) {
-            s_log(LOG_DEBUG, "Socket write shutdown");
-            sock_wr=0; /* no further write allowed */
+    /****************************** check write shutdown conditions */
+    if(sock_wr && !ssl_rd && !c->ssl_ptr) {
+        s_log(LOG_DEBUG, "Socket write shutdown");
+        sock_wr=0; /* no further write allowed */
+        shutdown(c->sock_wfd->fd, SHUT_WR); /* send TCP FIN */
+    }
+    if(ssl_wr && (!sock_rd || SSL_get_shutdown(c->ssl)) && !c->sock_ptr) {
+        s_log(LOG_DEBUG, "SSL write shutdown");
+        ssl_wr=0; /* no further write allowed */
+        if(strcmp(SSL_get_version(c->ssl), "SSLv2")) { /* SSLv3, TLSv1 */
+            c->ssl_closing=CL_INIT; /* initiate close_notify */
+        } else { /* no alerts in SSLv2 including close_notify alert */
+            shutdown(c->sock_rfd->fd, SHUT_RD); /* notify the kernel */
             shutdown(c->sock_wfd->fd, SHUT_WR); /* send TCP FIN */
+            SSL_set_shutdown(c->ssl, /* notify the OpenSSL library */
+                SSL_SENT_SHUTDOWN|SSL_RECEIVED_SHUTDOWN);
+            ssl_rd=0; /* no further read allowed */
+            c->ssl_closing=CL_CLOSED; /* closed */
         }
-        if(ssl_wr && (!sock_rd || SSL_get_shutdown(c->ssl)) && !c->sock_ptr) {
-            s_log(LOG_DEBUG, "SSL write shutdown");
-            ssl_wr=0; /* no further write allowed */
-            if(strcmp(SSL_get_version(c->ssl), "SSLv2")) { /* SSLv3, TLSv1 */
-                ssl_closing=CL_INIT; /* initiate close_notify */
-            } else { /* no alerts in SSLv2 including close_notify alert */
-                shutdown(c->sock_rfd->fd, SHUT_RD); /* notify the kernel */
-                shutdown(c->sock_wfd->fd, SHUT_WR); /* send TCP FIN */
-                SSL_set_shutdown(c->ssl, /* notify the OpenSSL library */
-                    SSL_SENT_SHUTDOWN|SSL_RECEIVED_SHUTDOWN);
-                ssl_rd=0; /* no further read allowed */
-                ssl_closing=CL_CLOSED; /* closed */
-            }
+    }
+    if(c->ssl_closing==CL_RETRY) { /* SSL shutdown */
+        if(!want_rd && !want_wr) { /* close_notify alert was received */
+            s_log(LOG_DEBUG, "SSL doesn't need to read or write");
+            c->ssl_closing=CL_CLOSED;
         }
-        if(ssl_closing==CL_RETRY) { /* SSL shutdown */
-            if(!want_rd && !want_wr) { /* close_notify alert was received */
-                s_log(LOG_DEBUG, "SSL doesn't need to read or write");
-                ssl_closing=CL_CLOSED;
-            }
-            if(watchdog>5) {
-                s_log(LOG_NOTICE, "Too many retries on SSL shutdown");
-                ssl_closing=CL_CLOSED;
-            }
+        if(c->watchdog>5) {
+            s_log(LOG_NOTICE, "Too many retries on SSL shutdown");
+            c->ssl_closing=CL_CLOSED;
         }
+    }
 
-        /****************************** check watchdog */
-        if(++watchdog>100) { /* loop executes without transferring any data */
-            s_log(LOG_ERR,
-                "transfer() loop executes not transferring any data");
-            s_log(LOG_ERR,
-                "please report the problem to Michal.Trojnara@mirt.net");
-            s_log(LOG_ERR, "socket open: rd=%s wr=%s, ssl open: rd=%s wr=%s",
-                sock_rd ? "yes" : "no", sock_wr ? "yes" : "no",
-                ssl_rd ? "yes" : "no", ssl_wr ? "yes" : "no");
-            s_log(LOG_ERR, "socket ready: rd=%s wr=%s, ssl ready: rd=%s wr=%s",
-                sock_can_rd ? "yes" : "no", sock_can_wr ? "yes" : "no",
-                ssl_can_rd ? "yes" : "no", ssl_can_wr ? "yes" : "no");
-            s_log(LOG_ERR, "ssl want: rd=%s wr=%s",
-                want_rd ? "yes" : "no", want_wr ? "yes" : "no");
-            s_log(LOG_ERR, "socket input buffer: %d byte(s), "
-                "ssl input buffer: %d byte(s)", c->sock_ptr, c->ssl_ptr);
-            s_log(LOG_ERR, "check_SSL_pending=%d, ssl_closing=%d",
-                check_SSL_pending, ssl_closing);
-            longjmp(c->err, 1);
-        }
+    /****************************** publish byte counters */
+    if(c->stats.bytes_to_ssl+c->stats.bytes_to_sock>=STATS_FLUSH_BYTES)
+        stats_flush(c);
+
+    /****************************** check c->watchdog */
+    if(++c->watchdog>100) { /* loop executes without transferring any data */
+        s_log(LOG_ERR,
+            "transfer() loop executes not transferring any data");
+        s_log(LOG_ERR,
+            "please report the problem to Michal.Trojnara@mirt.net");
+        s_log(LOG_ERR, "socket open: rd=%s wr=%s, ssl open: rd=%s wr=%s",
+            sock_rd ? "yes" : "no", sock_wr ? "yes" : "no",
+            ssl_rd ? "yes" : "no", ssl_wr ? "yes" : "no");
+        s_log(LOG_ERR, "socket ready: rd=%s wr=%s, ssl ready: rd=%s wr=%s",
+            sock_can_rd ? "yes" : "no", sock_can_wr ? "yes" : "no",
+            ssl_can_rd ? "yes" : "no", ssl_can_wr ? "yes" : "no");
+        s_log(LOG_ERR, "ssl want: rd=%s wr=%s",
+            want_rd ? "yes" : "no", want_wr ? "yes" : "no");
+        s_log(LOG_ERR, "socket input buffer: %d byte(s), "
+            "ssl input buffer: %d byte(s)", c->sock_ptr, c->ssl_ptr);
+        s_log(LOG_ERR, "check_SSL_pending=%d, c->ssl_closing=%d",
+            check_SSL_pending, c->ssl_closing);
+        return -1;
+    }
+
+    return sock_wr || c->ssl_closing!=CL_CLOSED;
+}
+
+    /* maximum length of the next SSL_write() */
+static int record_size(CLI *c) {
+    double now;
+
+    if(c->opt->record_size) /* fixed */
+        return c->opt->record_size;
+    now=stats_time();
+    if(now-c->record_time>=RECORD_IDLE) /* latency matters again */
+        c->record_burst=0.0;
+    c->record_time=now;
+    return c->record_burst<RECORD_BURST ? RECORD_SMALL : BUFFSIZE;
+}
 
-    } while(sock_wr || ssl_closing!=CL_CLOSED);
+    /* with Nagle's algorithm each small record (or its decrypted data
+     * written to the socket) waits for the ACK of the previous one,
+     * which is delayed by the peer: send them at once on both sides */
+static void record_nodelay(CLI *c) {
+    int on=1, fd[2], i;
+
+    fd[0]=c->ssl_wfd->fd;
+    fd[1]=c->sock_wfd->fd;
+    for(i=0; i<2; i++)
+        if(setsockopt(fd[i], IPPROTO_TCP, TCP_NODELAY,
+                (void *)&on, sizeof on)) /* not a TCP socket */
+            s_log(LOG_DEBUG, "TCP_NODELAY not set on FD=%d", fd[i]);
 }
 
-static void parse_socket_error(CLI *c, const char *text) {
+    /* a descriptor retried in the drain loop of transfer() without being
+     * reported by s_poll_wait() is often not ready: no need to log it */
+static int would_block(void) {
+    int err=get_last_socket_error();
+
+    return err==EWOULDBLOCK || err==EAGAIN;
+}
+
+    /* returns 0 if the operation should be retried, -1 on fatal error */
+static int parse_socket_error(CLI *c, const char *text) {
     switch(get_last_socket_error()) {
     case EINTR:
         s_log(LOG_DEBUG, "%s interrupted by a signal: retrying", text);
-        return;
+        return 0;
     case EWOULDBLOCK:
         s_log(LOG_NOTICE, "%s would block: retrying", text);
         sleep(1); /* Microsoft bug KB177346 */
-        return;
+        return 0;
 #if EAGAIN!=EWOULDBLOCK
     case EAGAIN:
         s_log(LOG_DEBUG, "%s temporary lack of resources: retrying", text);
-        return;
+        return 0;
 #endif
     default:
         sockerror(text);
-        longjmp(c->err, 1);
+        return -1;
     }
 }
 
@@ -787,11 +1199,12 @@ static void print_cipher(CLI *c) { /* print negotiated cipher */
     len=strlen(buf);
     if(len>0)
         buf[len-1]='\0';
-    s_log(LOG_INFO, "Negotiated ciphers: %s", buf);
+    s_log(LOG_INFO, "Negotiated %s ciphers: %s",
+        SSL_get_version(c->ssl), buf);
 #endif
 }
 
-static void auth_libwrap(CLI *c) {
+static int auth_libwrap(CLI *c) {
 #ifdef USE_LIBWRAP
     struct request_info request;
     int fd[2];
@@ -799,17 +1212,20 @@ static void auth_libwrap(CLI *c) {
 
     if(pipe(fd)<0) {
         ioerror("pipe");
-        longjmp(c->err, 1);
+        return -1;
     }
     if(alloc_fd(fd[0]) || alloc_fd(fd[1]))
-        longjmp(c->err, 1);
+        return -1;
     switch(fork()) {
     case -1:    /* error */
         close(fd[0]);
         close(fd[1]);
         ioerror("fork");
-        longjmp(c->err, 1);
+        return -1;
     case  0:    /* child */
+#ifdef LOG_ASYNC
+        log_async_child();
+#endif
         close(fd[0]); /* read side */
         request_init(&request,
             RQ_DAEMON, c->opt->servname, RQ_FILE, c->local_rfd.fd, 0);
@@ -833,14 +1249,15 @@ static void auth_libwrap(CLI *c) {
         s_log(LOG_WARNING, "Connection from %s REFUSED by libwrap",
             c->accepting_address);
         s_log(LOG_DEBUG, "See hosts_access(5) manual for details");
-        longjmp(c->err, 1);
+        return -1;
     }
     s_log(LOG_DEBUG, "Connection from %s permitted by libwrap",
         c->accepting_address);
 #endif
+    return 0; /* OK */
 }
 
-static void auth_user(CLI *c) {
+static int auth_user(CLI *c) {
 #ifndef _WIN32_WCE
     struct servent *s_ent;    /* structure for getservbyname */
 #endif
@@ -849,14 +1266,14 @@ static void auth_user(CLI *c) {
     int error;
 
     if(!c->opt->username)
-        return; /* -u option not specified */
+        return 0; /* -u option not specified */
     if((c->fd=
             socket(c->peer_addr.addr[0].sa.sa_family, SOCK_STREAM, 0))<0) {
         sockerror("socket (auth_user)");
-        longjmp(c->err, 1);
+        return -1;
     }
     if(alloc_fd(c->fd))
-        longjmp(c->err, 1);
+        return -1;
     memcpy(&ident, &c->peer_addr.addr[0], sizeof(SOCKADDR_UNION));
 #ifndef _WIN32_WCE
     s_ent=getservbyname("auth", "tcp");
@@ -872,34 +1289,38 @@ static void auth_user(CLI *c) {
         error=get_last_socket_error();
         if(error!=EINPROGRESS && error!=EWOULDBLOCK) {
             sockerror("ident connect (auth_user)");
-            longjmp(c->err, 1);
+            return -1;
         }
-        connect_wait(c);
+        if(connect_wait(c))
+            return -1;
     }
     s_log(LOG_DEBUG, "IDENT server connected");
-    fdprintf(c, c->fd, "%u , %u",
-        ntohs(c->peer_addr.addr[0].in.sin_port),
-        ntohs(c->opt->local_addr.addr[0].in.sin_port));
+    if(fdprintf(c, c->fd, "%u , %u",
+            ntohs(c->peer_addr.addr[0].in.sin_port),
+            ntohs(c->opt->local_addr.addr[0].in.sin_port))<0)
+        return -1;
     if(fdscanf(c, c->fd, "%*[^:]: USERID :%*[^:]:%s", name)!=1) {
         s_log(LOG_ERR, "Incorrect data from IDENT server");
-        longjmp(c->err, 1);
+        return -1;
     }
     closesocket(c->fd);
+    if(c->line_fd==c->fd) /* the number may be reused */
+        c->line_fd=-1;
     c->fd=-1; /* avoid double close at cleanup */
     if(strcmp(name, c->opt->username)) {
         safestring(name);
         s_log(LOG_WARNING, "Connection from %s REFUSED by IDENT (user %s)",
             c->accepting_address, name);
-        longjmp(c->err, 1);
+        return -1;
     }
     s_log(LOG_INFO, "IDENT authentication passed");
+    return 0; /* OK */
 }
 
 static int connect_local(CLI *c) { /* spawn local process */
 #if defined (USE_WIN32) || defined (__vms)
     s_log(LOG_ERR, "LOCAL MODE NOT SUPPORTED ON WIN32 and OpenVMS PLATFORM");
-    longjmp(c->err, 1);
-    return -1; /* some C compilers require a return value */
+    return -1;
 #else /* USE_WIN32, __vms */
     char env[3][STRLEN], name[STRLEN], *portname;
     int fd[2], pid;
@@ -912,10 +1333,10 @@ static int connect_local(CLI *c) { /* spawn local process */
         char tty[STRLEN];
 
         if(pty_allocate(fd, fd+1, tty, STRLEN))
-            longjmp(c->err, 1);
+            return -1;
         s_log(LOG_DEBUG, "%s allocated", tty);
-    } else
-        make_sockets(c, fd);
+    } else if(make_sockets(c, fd))
+        return -1;
     pid=fork();
     c->pid=(unsigned long)pid;
     switch(pid) {
@@ -923,8 +1344,11 @@ static int connect_local(CLI *c) { /* spawn local process */
         closesocket(fd[0]);
         closesocket(fd[1]);
         ioerror("fork");
-        longjmp(c->err, 1);
+        return -1;
     case  0:    /* child */
+#ifdef LOG_ASYNC
+        log_async_child();
+#endif
         closesocket(fd[0]);
         dup2(fd[1], 0);
         dup2(fd[1], 1);
@@ -980,7 +1404,7 @@ static int connect_local(CLI *c) { /* spawn local process */
 
 #ifndef USE_WIN32
 
-static void make_sockets(CLI *c, int fd[2]) { /* make a pair of connected sockets */
+static int make_sockets(CLI *c, int fd[2]) { /* make a pair of connected sockets */
 #ifdef INET_SOCKET_PAIR
     SOCKADDR_UNION addr;
     socklen_t addrlen;
@@ -988,11 +1412,11 @@ static void make_sockets(CLI *c, int fd[2]) { /* make a pair of connected socket
 
     if((s=socket(AF_INET, SOCK_STREAM, 0))<0) {
         sockerror("socket#1");
-        longjmp(c->err, 1);
+        return -1;
     }
     if((fd[1]=socket(AF_INET, SOCK_STREAM, 0))<0) {
         sockerror("socket#2");
-        longjmp(c->err, 1);
+        return -1;
     }
     addrlen=sizeof(SOCKADDR_UNION);
     memset(&addr, 0, addrlen);
@@ -1005,35 +1429,48 @@ static void make_sockets(CLI *c, int fd[2]) { /* make a pair of connected socket
         log_error(LOG_DEBUG, get_last_socket_error(), "bind#2");
     if(listen(s, 5)) {
         sockerror("listen");
-        longjmp(c->err, 1);
+        return -1;
     }
     if(getsockname(s, &addr.sa, &addrlen)) {
         sockerror("getsockname");
-        longjmp(c->err, 1);
+        return -1;
     }
     if(connect(fd[1], &addr.sa, addrlen)) {
         sockerror("connect");
-        longjmp(c->err, 1);
+        return -1;
     }
     if((fd[0]=accept(s, &addr.sa, &addrlen))<0) {
         sockerror("accept");
-        longjmp(c->err, 1);
+        return -1;
     }
     closesocket(s); /* don't care about the result */
 #else
     if(socketpair(AF_UNIX, SOCK_STREAM, 0, fd)) {
         sockerror("socketpair");
-        longjmp(c->err, 1);
+        return -1;
     }
 #endif
+    return 0; /* OK */
 }
 #endif
 
-static int connect_remote(CLI *c) { /* connect to remote host */
+    /* connect to remote host and set c->remote_fd.fd
+     * returns CLI_WAIT while the non-blocking connect is in progress */
+static int connect_remote(CLI *c) {
     SOCKADDR_UNION bind_addr, addr;
     SOCKADDR_LIST resolved_list, *address_list;
-    int error, fd;
-    u16 i;
+    int error;
+    u16 i, n;
+
+    if(c->resumed) { /* s_poll_wait() returned for connect_fds() */
+        if(connect_result(c, c->wait_result)) {
+            c->stats.connect_failures[c->connect_index]++;
+            return -1;
+        }
+        c->remote_fd.fd=c->fd;
+        c->fd=-1;
+        return 0; /* success! */
+    }
 
     /* setup address_list */
     if(c->opt->option.delayed_lookup) {
@@ -1041,7 +1478,7 @@ static int connect_remote(CLI *c) { /* connect to remote host */
         if(!name2addrlist(&resolved_list,
                 c->opt->remote_address, DEFAULT_LOOPBACK)){
             s_log(LOG_ERR, "No host resolved");
-            longjmp(c->err, 1);
+            return -1;
         }
         address_list=&resolved_list;
     } else /* use pre-resolved addresses */
@@ -1049,6 +1486,7 @@ static int connect_remote(CLI *c) { /* connect to remote host */
 
     /* try to connect each host from the list */
     for(i=0; i<address_list->num; i++) {
+        n=c->opt->option.delayed_lookup ? 0 : address_list->cur;
         memcpy(&addr, address_list->addr + address_list->cur,
             sizeof(SOCKADDR_UNION));
         address_list->cur=(address_list->cur+1)%address_list->num;
@@ -1056,16 +1494,16 @@ static int connect_remote(CLI *c) { /* connect to remote host */
 
         if((c->fd=socket(addr.sa.sa_family, SOCK_STREAM, 0))<0) {
             sockerror("remote socket");
-            longjmp(c->err, 1);
+            return -1;
         }
         if(alloc_fd(c->fd))
-            longjmp(c->err, 1);
+            return -1;
 
         if(c->bind_addr.num) { /* explicit local bind or transparent proxy */
             memcpy(&bind_addr, &c->bind_addr.addr[0], sizeof(SOCKADDR_UNION));
             if(bind(c->fd, &bind_addr.sa, addr_len(bind_addr))<0) {
                 sockerror("bind transparent");
-                longjmp(c->err, 1);
+                return -1;
             }
         }
 
@@ -1074,45 +1512,54 @@ static int connect_remote(CLI *c) { /* connect to remote host */
         s_log(LOG_DEBUG, "%s connecting %s",
             c->opt->servname, c->connecting_address);
         if(!connect(c->fd, &addr.sa, addr_len(addr))) {
-            fd=c->fd;
+            c->remote_fd.fd=c->fd;
             c->fd=-1;
-            return fd; /* no error -> success (should not be possible) */
+            return 0; /* no error -> success (should not be possible) */
         }
         error=get_last_socket_error();
         if(error!=EINPROGRESS && error!=EWOULDBLOCK) {
             s_log(LOG_ERR, "remote connect (%s): %s (%d)",
                 c->connecting_address, my_strerror(error), error);
+            c->stats.connect_failures[n]++;
             closesocket(c->fd);
             c->fd=-1;
             continue; /* next IP */
         }
-        connect_wait(c);
-        fd=c->fd;
-        c->fd=-1;
-        return fd; /* success! */
+        c->connect_index=n;
+        connect_fds(c);
+        c->wait_timeout=c->opt->timeout_connect;
+        return CLI_WAIT; /* resumed above */
     }
-    longjmp(c->err, 1);
-    return -1; /* some C compilers require a return value */
+    return -1; /* no more addresses to try */
 }
 
     /* wait for the result of a non-blocking connect */
     /* file descriptor : c->fd                       */
     /* timeout         : c->opt->timeout_connect     */
-static void connect_wait(CLI *c) {
-    int error;
-    socklen_t optlen;
+static int connect_wait(CLI *c) {
+    connect_fds(c);
+    return connect_result(c, s_poll_wait(&c->fds, c->opt->timeout_connect));
+}
 
+static void connect_fds(CLI *c) {
     s_log(LOG_DEBUG, "connect_wait: waiting %d seconds",
         c->opt->timeout_connect);
     s_poll_zero(&c->fds);
     s_poll_add(&c->fds, c->fd, 1, 1);
-    switch(s_poll_wait(&c->fds, c->opt->timeout_connect)) {
+}
+
+static int connect_result(CLI *c, int result) {
+    int error;
+    socklen_t optlen;
+
+    switch(result) {
     case -1:
         sockerror("connect_wait: s_poll_wait");
-        longjmp(c->err, 1);
+        return -1;
     case 0:
         s_log(LOG_INFO, "connect_wait: s_poll_wait timeout");
-        longjmp(c->err, 1);
+        c->stats.timeouts[TIMEOUT_CONNECT]++;
+        return -1;
     default:
         if(s_poll_canread(&c->fds, c->fd)) {
             /* just connected socket should not be ready for read */
@@ -1122,19 +1569,32 @@ static void connect_wait(CLI *c) {
                 errno=error;
             if(errno) { /* really an error? */
                 sockerror("connect_wait: getsockopt");
-                longjmp(c->err, 1);
+                return -1;
             }
         }
         if(s_poll_canwrite(&c->fds, c->fd)) {
             s_log(LOG_DEBUG, "connect_wait: connected");
-            return; /* success */
+            return 0; /* success */
         }
         s_log(LOG_ERR, "connect_wait: unexpected s_poll_wait result");
-        longjmp(c->err, 1);
+        return -1;
     }
-    longjmp(c->err, 1); /* should not be possible */
 }
 
+#ifdef USE_UCONTEXT
+static void stack_sample(LOCAL_OPTIONS *opt) { /* per-service stack usage */
+    int used;
+
+    used=stack_usage();
+    if(used<=opt->stack_max)
+        return;
+    opt->stack_max=used;
+    s_log(used>UCONTEXT_STACK_SIZE/4*3 ? LOG_WARNING : LOG_DEBUG,
+        "%s: stack high-water mark %d bytes (%d%% of %d)", opt->servname,
+        used, (int)(used*100/UCONTEXT_STACK_SIZE), UCONTEXT_STACK_SIZE);
+}
+#endif
+
 static void reset(int fd, char *txt) {
     /* Set lingering on a socket if needed*/
     struct linger l;
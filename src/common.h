@@ -53,6 +53,13 @@ typedef int socklen_t;
 /* CPU stack size */
 #define STACK_SIZE 65536
 
+/* Virtual memory reserved for each ucontext stack */
+/* Pages are only committed when touched, so it can be generous */
+#define UCONTEXT_STACK_SIZE (1024*1024)
+
+/* How many released ucontext stacks to keep for reuse */
+#define STACK_POOL_SIZE 256
+
 /* I/O buffer size */
 #define BUFFSIZE        16384
 
@@ -79,8 +86,15 @@ typedef int socklen_t;
 
 /* threads model */
 #ifdef USE_UCONTEXT
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE      /* for sched_setaffinity */
+#endif
 #define __MAKECONTEXT_V2_SOURCE
 #include <ucontext.h>
+#ifndef USE_WIN32
+#include <sys/mman.h>    /* mmap for context stacks */
+#include <sched.h>       /* sched_setaffinity */
+#endif
 #endif
 
 #ifdef USE_PTHREAD
@@ -105,6 +119,7 @@ typedef int socklen_t;
 #include <stdarg.h>      /* va_ */
 #include <string.h>
 #include <ctype.h>       /* isalnum */
+#include <limits.h>      /* INT_MAX */
 #include <time.h>
 #include <sys/stat.h>    /* stat */
 #include <setjmp.h>
@@ -249,12 +264,20 @@ typedef unsigned long u32;
 #include <posix/grp.h>
 #endif
 #include <fcntl.h>
+#include <dirent.h>      /* opendir for CApath */
 
 #include <netinet/in.h>  /* struct sockaddr_in */
 #include <sys/socket.h>  /* getpeername */
+#include <sys/un.h>      /* struct sockaddr_un */
 #include <arpa/inet.h>   /* inet_ntoa */
 #include <sys/time.h>    /* select */
 #include <sys/ioctl.h>   /* ioctl */
+#ifndef __vms
+#include <sys/mman.h>    /* mmap */
+#ifndef MAP_FAILED
+#define MAP_FAILED       ((void *)-1)
+#endif
+#endif /* __vms */
 #include <netinet/tcp.h>
 #include <netdb.h>
 #ifndef INADDR_ANY
@@ -298,6 +321,28 @@ extern char *sys_errlist[];
 #ifdef HAVE_OSSL_ENGINE_H
 #include <openssl/engine.h>
 #endif
+#if SSLEAY_VERSION_NUMBER >= 0x00908080L && \
+    !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_TLSEXT)
+#define HAVE_OCSP_STAPLING
+#include <openssl/ocsp.h>
+#endif
+#if SSLEAY_VERSION_NUMBER >= 0x10101000L && defined(TLS1_3_VERSION)
+#define HAVE_EARLY_DATA
+#endif
+#if SSLEAY_VERSION_NUMBER < 0x10100000L
+/* the certificates to verify: the structure is opaque in OpenSSL 1.1.0 */
+#define X509_STORE_CTX_get0_cert(ctx) ((ctx)->cert)
+#define X509_STORE_CTX_get0_untrusted(ctx) ((ctx)->untrusted)
+/* revoked serial numbers and store lookups, also opaque in OpenSSL 1.1.0 */
+#define X509_REVOKED_get0_serialNumber(r) ((r)->serialNumber)
+#define X509_STORE_CTX_get_by_subject X509_STORE_get_by_subject
+#define X509_OBJECT_new() ((X509_OBJECT *)calloc(1, sizeof(X509_OBJECT)))
+#define X509_OBJECT_get0_X509(obj) ((obj)->data.x509)
+#define X509_OBJECT_free(obj) (X509_OBJECT_free_contents(obj), free(obj))
+#define X509_OBJECT_get0_X509_CRL(obj) ((obj)->data.crl)
+/* compression methods, also opaque in OpenSSL 1.1.0 */
+#define COMP_get_type(meth) ((meth)->type)
+#endif
 #else
 #include <lhash.h>
 #include <ssl.h>
@@ -305,6 +350,15 @@ extern char *sys_errlist[];
 #include <crypto.h> /* for CRYPTO_* and SSLeay_version */
 #endif
 
+/* forward secret AEAD suites first, then the library defaults */
+#define DEFAULT_CIPHER_LIST \
+    "ECDHE+AESGCM:ECDHE+CHACHA20:DHE+AESGCM:" SSL_DEFAULT_CIPHER_LIST ":!aNULL"
+#if SSLEAY_VERSION_NUMBER >= 0x10100000L
+#define DEFAULT_CURVES "X25519:P-256"
+#else
+#define DEFAULT_CURVES "P-256"
+#endif
+
 /**************************************** Other defines */
 
 /* Safe copy for strings declarated as char[STRLEN] */
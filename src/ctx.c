@@ -41,15 +41,117 @@
 #include "common.h"
 #include "prototypes.h"
 
+    /* CRLs from CRLfile are parsed once when the SSL context is created:
+     * one entry per issuer with its revoked serial numbers in a hash set */
+typedef struct crl_entry {
+    struct crl_entry *next;
+    X509_CRL *crl;
+    int verified; /* signature: 0 - not checked yet, 1 - valid, -1 - invalid */
+    unsigned int size; /* slots of the hash set (a power of 2) */
+    const ASN1_INTEGER **revoked; /* serial numbers owned by crl */
+} CRL_ENTRY;
+
+typedef struct {
+    CRL_ENTRY *entries; /* CRLfile */
+    X509_STORE *store; /* CRLpath, searched by OpenSSL on each lookup */
+} CRL_CACHE;
+
+    /* verification results of recently seen peer chains, so that
+     * reconnecting peers skip chain building and the hostname check
+     * the cache belongs to the SSL context and is dropped with it */
+#define VERIFY_CACHE_SIZE 1024 /* slots, a power of 2 */
+#define VERIFY_CACHE_TIME 3600 /* maximum age in seconds */
+#define VERIFY_SLOT(md) (((md)[0]|(md)[1]<<8)&(VERIFY_CACHE_SIZE-1))
+
+#if SSLEAY_VERSION_NUMBER >= 0x00908000L
+#define VERIFY_DIGEST EVP_sha256()
+#else
+#define VERIFY_DIGEST EVP_sha1()
+#endif
+
+typedef struct {
+    unsigned char digest[EVP_MAX_MD_SIZE]; /* of the peer chain */
+    unsigned int digest_len;
+    time_t timeout;
+    int error; /* X509_V_OK or the verification error */
+    char *hostname; /* last checked by post_connection_check() */
+    int hostname_ok;
+} VERIFY_ENTRY;
+
+typedef struct {
+    VERIFY_ENTRY *slot[VERIFY_CACHE_SIZE];
+} VERIFY_CACHE;
+
+    /* SHA-256 fingerprints from pinnedPeers in an open addressing set */
+#define PIN_LEN 32
+#define PIN_CERT 1
+#define PIN_PUBKEY 2
+#define PIN_SLOT(md) ((md)[0]|(md)[1]<<8|(md)[2]<<16)
+
+typedef struct {
+    int type; /* 0 - empty slot, PIN_CERT or PIN_PUBKEY */
+    unsigned char md[PIN_LEN];
+} PIN;
+
+typedef struct {
+    unsigned int size, num; /* slots (a power of 2) and fingerprints */
+    int pubkeys; /* public key fingerprints need another digest */
+    PIN *slot;
+} PIN_SET;
+
+    /* sections with the same TLS parameters share their SSL context */
+typedef struct ctx_shared {
+    struct ctx_shared *next;
+    char *key; /* made by context_key() */
+    unsigned long stamp; /* of the files when ctx was created */
+    SSL_CTX *ctx;
+    int refs; /* sections using ctx */
+} CTX_SHARED;
+
     /* SSL context initalization */
+static SSL_CTX *context_get(LOCAL_OPTIONS *, unsigned long);
+static char *context_key(LOCAL_OPTIONS *);
+static SSL_CTX *context_new(LOCAL_OPTIONS *);
+static int cert_init(SSL_CTX *, LOCAL_OPTIONS *, char *, char *);
+static unsigned long context_stamp(LOCAL_OPTIONS *);
 static int init_dh(void);
+static int new_session_cb(SSL *, SSL_SESSION *);
+static int version_init(SSL_CTX *, LOCAL_OPTIONS *);
+static int curves_init(SSL_CTX *, LOCAL_OPTIONS *);
 #ifndef NO_RSA
 static RSA *tmp_rsa_cb(SSL *, int, int);
 static RSA *make_temp_key(int);
 #endif /* NO_RSA */
-static void verify_init(SSL_CTX *, LOCAL_OPTIONS *);
+static int verify_init(SSL_CTX *, LOCAL_OPTIONS *);
+#ifndef USE_WIN32
+static int ca_dir_scan(char *, SSL_CTX *, unsigned long *);
+static int is_hash_name(char *);
+#endif
+static int crl_init(SSL_CTX *, LOCAL_OPTIONS *);
+static int crl_load(SSL_CTX *, CRL_CACHE *, char *);
+static CRL_ENTRY *crl_entry_new(X509_CRL *);
+static void crl_entry_verify(SSL_CTX *, CRL_ENTRY *);
+static void crl_entry_log(CRL_ENTRY *);
+static unsigned int serial_hash(const ASN1_INTEGER *);
+static void crl_cache_free(void *, void *, CRYPTO_EX_DATA *, int, long, void *);
+static int pin_init(SSL_CTX *, LOCAL_OPTIONS *);
+static int pin_parse(char *, unsigned char *);
+static int pin_add(PIN_SET *, int, unsigned char *);
+static int pin_find(PIN_SET *, int, unsigned char *);
+static int pin_check(X509_STORE_CTX *, PIN_SET *);
+static void pin_set_free(void *, void *, CRYPTO_EX_DATA *, int, long, void *);
+static int cert_verify_callback(X509_STORE_CTX *, void *);
+static int chain_digest(X509_STORE_CTX *, unsigned char *, unsigned int *);
+static int chain_current(X509_STORE_CTX *, SSL_CTX *);
+static VERIFY_ENTRY *verify_cache_find(CLI *);
+static void verify_cache_free(void *, void *, CRYPTO_EX_DATA *, int, long, void *);
 static int verify_callback(int, X509_STORE_CTX *);
-static int crl_callback(X509_STORE_CTX *);
+static int crl_callback(X509_STORE_CTX *, CRL_CACHE *);
+static CRL_ENTRY *crl_find(CRL_CACHE *, X509_NAME *);
+static int crl_revoked(CRL_ENTRY *, const ASN1_INTEGER *);
+static int crl_current(X509_STORE_CTX *, X509_CRL *);
+static int crl_store_check(X509_STORE_CTX *, X509_STORE *);
+static X509_OBJECT *crl_lookup(X509_STORE *, X509_NAME *);
 #if SSLEAY_VERSION_NUMBER >= 0x00907000L
 static void info_callback(const SSL *, int, int);
 #else
@@ -58,29 +160,175 @@ static void info_callback(SSL *, int, int);
 static void print_stats(SSL_CTX *);
 static void sslerror_stack(void);
 
-static X509_STORE *revocation_store=NULL;
+static CTX_SHARED *shared_contexts=NULL; /* CRIT_CTX */
+static int crl_index=-1; /* CRL cache of an SSL context */
+static int verify_index=-1; /* verification cache of an SSL context */
+static int pin_index=-1; /* pinned peers of an SSL context */
 
 SSL_CTX *context_init(LOCAL_OPTIONS *section) { /* init SSL context */
-    int i;
     SSL_CTX *ctx;
-    struct stat st; /* buffer for stat */
 
-    /* check if certificate exists */
     if(!section->key) /* key file not specified */
         section->key=section->cert;
-    if(section->option.cert) {
-        if(stat(section->key, &st)) {
-            ioerror(section->key);
-            exit(1);
+    if(!section->ecdsa_key)
+        section->ecdsa_key=section->ecdsa_cert;
+    section->ctx_stamp=context_stamp(section);
+    ctx=context_get(section, section->ctx_stamp);
+    if(!ctx)
+        exit(1);
+    return ctx;
+}
+
+    /* rebuild the SSL context if its files were modified
+     * new connections pick up the new context, established ones keep
+     * their reference to the old one until SSL_free() */
+void context_check(LOCAL_OPTIONS *section) {
+    SSL_CTX *ctx, *old_ctx;
+    unsigned long stamp;
+
+    stamp=context_stamp(section);
+    if(stamp==section->ctx_stamp)
+        return; /* not modified */
+    s_log(LOG_INFO, "Files of service %s modified: reloading",
+        section->servname);
+    ctx=context_get(section, stamp);
+    if(!ctx) { /* e.g. a certificate without its new key yet */
+        s_log(LOG_ERR, "Old SSL context of service %s kept",
+            section->servname);
+        return; /* retried on the next check */
+    }
+    section->ctx_stamp=stamp;
+    enter_critical_section(CRIT_CTX); /* see init_ssl() */
+    old_ctx=section->ctx;
+    section->ctx=ctx;
+    leave_critical_section(CRIT_CTX);
+    context_free(old_ctx);
+    s_log(LOG_NOTICE, "SSL context of service %s replaced",
+        section->servname);
+}
+
+    /* a new reference to the SSL context for the section, NULL on error
+     * only the main thread creates contexts, so CRIT_CTX is not held
+     * while context_new() reads the files */
+static SSL_CTX *context_get(LOCAL_OPTIONS *section, unsigned long stamp) {
+    CTX_SHARED *shared;
+    SSL_CTX *ctx=NULL;
+    char *key;
+
+    key=context_key(section);
+    if(!key) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        return NULL;
+    }
+    enter_critical_section(CRIT_CTX);
+    for(shared=shared_contexts; shared; shared=shared->next)
+        if(shared->stamp==stamp && !strcmp(shared->key, key)) {
+            shared->refs++;
+            ctx=shared->ctx;
+            break;
         }
-#ifndef USE_WIN32
-        if(st.st_mode & 7)
-            s_log(LOG_WARNING, "Wrong permissions on %s", section->key);
-#endif /* defined USE_WIN32 */
+    leave_critical_section(CRIT_CTX);
+    if(ctx) {
+        s_log(LOG_DEBUG, "SSL context shared with service %s",
+            section->servname);
+        free(key);
+        return ctx;
+    }
+    shared=calloc(1, sizeof(CTX_SHARED));
+    if(!shared) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        free(key);
+        return NULL;
+    }
+    ctx=context_new(section);
+    if(!ctx) {
+        free(shared);
+        free(key);
+        return NULL;
+    }
+    shared->key=key;
+    shared->stamp=stamp;
+    shared->ctx=ctx;
+    shared->refs=1;
+    enter_critical_section(CRIT_CTX);
+    shared->next=shared_contexts;
+    shared_contexts=shared;
+    leave_critical_section(CRIT_CTX);
+    return ctx;
+}
+
+    /* all the section options used by context_new() */
+static char *context_key(LOCAL_OPTIONS *section) {
+    char *field[12], *key;
+    size_t len;
+    int i;
+
+    field[0]=section->option.cert ? section->cert : NULL;
+    field[1]=section->option.cert ? section->key : NULL;
+    field[2]=section->ca_dir;
+    field[3]=section->ca_file;
+    field[4]=section->crl_dir;
+    field[5]=section->crl_file;
+    field[6]=section->pinned_file;
+    field[7]=section->cipher_list;
+    field[8]=section->ocsp_url;
+    field[9]=section->curves;
+    field[10]=section->ecdsa_cert;
+    field[11]=section->ecdsa_key;
+    len=STRLEN; /* the numbers */
+    for(i=0; i<12; i++)
+        len+=(field[i] ? strlen(field[i]) : 0)+1;
+    key=malloc(len);
+    if(!key)
+        return NULL;
+    sprintf(key, "%d %d %lx %ld %d %d %x %x\n", section->option.client,
+        section->option.early_data, section->ssl_options,
+        section->session_timeout, section->verify_level,
+        section->verify_use_only_my,
+        section->ssl_version_min, section->ssl_version_max);
+    for(i=0; i<12; i++) {
+        if(field[i])
+            strcat(key, field[i]);
+        strcat(key, "\n");
+    }
+    return key;
+}
+
+    /* modification stamp of the files read by context_new() */
+static unsigned long context_stamp(LOCAL_OPTIONS *section) {
+    char *file[7];
+    struct stat st;
+    unsigned long stamp;
+    int i;
+
+    file[0]=section->option.cert ? section->cert : NULL;
+    file[1]=section->option.cert ? section->key : NULL;
+    file[2]=section->ca_file;
+    file[3]=section->crl_file;
+    file[4]=section->pinned_file;
+    file[5]=section->ecdsa_cert;
+    file[6]=section->ecdsa_key;
+    stamp=0;
+    for(i=0; i<7; i++) {
+        stamp*=31;
+        if(file[i] && !stat(file[i], &st))
+            stamp+=(unsigned long)st.st_mtime^(unsigned long)st.st_size^
+                (unsigned long)st.st_ino<<16;
     }
-    /* create SSL context */
+#ifndef USE_WIN32
+    if(section->ca_dir)
+        ca_dir_scan(section->ca_dir, NULL, &stamp);
+#endif
+    return stamp;
+}
+
+    /* create a new SSL context, NULL on error */
+static SSL_CTX *context_new(LOCAL_OPTIONS *section) {
+    SSL_CTX *ctx;
+
+    /* create SSL context with the version-flexible methods */
     if(section->option.client) {
-        ctx=SSL_CTX_new(SSLv3_client_method());
+        ctx=SSL_CTX_new(SSLv23_client_method());
     } else { /* Server mode */
         ctx=SSL_CTX_new(SSLv23_server_method());
 #ifndef NO_RSA
@@ -95,6 +343,10 @@ SSL_CTX *context_init(LOCAL_OPTIONS *section) { /* init SSL context */
         s_log(LOG_DEBUG, "SSL options set: 0x%08lX", 
             SSL_CTX_set_options(ctx, section->ssl_options));
     }
+    if(version_init(ctx, section) || curves_init(ctx, section)) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
 #if SSLEAY_VERSION_NUMBER >= 0x00906000L
     SSL_CTX_set_mode(ctx,
         SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
@@ -102,54 +354,50 @@ SSL_CTX *context_init(LOCAL_OPTIONS *section) { /* init SSL context */
 
     SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_BOTH);
     SSL_CTX_set_timeout(ctx, section->session_timeout);
-    if(section->option.cert) {
-        if(!SSL_CTX_use_certificate_chain_file(ctx, section->cert)) {
-            s_log(LOG_ERR, "Error reading certificate file: %s", section->cert);
-            sslerror("SSL_CTX_use_certificate_chain_file");
-            exit(1);
-        }
-        s_log(LOG_DEBUG, "Certificate: %s", section->cert);
-        s_log(LOG_DEBUG, "Key file: %s", section->key);
-#ifdef USE_WIN32
-        SSL_CTX_set_default_passwd_cb(ctx, pem_passwd_cb);
-        SSL_CTX_set_default_passwd_cb_userdata(ctx, section);
+    if(section->option.client)
+        SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+#ifdef HAVE_EARLY_DATA
+    else if(section->option.early_data) /* replays detected in the cache */
+        SSL_CTX_set_max_early_data(ctx, BUFFSIZE);
+#endif
+    /* OpenSSL keeps one certificate for each key type
+     * and selects it with the cipher or signature algorithm of the peer */
+    if((section->option.cert &&
+            cert_init(ctx, section, section->cert, section->key)) ||
+            (section->ecdsa_cert && cert_init(ctx, section,
+            section->ecdsa_cert, section->ecdsa_key))) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    if(section->ecdsa_cert && !section->option.client) {
+        /* the default ciphers and signature algorithms list ECDSA first */
+        SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_PRIORITIZE_CHACHA
+        SSL_CTX_set_options(ctx, SSL_OP_PRIORITIZE_CHACHA);
 #endif
-        for(i=0; i<3; i++) {
-#ifdef NO_RSA
-            if(SSL_CTX_use_PrivateKey_file(ctx, section->key,
-                    SSL_FILETYPE_PEM))
-#else /* NO_RSA */
-            if(SSL_CTX_use_RSAPrivateKey_file(ctx, section->key,
-                    SSL_FILETYPE_PEM))
-#endif /* NO_RSA */
-                break;
-            if(i<2 && ERR_GET_REASON(ERR_peek_error())==EVP_R_BAD_DECRYPT) {
-                sslerror_stack(); /* dump the error stack */
-                s_log(LOG_ERR, "Wrong pass phrase: retrying");
-                continue;
-            }
-#ifdef NO_RSA
-            sslerror("SSL_CTX_use_PrivateKey_file");
-#else /* NO_RSA */
-            sslerror("SSL_CTX_use_RSAPrivateKey_file");
-#endif /* NO_RSA */
-            exit(1);
-        }
-        if(!SSL_CTX_check_private_key(ctx)) {
-            sslerror("Private key does not match the certificate");
-            exit(1);
-        }
     }
 
     /* Initialize certificate verification */
-    verify_init(ctx, section);
+    if(verify_init(ctx, section)) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+#ifdef HAVE_OCSP_STAPLING
+    if(!section->option.client && section->ocsp_url &&
+            ocsp_init(ctx, section)) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+#endif
 
     SSL_CTX_set_info_callback(ctx, info_callback);
 
     if(section->cipher_list) {
         if (!SSL_CTX_set_cipher_list(ctx, section->cipher_list)) {
             sslerror("SSL_CTX_set_cipher_list");
-            exit(1);
+            SSL_CTX_free(ctx);
+            return NULL;
         }
     }
     s_log(LOG_DEBUG, "SSL context initialized for service %s",
@@ -157,7 +405,69 @@ SSL_CTX *context_init(LOCAL_OPTIONS *section) { /* init SSL context */
     return ctx;
 }
 
-void context_free(SSL_CTX *ctx) { /* free SSL */
+    /* load a certificate chain and its private key */
+static int cert_init(SSL_CTX *ctx, LOCAL_OPTIONS *section,
+        char *cert, char *key) {
+    int i;
+    struct stat st; /* buffer for stat */
+
+    /* check if certificate exists */
+    if(stat(key, &st)) {
+        ioerror(key);
+        return -1;
+    }
+#ifndef USE_WIN32
+    if(st.st_mode & 7)
+        s_log(LOG_WARNING, "Wrong permissions on %s", key);
+#endif /* defined USE_WIN32 */
+    if(!SSL_CTX_use_certificate_chain_file(ctx, cert)) {
+        s_log(LOG_ERR, "Error reading certificate file: %s", cert);
+        sslerror("SSL_CTX_use_certificate_chain_file");
+        return -1;
+    }
+    s_log(LOG_DEBUG, "Certificate: %s", cert);
+    s_log(LOG_DEBUG, "Key file: %s", key);
+#ifdef USE_WIN32
+    SSL_CTX_set_default_passwd_cb(ctx, pem_passwd_cb);
+    SSL_CTX_set_default_passwd_cb_userdata(ctx, section);
+#endif
+    for(i=0; i<3; i++) {
+        if(SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM))
+            break;
+        if(i<2 && ERR_GET_REASON(ERR_peek_error())==EVP_R_BAD_DECRYPT) {
+            sslerror_stack(); /* dump the error stack */
+            s_log(LOG_ERR, "Wrong pass phrase: retrying");
+            continue;
+        }
+        sslerror("SSL_CTX_use_PrivateKey_file");
+        return -1;
+    }
+    if(!SSL_CTX_check_private_key(ctx)) {
+        sslerror("Private key does not match the certificate");
+        return -1;
+    }
+    return 0; /* OK */
+}
+
+void context_free(SSL_CTX *ctx) { /* release a reference */
+    CTX_SHARED **ptr, *shared=NULL;
+
+    enter_critical_section(CRIT_CTX);
+    for(ptr=&shared_contexts; *ptr; ptr=&(*ptr)->next)
+        if((*ptr)->ctx==ctx) {
+            if(--(*ptr)->refs) { /* still used by another section */
+                leave_critical_section(CRIT_CTX);
+                return;
+            }
+            shared=*ptr;
+            *ptr=shared->next;
+            break;
+        }
+    leave_critical_section(CRIT_CTX);
+    if(shared) {
+        free(shared->key);
+        free(shared);
+    }
     SSL_CTX_free(ctx);
 }
 
@@ -203,6 +513,121 @@ static int init_dh(void) {
     return 0; /* OK */
 }
 
+    /* keep the last session of a client section for resumption
+     * TLS 1.3 tickets only arrive after the handshake is finished */
+static int new_session_cb(SSL *ssl, SSL_SESSION *sess) {
+    CLI *c;
+    SSL_SESSION *old_session;
+
+    c=SSL_get_ex_data(ssl, cli_index);
+    enter_critical_section(CRIT_SESSION);
+    old_session=c->opt->session;
+    c->opt->session=sess; /* store it */
+    leave_critical_section(CRIT_SESSION);
+    if(old_session)
+        SSL_SESSION_free(old_session); /* release the old one */
+    return 1; /* the reference was taken */
+}
+
+    /* limit the versions negotiated by the version-flexible method */
+static int version_init(SSL_CTX *ctx, LOCAL_OPTIONS *section) {
+#if SSLEAY_VERSION_NUMBER < 0x10100000L
+    static struct {
+        int version;
+        long option;
+    } no_version[]={
+        {SSL2_VERSION, SSL_OP_NO_SSLv2},
+        {SSL3_VERSION, SSL_OP_NO_SSLv3},
+        {TLS1_VERSION, SSL_OP_NO_TLSv1},
+#ifdef SSL_OP_NO_TLSv1_1
+        {0x0302, SSL_OP_NO_TLSv1_1},
+#endif
+#ifdef SSL_OP_NO_TLSv1_2
+        {0x0303, SSL_OP_NO_TLSv1_2},
+#endif
+        {0, 0}
+    };
+    int i, enabled=0;
+#endif /* OpenSSL-1.1.0 */
+
+    if(section->ssl_version_max &&
+            section->ssl_version_min>section->ssl_version_max) {
+        s_log(LOG_ERR, "sslVersionMin is higher than sslVersionMax");
+        return -1; /* FAILED */
+    }
+#if SSLEAY_VERSION_NUMBER >= 0x10100000L
+    if(section->ssl_version_min &&
+            !SSL_CTX_set_min_proto_version(ctx, section->ssl_version_min)) {
+        sslerror("SSL_CTX_set_min_proto_version");
+        return -1; /* FAILED */
+    }
+    if(section->ssl_version_max &&
+            !SSL_CTX_set_max_proto_version(ctx, section->ssl_version_max)) {
+        sslerror("SSL_CTX_set_max_proto_version");
+        return -1; /* FAILED */
+    }
+#else /* OpenSSL-1.1.0 */
+    for(i=0; no_version[i].version; i++)
+        if(no_version[i].version<section->ssl_version_min ||
+                (section->ssl_version_max &&
+                no_version[i].version>section->ssl_version_max))
+            SSL_CTX_set_options(ctx, no_version[i].option);
+        else
+            enabled++;
+    if(!enabled) {
+        s_log(LOG_ERR, "No SSL protocol version supported by the library"
+            " is enabled");
+        return -1; /* FAILED */
+    }
+#endif /* OpenSSL-1.1.0 */
+    return 0; /* OK */
+}
+
+    /* groups offered for ECDHE key exchange */
+static int curves_init(SSL_CTX *ctx, LOCAL_OPTIONS *section) {
+#if SSLEAY_VERSION_NUMBER >= 0x10002000L
+    if(section->curves && !SSL_CTX_set1_curves_list(ctx, section->curves)) {
+        s_log(LOG_ERR, "Invalid curves: %s", section->curves);
+        sslerror("SSL_CTX_set1_curves_list");
+        return -1; /* FAILED */
+    }
+#if SSLEAY_VERSION_NUMBER < 0x10100000L
+    SSL_CTX_set_ecdh_auto(ctx, 1); /* always enabled since OpenSSL-1.1.0 */
+#endif
+    if(section->curves)
+        s_log(LOG_DEBUG, "ECDHE curves: %s", section->curves);
+#elif SSLEAY_VERSION_NUMBER >= 0x0090800fL && !defined(OPENSSL_NO_ECDH)
+    char name[STRLEN];
+    EC_KEY *ecdh;
+    int nid;
+
+    /* older servers can only use the first curve of the list */
+    if(section->option.client || !section->curves)
+        return 0; /* OK */
+    safecopy(name, section->curves);
+    name[strcspn(name, ":")]='\0';
+    if(!strcmp(name, "P-256"))
+        nid=NID_X9_62_prime256v1;
+    else if(!strcmp(name, "P-384"))
+        nid=NID_secp384r1;
+    else if(!strcmp(name, "P-521"))
+        nid=NID_secp521r1;
+    else
+        nid=OBJ_sn2nid(name);
+    ecdh=nid==NID_undef ? NULL : EC_KEY_new_by_curve_name(nid);
+    if(!ecdh) {
+        s_log(LOG_ERR, "Unsupported curve: %s", name);
+        sslerror("EC_KEY_new_by_curve_name");
+        return -1; /* FAILED */
+    }
+    SSL_CTX_set_tmp_ecdh(ctx, ecdh);
+    EC_KEY_free(ecdh);
+    SSL_CTX_set_options(ctx, SSL_OP_SINGLE_ECDH_USE);
+    s_log(LOG_DEBUG, "ECDHE initialized with curve %s", name);
+#endif /* OpenSSL-1.0.2 */
+    return 0; /* OK */
+}
+
 #ifndef NO_RSA
 
 static RSA *tmp_rsa_cb(SSL *s, int export, int keylen) {
@@ -266,16 +691,21 @@ static RSA *make_temp_key(int keylen) {
 
 #endif /* NO_RSA */
 
-static void verify_init(SSL_CTX *ctx, LOCAL_OPTIONS *section) {
-    X509_LOOKUP *lookup;
+static int verify_init(SSL_CTX *ctx, LOCAL_OPTIONS *section) {
+#ifndef USE_WIN32
+    int num;
+#endif
+
+    if(section->pinned_file) /* no certificate chains are verified */
+        return pin_init(ctx, section);
 
     if(section->verify_level<0)
-        return; /* No certificate verification */
+        return 0; /* No certificate verification */
 
     if(section->verify_level>1 && !section->ca_file && !section->ca_dir) {
         s_log(LOG_ERR, "Either CApath or CAfile "
             "has to be used for authentication");
-        exit(1);
+        return -1;
     }
 
     if(section->ca_file) {
@@ -283,7 +713,7 @@ static void verify_init(SSL_CTX *ctx, LOCAL_OPTIONS *section) {
             s_log(LOG_ERR, "Error loading verify certificates from %s",
                 section->ca_file);
             sslerror("SSL_CTX_load_verify_locations");
-            exit(1);
+            return -1;
         }
 #if 0
         SSL_CTX_set_client_CA_list(ctx,
@@ -294,108 +724,813 @@ static void verify_init(SSL_CTX *ctx, LOCAL_OPTIONS *section) {
     }
 
     if(section->ca_dir) {
+#ifdef USE_WIN32
         if(!SSL_CTX_load_verify_locations(ctx, NULL, section->ca_dir)) {
             s_log(LOG_ERR, "Error setting verify directory to %s",
                 section->ca_dir);
             sslerror("SSL_CTX_load_verify_locations");
-            exit(1);
+            return -1;
         }
         s_log(LOG_DEBUG, "Verify directory set to %s", section->ca_dir);
+#else
+        /* loaded into memory: handshakes never search the directory */
+        num=ca_dir_scan(section->ca_dir, ctx, NULL);
+        if(num<0) {
+            s_log(LOG_ERR, "Error loading verify directory %s",
+                section->ca_dir);
+            return -1;
+        }
+        s_log(LOG_DEBUG, "Loaded %d verify certificate file(s) from %s",
+            num, section->ca_dir);
+#endif
+    }
+
+    if((section->crl_file || section->crl_dir) && crl_init(ctx, section))
+        return -1;
+
+    SSL_CTX_set_verify(ctx, section->verify_level==SSL_VERIFY_NONE ?
+        SSL_VERIFY_PEER : section->verify_level, verify_callback);
+#if SSLEAY_VERSION_NUMBER >= 0x00907000L
+    if(verify_index<0) /* freed together with its SSL context */
+        verify_index=SSL_CTX_get_ex_new_index(0, "verify cache",
+            NULL, NULL, verify_cache_free);
+    SSL_CTX_set_ex_data(ctx, verify_index, calloc(1, sizeof(VERIFY_CACHE)));
+    SSL_CTX_set_cert_verify_callback(ctx, cert_verify_callback, NULL);
+#endif
+
+    if(section->ca_dir && section->verify_use_only_my)
+        s_log(LOG_NOTICE, "Peer certificate location %s", section->ca_dir);
+    return 0; /* OK */
+}
+
+#ifndef USE_WIN32
+
+    /* load the hashed certificates of CApath into the SSL context, or
+     * only add their modification stamps to *stamp if ctx is NULL
+     * returns the number of files loaded or -1 on error */
+static int ca_dir_scan(char *dir, SSL_CTX *ctx, unsigned long *stamp) {
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    char path[PATH_MAX];
+    int num=0, len;
+
+    d=opendir(dir);
+    if(!d) {
+        if(ctx)
+            ioerror(dir);
+        return -1;
+    }
+    while((de=readdir(d))) {
+        if(!is_hash_name(de->d_name))
+            continue;
+        len=snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+        if(len<0 || len>=(int)sizeof path) /* truncated: not our file */
+            continue;
+        if(!ctx) {
+            if(!stat(path, &st))
+                *stamp+=(unsigned long)st.st_mtime^(unsigned long)st.st_size^
+                    (unsigned long)st.st_ino<<16;
+        } else if(SSL_CTX_load_verify_locations(ctx, path, NULL)) {
+            num++;
+        } else { /* e.g. the same certificate under two names */
+            s_log(LOG_WARNING, "Error loading verify certificates from %s",
+                path);
+            ERR_clear_error();
+        }
     }
+    closedir(d);
+    return num;
+}
+
+    /* <8 hex digits of the subject hash>.<number>, as made by c_rehash */
+static int is_hash_name(char *name) {
+    int i;
+
+    for(i=0; i<8; i++)
+        if(!isxdigit((unsigned char)name[i]))
+            return 0;
+    if(name[8]!='.' || !isdigit((unsigned char)name[9]))
+        return 0;
+    for(i=10; name[i]; i++)
+        if(!isdigit((unsigned char)name[i]))
+            return 0;
+    return 1;
+}
 
-    if(section->crl_file || section->crl_dir) { /* setup CRL store */
-        revocation_store=X509_STORE_new();
-        if(!revocation_store) {
+#endif /* !defined USE_WIN32 */
+
+static int crl_init(SSL_CTX *ctx, LOCAL_OPTIONS *section) {
+    CRL_CACHE *cache;
+    X509_LOOKUP *lookup;
+
+    if(crl_index<0) /* freed together with its SSL context */
+        crl_index=SSL_CTX_get_ex_new_index(0, "crl cache",
+            NULL, NULL, crl_cache_free);
+    cache=calloc(1, sizeof(CRL_CACHE));
+    if(!cache) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    SSL_CTX_set_ex_data(ctx, crl_index, cache);
+    if(section->crl_file) {
+        if(crl_load(ctx, cache, section->crl_file))
+            return -1;
+        s_log(LOG_DEBUG, "Loaded CRLs from %s", section->crl_file);
+    }
+    if(section->crl_dir) {
+        cache->store=X509_STORE_new();
+        if(!cache->store) {
             sslerror("X509_STORE_new");
-            exit(1);
+            return -1;
         }
-        if(section->crl_file) {
-            lookup=X509_STORE_add_lookup(revocation_store,
-                X509_LOOKUP_file());
-            if(!lookup) {
-                sslerror("X509_STORE_add_lookup");
-                exit(1);
-            }
-            if(!X509_LOOKUP_load_file(lookup, section->crl_file,
-                    X509_FILETYPE_PEM)) {
-                s_log(LOG_ERR, "Error loading CRLs from %s",
-                    section->crl_file);
-                sslerror("X509_LOOKUP_load_file");
-                exit(1);
-            }
-            s_log(LOG_DEBUG, "Loaded CRLs from %s", section->crl_file);
+        lookup=X509_STORE_add_lookup(cache->store, X509_LOOKUP_hash_dir());
+        if(!lookup) {
+            sslerror("X509_STORE_add_lookup");
+            return -1;
         }
-        if(section->crl_dir) {
-            lookup=X509_STORE_add_lookup(revocation_store,
-                X509_LOOKUP_hash_dir());
-            if(!lookup) {
-                sslerror("X509_STORE_add_lookup");
-                exit(1);
-            }
-            if(!X509_LOOKUP_add_dir(lookup, section->crl_dir,
-                    X509_FILETYPE_PEM)) {
-                s_log(LOG_ERR, "Error setting CRL directory to %s",
-                    section->crl_dir);
-                sslerror("X509_LOOKUP_add_dir");
-                exit(1);
-            }
-            s_log(LOG_DEBUG, "CRL directory set to %s", section->crl_dir);
+        if(!X509_LOOKUP_add_dir(lookup, section->crl_dir,
+                X509_FILETYPE_PEM)) {
+            s_log(LOG_ERR, "Error setting CRL directory to %s",
+                section->crl_dir);
+            sslerror("X509_LOOKUP_add_dir");
+            return -1;
         }
+        s_log(LOG_DEBUG, "CRL directory set to %s", section->crl_dir);
     }
+    return 0; /* OK */
+}
 
-    SSL_CTX_set_verify(ctx, section->verify_level==SSL_VERIFY_NONE ?
-        SSL_VERIFY_PEER : section->verify_level, verify_callback);
+static int crl_load(SSL_CTX *ctx, CRL_CACHE *cache, char *file) {
+    BIO *bio;
+    X509_CRL *crl;
+    CRL_ENTRY *entry;
 
-    if(section->ca_dir && section->verify_use_only_my)
-        s_log(LOG_NOTICE, "Peer certificate location %s", section->ca_dir);
+    bio=BIO_new_file(file, "r");
+    if(!bio) {
+        s_log(LOG_ERR, "Error loading CRLs from %s", file);
+        sslerror("BIO_new_file");
+        return -1;
+    }
+    while((crl=PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL))) {
+        if(crl_find(cache, X509_CRL_get_issuer(crl))) {
+            s_log(LOG_WARNING, "Ignored another CRL of the same issuer");
+            X509_CRL_free(crl);
+            continue;
+        }
+        entry=crl_entry_new(crl);
+        if(!entry) {
+            s_log(LOG_ERR, "Memory allocation failed");
+            X509_CRL_free(crl);
+            BIO_free(bio);
+            return -1;
+        }
+        entry->next=cache->entries;
+        cache->entries=entry;
+        crl_entry_verify(ctx, entry);
+        crl_entry_log(entry);
+    }
+    BIO_free(bio);
+    if(ERR_GET_REASON(ERR_peek_last_error())!=PEM_R_NO_START_LINE) {
+        s_log(LOG_ERR, "Error loading CRLs from %s", file);
+        sslerror("PEM_read_bio_X509_CRL");
+        return -1;
+    }
+    ERR_clear_error(); /* end of file */
+    return 0; /* OK */
+}
+
+static CRL_ENTRY *crl_entry_new(X509_CRL *crl) {
+    CRL_ENTRY *entry;
+    X509_REVOKED *revoked;
+    const ASN1_INTEGER *serial;
+    unsigned int i, n, slot;
+
+#if SSLEAY_VERSION_NUMBER >= 0x00904000
+    n=sk_X509_REVOKED_num(X509_CRL_get_REVOKED(crl));
+#else
+    n=sk_num(X509_CRL_get_REVOKED(crl));
+#endif
+    entry=calloc(1, sizeof(CRL_ENTRY));
+    if(!entry)
+        return NULL;
+    /* at most half full to keep the probe sequences short */
+    for(entry->size=16; entry->size<2*n; entry->size*=2)
+        ;
+    entry->revoked=calloc(entry->size, sizeof(const ASN1_INTEGER *));
+    if(!entry->revoked) {
+        free(entry);
+        return NULL;
+    }
+    entry->crl=crl;
+    for(i=0; i<n; i++) {
+#if SSLEAY_VERSION_NUMBER >= 0x00904000
+        revoked=sk_X509_REVOKED_value(X509_CRL_get_REVOKED(crl), i);
+#else
+        revoked=(X509_REVOKED *)sk_value(X509_CRL_get_REVOKED(crl), i);
+#endif
+        serial=X509_REVOKED_get0_serialNumber(revoked);
+        slot=serial_hash(serial)&(entry->size-1);
+        while(entry->revoked[slot]) /* linear probing */
+            slot=(slot+1)&(entry->size-1);
+        entry->revoked[slot]=serial;
+    }
+    return entry;
+}
+
+    /* check the signature with the issuer from CAfile or CApath
+     * issuers not found there are checked with the peer chain */
+static void crl_entry_verify(SSL_CTX *ctx, CRL_ENTRY *entry) {
+    X509_STORE_CTX *store_ctx; /* both opaque in OpenSSL 1.1.0 */
+    X509_OBJECT *obj;
+    EVP_PKEY *pubkey;
+    int rc;
+
+    store_ctx=X509_STORE_CTX_new();
+    if(!store_ctx)
+        return;
+    obj=X509_OBJECT_new();
+    if(!obj) {
+        X509_STORE_CTX_free(store_ctx);
+        return;
+    }
+    X509_STORE_CTX_init(store_ctx, SSL_CTX_get_cert_store(ctx), NULL, NULL);
+    rc=X509_STORE_CTX_get_by_subject(store_ctx, X509_LU_X509,
+        X509_CRL_get_issuer(entry->crl), obj);
+    X509_STORE_CTX_free(store_ctx);
+    if(rc<=0 || !X509_OBJECT_get0_X509(obj)) {
+        X509_OBJECT_free(obj);
+        return;
+    }
+    pubkey=X509_get_pubkey(X509_OBJECT_get0_X509(obj));
+    entry->verified=pubkey && X509_CRL_verify(entry->crl, pubkey)>0 ? 1 : -1;
+    if(pubkey)
+        EVP_PKEY_free(pubkey);
+    X509_OBJECT_free(obj);
+    if(entry->verified<0)
+        s_log(LOG_WARNING, "Invalid signature on CRL");
+}
+
+static void crl_entry_log(CRL_ENTRY *entry) {
+    BIO *bio;
+    int n;
+    char *cp;
+    char *cp2;
+
+    /* Log information about CRL
+     * (A little bit complicated because of ASN.1 and BIOs...) */
+    bio=BIO_new(BIO_s_mem());
+    BIO_printf(bio, "lastUpdate: ");
+    ASN1_UTCTIME_print(bio, X509_CRL_get_lastUpdate(entry->crl));
+    BIO_printf(bio, ", nextUpdate: ");
+    ASN1_UTCTIME_print(bio, X509_CRL_get_nextUpdate(entry->crl));
+    n=BIO_pending(bio);
+    cp=malloc(n+1);
+    n=BIO_read(bio, cp, n);
+    cp[n]='\0';
+    BIO_free(bio);
+    cp2=X509_NAME_oneline(X509_CRL_get_issuer(entry->crl), NULL, 0);
+    s_log(LOG_INFO, "CA CRL: Issuer: %s, %s, %s", cp2, cp,
+        entry->verified>0 ? "signature valid" :
+        entry->verified<0 ? "signature INVALID" : "signature not checked");
+    OPENSSL_free(cp2);
+    free(cp);
+}
+
+static unsigned int serial_hash(const ASN1_INTEGER *serial) { /* FNV-1a */
+    unsigned int hash=2166136261U;
+    int i;
+
+    for(i=0; i<serial->length; i++)
+        hash=(hash^serial->data[i])*16777619U;
+    return hash^serial->type; /* V_ASN1_NEG_INTEGER */
+}
+
+static void crl_cache_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+        int idx, long argl, void *argp) {
+    CRL_CACHE *cache=ptr;
+    CRL_ENTRY *entry;
+
+    if(!cache)
+        return;
+    while(cache->entries) {
+        entry=cache->entries;
+        cache->entries=entry->next;
+        free(entry->revoked);
+        X509_CRL_free(entry->crl);
+        free(entry);
+    }
+    if(cache->store)
+        X509_STORE_free(cache->store);
+    free(cache);
+}
+
+    /* pinnedPeers replaces the certificate chain verification */
+static int pin_init(SSL_CTX *ctx, LOCAL_OPTIONS *section) {
+    PIN_SET *pins;
+    DISK_FILE *df;
+    char line[STRLEN];
+    unsigned char md[PIN_LEN];
+    int line_number, type;
+
+    df=file_open(section->pinned_file, 0);
+    if(!df) {
+        s_log(LOG_ERR, "Cannot read pinned peers from %s",
+            section->pinned_file);
+        return -1;
+    }
+    pins=calloc(1, sizeof(PIN_SET));
+    if(!pins) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        file_close(df);
+        return -1;
+    }
+    if(pin_index<0) /* freed together with its SSL context */
+        pin_index=SSL_CTX_get_ex_new_index(0, "pinned peers",
+            NULL, NULL, pin_set_free);
+    SSL_CTX_set_ex_data(ctx, pin_index, pins);
+    line_number=0;
+    while(file_getline(df, line, STRLEN)) {
+        line_number++;
+        type=pin_parse(line, md);
+        if(!type) /* empty line or comment */
+            continue;
+        if(type<0 || pin_add(pins, type, md)) {
+            s_log(LOG_ERR, "%s:%d: Invalid fingerprint",
+                section->pinned_file, line_number);
+            file_close(df);
+            return -1;
+        }
+    }
+    file_close(df);
+    s_log(LOG_DEBUG, "Loaded %d pinned peer(s) from %s",
+        pins->num, section->pinned_file);
+    SSL_CTX_set_verify(ctx,
+        SSL_VERIFY_PEER|SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+#if SSLEAY_VERSION_NUMBER >= 0x00907000L
+    SSL_CTX_set_cert_verify_callback(ctx, cert_verify_callback, NULL);
+#endif
+    return 0; /* OK */
+}
+
+    /* "[pubkey] AB:CD:..." with an optional "SHA256 Fingerprint=" prefix
+     * returns PIN_CERT or PIN_PUBKEY, 0 for comments or -1 on error */
+static int pin_parse(char *line, unsigned char *md) {
+    char *p;
+    int type=PIN_CERT, i, n;
+
+    p=line;
+    while(isspace((unsigned char)*p))
+        p++;
+    if(!*p || *p=='#' || *p==';')
+        return 0;
+    if(!strncasecmp(p, "pubkey", 6) && isspace((unsigned char)p[6])) {
+        type=PIN_PUBKEY;
+        p+=6;
+    }
+    if(strchr(p, '='))
+        p=strchr(p, '=')+1;
+    for(i=0; i<2*PIN_LEN; p++) {
+        if(*p==':' || (i==0 && isspace((unsigned char)*p)))
+            continue;
+        if(!isxdigit((unsigned char)*p))
+            return -1;
+        n=isdigit((unsigned char)*p) ? *p-'0' : tolower((unsigned char)*p)-'a'+10;
+        if(i%2)
+            md[i/2]|=n;
+        else
+            md[i/2]=n<<4;
+        i++;
+    }
+    while(isspace((unsigned char)*p))
+        p++;
+    return *p ? -1 : type;
+}
+
+static int pin_add(PIN_SET *pins, int type, unsigned char *md) {
+    PIN *slot;
+    unsigned int i, size;
+
+    if(2*(pins->num+1)>pins->size) { /* keep it at most half full */
+        slot=pins->slot;
+        size=pins->size;
+        pins->size=size ? 2*size : 16;
+        pins->slot=calloc(pins->size, sizeof(PIN));
+        if(!pins->slot) {
+            pins->slot=slot;
+            pins->size=size;
+            return -1;
+        }
+        pins->num=0;
+        pins->pubkeys=0;
+        for(i=0; i<size; i++)
+            if(slot[i].type)
+                pin_add(pins, slot[i].type, slot[i].md);
+        if(slot)
+            free(slot);
+    }
+    if(pin_find(pins, type, md))
+        return 0; /* duplicate */
+    i=PIN_SLOT(md)&(pins->size-1);
+    while(pins->slot[i].type) /* linear probing */
+        i=(i+1)&(pins->size-1);
+    pins->slot[i].type=type;
+    memcpy(pins->slot[i].md, md, PIN_LEN);
+    pins->num++;
+    if(type==PIN_PUBKEY)
+        pins->pubkeys++;
+    return 0;
+}
+
+static int pin_find(PIN_SET *pins, int type, unsigned char *md) {
+    unsigned int i;
+
+    if(!pins->size)
+        return 0;
+    i=PIN_SLOT(md)&(pins->size-1);
+    while(pins->slot[i].type) {
+        if(pins->slot[i].type==type && !memcmp(pins->slot[i].md, md, PIN_LEN))
+            return 1;
+        i=(i+1)&(pins->size-1);
+    }
+    return 0;
+}
+
+    /* accept the peer if its certificate or its public key is pinned */
+static int pin_check(X509_STORE_CTX *store_ctx, PIN_SET *pins) {
+    char txt[STRLEN];
+    unsigned char md[EVP_MAX_MD_SIZE], *der, *der_ptr;
+    unsigned int n;
+    int len, found;
+    X509 *cert;
+    X509_PUBKEY *key;
+
+    /* the leaf: no current certificate before X509_verify_cert() */
+    cert=X509_STORE_CTX_get0_cert(store_ctx);
+    found=X509_digest(cert, EVP_sha256(), md, &n) &&
+        pin_find(pins, PIN_CERT, md);
+    if(!found && pins->pubkeys) { /* SHA-256 of SubjectPublicKeyInfo */
+        key=X509_get_X509_PUBKEY(cert);
+        len=i2d_X509_PUBKEY(key, NULL);
+        der=len>0 ? malloc(len) : NULL;
+        if(der) {
+            der_ptr=der; /* advanced by i2d_X509_PUBKEY() */
+            i2d_X509_PUBKEY(key, &der_ptr);
+            found=EVP_Digest(der, len, md, &n, EVP_sha256(), NULL) &&
+                pin_find(pins, PIN_PUBKEY, md);
+            free(der);
+        }
+    }
+    X509_NAME_oneline(X509_get_subject_name(cert), txt, STRLEN);
+    safestring(txt);
+    if(!found) {
+        s_log(LOG_WARNING, "VERIFY ERROR: peer not pinned: %s", txt);
+        X509_STORE_CTX_set_error(store_ctx, X509_V_ERR_CERT_REJECTED);
+        return 0; /* Reject connection */
+    }
+    s_log(LOG_NOTICE, "VERIFY OK: pinned, %s", txt);
+    X509_STORE_CTX_set_error(store_ctx, X509_V_OK);
+    return 1; /* Accept connection */
+}
+
+static void pin_set_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+        int idx, long argl, void *argp) {
+    PIN_SET *pins=ptr;
+
+    if(!pins)
+        return;
+    if(pins->slot)
+        free(pins->slot);
+    free(pins);
+}
+
+    /* replaces X509_verify_cert() for the handshake */
+static int cert_verify_callback(X509_STORE_CTX *store_ctx, void *arg) {
+    char txt[STRLEN];
+    SSL *ssl;
+    CLI *c;
+    PIN_SET *pins;
+    VERIFY_CACHE *cache;
+    VERIFY_ENTRY *entry, *old_entry;
+    int rc, error;
+
+    ssl=X509_STORE_CTX_get_ex_data(store_ctx,
+        SSL_get_ex_data_X509_STORE_CTX_idx());
+    c=SSL_get_ex_data(ssl, cli_index);
+    pins=pin_index<0 ? NULL :
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), pin_index);
+    if(pins)
+        return pin_check(store_ctx, pins);
+    cache=verify_index<0 ? NULL :
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), verify_index);
+    if(!cache || !chain_digest(store_ctx, c->peer_digest, &c->peer_digest_len))
+        return X509_verify_cert(store_ctx);
+
+    entry=verify_cache_find(c);
+    error=entry ? entry->error : X509_V_OK;
+    leave_critical_section(CRIT_VERIFY);
+    if(entry && chain_current(store_ctx, SSL_get_SSL_CTX(ssl))) {
+        X509_NAME_oneline(X509_get_subject_name(
+            X509_STORE_CTX_get0_cert(store_ctx)), txt, STRLEN);
+        safestring(txt);
+        if(error!=X509_V_OK) {
+            s_log(LOG_WARNING, "VERIFY ERROR: cached, error=%s: %s",
+                X509_verify_cert_error_string(error), txt);
+            X509_STORE_CTX_set_error(store_ctx, error);
+            return 0; /* Reject connection */
+        }
+        s_log(LOG_NOTICE, "VERIFY OK: cached, %s", txt);
+        X509_STORE_CTX_set_error(store_ctx, X509_V_OK);
+        return 1; /* Accept connection */
+    }
+
+    rc=X509_verify_cert(store_ctx);
+    error=X509_STORE_CTX_get_error(store_ctx);
+    if(rc<=0 && error==X509_V_OK) /* rejected by verify_callback() */
+        error=X509_V_ERR_APPLICATION_VERIFICATION;
+    entry=calloc(1, sizeof(VERIFY_ENTRY));
+    if(!entry)
+        return rc;
+    memcpy(entry->digest, c->peer_digest, c->peer_digest_len);
+    entry->digest_len=c->peer_digest_len;
+    entry->timeout=time(NULL)+VERIFY_CACHE_TIME;
+    entry->error=rc>0 ? X509_V_OK : error;
+    enter_critical_section(CRIT_VERIFY);
+    old_entry=cache->slot[VERIFY_SLOT(c->peer_digest)];
+    cache->slot[VERIFY_SLOT(c->peer_digest)]=entry;
+    leave_critical_section(CRIT_VERIFY);
+    if(old_entry) {
+        if(old_entry->hostname)
+            free(old_entry->hostname);
+        free(old_entry);
+    }
+    return rc;
+}
+
+    /* digest of the certificates sent by the peer */
+static int chain_digest(X509_STORE_CTX *store_ctx,
+        unsigned char *md, unsigned int *len) {
+    EVP_MD_CTX *md_ctx; /* opaque in OpenSSL 1.1.0 */
+    STACK_OF(X509) *untrusted;
+    unsigned char cert_md[EVP_MAX_MD_SIZE];
+    unsigned int n;
+    int i, ok=1;
+
+    md_ctx=EVP_MD_CTX_create();
+    if(!md_ctx)
+        return 0;
+    EVP_DigestInit(md_ctx, VERIFY_DIGEST);
+    if(X509_digest(X509_STORE_CTX_get0_cert(store_ctx), VERIFY_DIGEST,
+            cert_md, &n))
+        EVP_DigestUpdate(md_ctx, cert_md, n);
+    else
+        ok=0;
+    untrusted=X509_STORE_CTX_get0_untrusted(store_ctx);
+    for(i=0; untrusted && i<sk_X509_num(untrusted); i++)
+        if(X509_digest(sk_X509_value(untrusted, i),
+                VERIFY_DIGEST, cert_md, &n))
+            EVP_DigestUpdate(md_ctx, cert_md, n);
+        else
+            ok=0;
+    EVP_DigestFinal(md_ctx, md, len);
+    EVP_MD_CTX_destroy(md_ctx);
+    return ok;
+}
+
+    /* a cached result is only valid until a certificate of the chain
+     * or a CRL of one of their issuers expires */
+static int chain_current(X509_STORE_CTX *store_ctx, SSL_CTX *ctx) {
+    CRL_CACHE *crl_cache;
+    CRL_ENTRY *crl_entry;
+    STACK_OF(X509) *untrusted;
+    X509 *x;
+    ASN1_TIME *t;
+    int i;
+
+    crl_cache=crl_index<0 ? NULL : SSL_CTX_get_ex_data(ctx, crl_index);
+    x=X509_STORE_CTX_get0_cert(store_ctx);
+    untrusted=X509_STORE_CTX_get0_untrusted(store_ctx);
+    for(i=-1; i<0 || (untrusted && i<sk_X509_num(untrusted)); i++) {
+        if(i>=0)
+            x=sk_X509_value(untrusted, i);
+        if(X509_cmp_current_time(X509_get_notAfter(x))<0)
+            return 0;
+        crl_entry=crl_cache ?
+            crl_find(crl_cache, X509_get_issuer_name(x)) : NULL;
+        if(crl_entry) {
+            t=X509_CRL_get_nextUpdate(crl_entry->crl);
+            if(!t || X509_cmp_current_time(t)<0)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+    /* the valid entry for the chain verified in this handshake or NULL
+     * returns with CRIT_VERIFY entered */
+static VERIFY_ENTRY *verify_cache_find(CLI *c) {
+    VERIFY_CACHE *cache;
+    VERIFY_ENTRY *entry;
+
+    enter_critical_section(CRIT_VERIFY);
+    if(!c->peer_digest_len || verify_index<0)
+        return NULL;
+    cache=SSL_CTX_get_ex_data(SSL_get_SSL_CTX(c->ssl), verify_index);
+    if(!cache)
+        return NULL;
+    entry=cache->slot[VERIFY_SLOT(c->peer_digest)];
+    if(!entry || entry->digest_len!=c->peer_digest_len ||
+            memcmp(entry->digest, c->peer_digest, c->peer_digest_len) ||
+            entry->timeout<time(NULL))
+        return NULL;
+    return entry;
+}
+
+    /* 1 - hostname matched, 0 - did not match, -1 - unknown */
+int verify_cache_hostname(CLI *c, char *hostname) {
+    VERIFY_ENTRY *entry;
+    int retval=-1;
+
+    entry=verify_cache_find(c);
+    if(entry && entry->hostname && !strcmp(entry->hostname, hostname))
+        retval=entry->hostname_ok;
+    leave_critical_section(CRIT_VERIFY);
+    return retval;
+}
+
+void verify_cache_set_hostname(CLI *c, char *hostname, int ok) {
+    VERIFY_ENTRY *entry;
+
+    entry=verify_cache_find(c);
+    if(entry) {
+        if(entry->hostname)
+            free(entry->hostname);
+        entry->hostname=strdup(hostname);
+        entry->hostname_ok=ok;
+    }
+    leave_critical_section(CRIT_VERIFY);
+}
+
+static void verify_cache_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+        int idx, long argl, void *argp) {
+    VERIFY_CACHE *cache=ptr;
+    int i;
+
+    if(!cache)
+        return;
+    for(i=0; i<VERIFY_CACHE_SIZE; i++)
+        if(cache->slot[i]) {
+            if(cache->slot[i]->hostname)
+                free(cache->slot[i]->hostname);
+            free(cache->slot[i]);
+        }
+    free(cache);
 }
 
 static int verify_callback(int preverify_ok, X509_STORE_CTX *callback_ctx) {
         /* our verify callback function */
     char txt[STRLEN];
-    X509_OBJECT ret;
+    X509 *cert;
+    X509_OBJECT *obj;
+    CRL_CACHE *crl_cache;
     SSL *ssl;
     CLI *c;
+    int depth, rc;
 
     /* Retrieve the pointer to the SSL of the connection currently treated
      * and the application specific data stored into the SSL object. */
     ssl=X509_STORE_CTX_get_ex_data(callback_ctx,
         SSL_get_ex_data_X509_STORE_CTX_idx());
     c=SSL_get_ex_data(ssl, cli_index);
+    cert=X509_STORE_CTX_get_current_cert(callback_ctx);
+    depth=X509_STORE_CTX_get_error_depth(callback_ctx);
 
-    X509_NAME_oneline(X509_get_subject_name(callback_ctx->current_cert),
-        txt, STRLEN);
+    X509_NAME_oneline(X509_get_subject_name(cert), txt, STRLEN);
     safestring(txt);
     if(c->opt->verify_level==SSL_VERIFY_NONE) {
-        s_log(LOG_NOTICE, "VERIFY IGNORE: depth=%d, %s",
-            callback_ctx->error_depth, txt);
+        s_log(LOG_NOTICE, "VERIFY IGNORE: depth=%d, %s", depth, txt);
         return 1; /* Accept connection */
     }
     if(!preverify_ok) {
         /* Remote site specified a certificate, but it's not correct */
-        s_log(LOG_WARNING, "VERIFY ERROR: depth=%d, error=%s: %s",
-            callback_ctx->error_depth,
-            X509_verify_cert_error_string (callback_ctx->error), txt);
+        s_log(LOG_WARNING, "VERIFY ERROR: depth=%d, error=%s: %s", depth,
+            X509_verify_cert_error_string(
+                X509_STORE_CTX_get_error(callback_ctx)), txt);
         return 0; /* Reject connection */
     }
-    if(c->opt->verify_use_only_my && callback_ctx->error_depth==0 &&
-            X509_STORE_get_by_subject(callback_ctx, X509_LU_X509,
-                X509_get_subject_name(callback_ctx->current_cert), &ret)!=1) {
-        s_log(LOG_WARNING, "VERIFY ERROR ONLY MY: no cert for %s", txt);
-        return 0; /* Reject connection */
+    if(c->opt->verify_use_only_my && depth==0) {
+        obj=X509_OBJECT_new();
+        rc=obj ? X509_STORE_CTX_get_by_subject(callback_ctx, X509_LU_X509,
+            X509_get_subject_name(cert), obj) : 0;
+        if(obj)
+            X509_OBJECT_free(obj);
+        if(rc!=1) {
+            s_log(LOG_WARNING, "VERIFY ERROR ONLY MY: no cert for %s", txt);
+            return 0; /* Reject connection */
+        }
     }
-    if(revocation_store && !crl_callback(callback_ctx))
+    crl_cache=crl_index<0 ? NULL :
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), crl_index);
+    if(crl_cache && !crl_callback(callback_ctx, crl_cache))
         return 0; /* Reject connection */
     /* errnum=X509_STORE_CTX_get_error(ctx); */
 
-    s_log(LOG_NOTICE, "VERIFY OK: depth=%d, %s", callback_ctx->error_depth, txt);
+    s_log(LOG_NOTICE, "VERIFY OK: depth=%d, %s", depth, txt);
+    return 1; /* Accept connection */
+}
+
+static int crl_callback(X509_STORE_CTX *callback_ctx, CRL_CACHE *cache) {
+    X509 *xs;
+    CRL_ENTRY *entry;
+    EVP_PKEY *pubkey;
+    long serial;
+    char *cp;
+
+    xs=X509_STORE_CTX_get_current_cert(callback_ctx);
+
+    /* CRL issued by the current certificate: check its integrity */
+    entry=crl_find(cache, X509_get_subject_name(xs));
+    if(entry) {
+        if(!entry->verified) { /* issuer was not in CAfile or CApath */
+            pubkey=X509_get_pubkey(xs);
+            /* concurrent handshakes can only store the same result */
+            entry->verified=pubkey && X509_CRL_verify(entry->crl, pubkey)>0 ?
+                1 : -1;
+            if(pubkey)
+                EVP_PKEY_free(pubkey);
+        }
+        if(entry->verified<0) {
+            s_log(LOG_WARNING, "Invalid signature on CRL");
+            X509_STORE_CTX_set_error(callback_ctx,
+                X509_V_ERR_CRL_SIGNATURE_FAILURE);
+            return 0; /* Reject connection */
+        }
+        if(!crl_current(callback_ctx, entry->crl))
+            return 0; /* Reject connection */
+    }
+
+    /* CRL of the issuer of the current certificate: check for revocation */
+    entry=crl_find(cache, X509_get_issuer_name(xs));
+    if(entry && crl_revoked(entry, X509_get_serialNumber(xs))) {
+        serial=ASN1_INTEGER_get(X509_get_serialNumber(xs));
+        cp=X509_NAME_oneline(X509_get_issuer_name(xs), NULL, 0);
+        s_log(LOG_NOTICE, "Certificate with serial %ld (0x%lX) "
+            "revoked per CRL from issuer %s", serial, serial, cp);
+        OPENSSL_free(cp);
+        X509_STORE_CTX_set_error(callback_ctx, X509_V_ERR_CERT_REVOKED);
+        return 0; /* Reject connection */
+    }
+
+    if(cache->store)
+        return crl_store_check(callback_ctx, cache->store);
     return 1; /* Accept connection */
 }
 
+static CRL_ENTRY *crl_find(CRL_CACHE *cache, X509_NAME *issuer) {
+    CRL_ENTRY *entry;
+
+    for(entry=cache->entries; entry; entry=entry->next)
+        if(!X509_NAME_cmp(X509_CRL_get_issuer(entry->crl), issuer))
+            return entry;
+    return NULL;
+}
+
+static int crl_revoked(CRL_ENTRY *entry, const ASN1_INTEGER *serial) {
+    unsigned int slot;
+
+    slot=serial_hash(serial)&(entry->size-1);
+    while(entry->revoked[slot]) {
+        if(!ASN1_INTEGER_cmp(entry->revoked[slot], serial))
+            return 1;
+        slot=(slot+1)&(entry->size-1);
+    }
+    return 0;
+}
+
+    /* check date of CRL to make sure it's not expired */
+static int crl_current(X509_STORE_CTX *callback_ctx, X509_CRL *crl) {
+    ASN1_TIME *t;
+
+    t=X509_CRL_get_nextUpdate(crl);
+    if(!t) {
+        s_log(LOG_WARNING, "Found CRL has invalid nextUpdate field");
+        X509_STORE_CTX_set_error(callback_ctx,
+            X509_V_ERR_ERROR_IN_CRL_NEXT_UPDATE_FIELD);
+        return 0; /* Reject connection */
+    }
+    if(X509_cmp_current_time(t)<0) {
+        s_log(LOG_WARNING, "Found CRL is expired - "
+            "revoking all certificates until you get updated CRL");
+        X509_STORE_CTX_set_error(callback_ctx, X509_V_ERR_CRL_HAS_EXPIRED);
+        return 0; /* Reject connection */
+    }
+    return 1; /* CRL is current */
+}
+
 /* Based on BSD-style licensed code of mod_ssl */
-static int crl_callback(X509_STORE_CTX *callback_ctx) {
-    X509_STORE_CTX store_ctx;
-    X509_OBJECT obj;
+static int crl_store_check(X509_STORE_CTX *callback_ctx,
+        X509_STORE *revocation_store) {
+    X509_OBJECT *obj;
     X509_NAME *subject;
     X509_NAME *issuer;
     X509 *xs;
@@ -404,10 +1539,9 @@ static int crl_callback(X509_STORE_CTX *callback_ctx) {
     EVP_PKEY *pubkey;
     long serial;
     BIO *bio;
-    int i, n, rc;
+    int i, n;
     char *cp;
     char *cp2;
-    ASN1_TIME *t;
 
     /* Determine certificate ingredients in advance */
     xs      = X509_STORE_CTX_get_current_cert(callback_ctx);
@@ -416,12 +1550,9 @@ static int crl_callback(X509_STORE_CTX *callback_ctx) {
 
     /* Try to retrieve a CRL corresponding to the _subject_ of
      * the current certificate in order to verify it's integrity. */
-    memset((char *)&obj, 0, sizeof(obj));
-    X509_STORE_CTX_init(&store_ctx, revocation_store, NULL, NULL);
-    rc=X509_STORE_get_by_subject(&store_ctx, X509_LU_CRL, subject, &obj);
-    X509_STORE_CTX_cleanup(&store_ctx);
-    crl=obj.data.crl;
-    if(rc>0 && crl) {
+    obj=crl_lookup(revocation_store, subject);
+    if(obj) {
+        crl=X509_OBJECT_get0_X509_CRL(obj);
         /* Log information about CRL
          * (A little bit complicated because of ASN.1 and BIOs...) */
         bio=BIO_new(BIO_s_mem());
@@ -445,7 +1576,7 @@ static int crl_callback(X509_STORE_CTX *callback_ctx) {
             s_log(LOG_WARNING, "Invalid signature on CRL");
             X509_STORE_CTX_set_error(callback_ctx,
                 X509_V_ERR_CRL_SIGNATURE_FAILURE);
-            X509_OBJECT_free_contents(&obj);
+            X509_OBJECT_free(obj);
             if(pubkey)
                 EVP_PKEY_free(pubkey);
             return 0; /* Reject connection */
@@ -454,32 +1585,18 @@ static int crl_callback(X509_STORE_CTX *callback_ctx) {
             EVP_PKEY_free(pubkey);
 
         /* Check date of CRL to make sure it's not expired */
-        t=X509_CRL_get_nextUpdate(crl);
-        if(!t) {
-            s_log(LOG_WARNING, "Found CRL has invalid nextUpdate field");
-            X509_STORE_CTX_set_error(callback_ctx,
-                X509_V_ERR_ERROR_IN_CRL_NEXT_UPDATE_FIELD);
-            X509_OBJECT_free_contents(&obj);
-            return 0; /* Reject connection */
-        }
-        if(X509_cmp_current_time(t)<0) {
-            s_log(LOG_WARNING, "Found CRL is expired - "
-                "revoking all certificates until you get updated CRL");
-            X509_STORE_CTX_set_error(callback_ctx, X509_V_ERR_CRL_HAS_EXPIRED);
-            X509_OBJECT_free_contents(&obj);
+        if(!crl_current(callback_ctx, crl)) {
+            X509_OBJECT_free(obj);
             return 0; /* Reject connection */
         }
-        X509_OBJECT_free_contents(&obj);
+        X509_OBJECT_free(obj);
     }
 
     /* Try to retrieve a CRL corresponding to the _issuer_ of
      * the current certificate in order to check for revocation. */
-    memset((char *)&obj, 0, sizeof(obj));
-    X509_STORE_CTX_init(&store_ctx, revocation_store, NULL, NULL);
-    rc=X509_STORE_get_by_subject(&store_ctx, X509_LU_CRL, issuer, &obj);
-    X509_STORE_CTX_cleanup(&store_ctx);
-    crl=obj.data.crl;
-    if(rc>0 && crl) {
+    obj=crl_lookup(revocation_store, issuer);
+    if(obj) {
+        crl=X509_OBJECT_get0_X509_CRL(obj);
         /* Check if the current certificate is revoked by this CRL */
 #if SSLEAY_VERSION_NUMBER >= 0x00904000
         n=sk_X509_REVOKED_num(X509_CRL_get_REVOKED(crl));
@@ -492,23 +1609,47 @@ static int crl_callback(X509_STORE_CTX *callback_ctx) {
 #else
             revoked=(X509_REVOKED *)sk_value(X509_CRL_get_REVOKED(crl), i);
 #endif
-            if(ASN1_INTEGER_cmp(revoked->serialNumber,
+            if(ASN1_INTEGER_cmp(X509_REVOKED_get0_serialNumber(revoked),
                     X509_get_serialNumber(xs)) == 0) {
-                serial=ASN1_INTEGER_get(revoked->serialNumber);
+                serial=ASN1_INTEGER_get(
+                    X509_REVOKED_get0_serialNumber(revoked));
                 cp=X509_NAME_oneline(issuer, NULL, 0);
                 s_log(LOG_NOTICE, "Certificate with serial %ld (0x%lX) "
                     "revoked per CRL from issuer %s", serial, serial, cp);
                 OPENSSL_free(cp);
                 X509_STORE_CTX_set_error(callback_ctx, X509_V_ERR_CERT_REVOKED);
-                X509_OBJECT_free_contents(&obj);
+                X509_OBJECT_free(obj);
                 return 0; /* Reject connection */
             }
         }
-        X509_OBJECT_free_contents(&obj);
+        X509_OBJECT_free(obj);
     }
     return 1; /* Accept connection */
 }
 
+/* the CRL of a name from the store, or NULL */
+static X509_OBJECT *crl_lookup(X509_STORE *store, X509_NAME *name) {
+    X509_STORE_CTX *store_ctx;
+    X509_OBJECT *obj;
+    int rc;
+
+    store_ctx=X509_STORE_CTX_new();
+    if(!store_ctx)
+        return NULL;
+    obj=X509_OBJECT_new();
+    if(!obj) {
+        X509_STORE_CTX_free(store_ctx);
+        return NULL;
+    }
+    X509_STORE_CTX_init(store_ctx, store, NULL, NULL);
+    rc=X509_STORE_CTX_get_by_subject(store_ctx, X509_LU_CRL, name, obj);
+    X509_STORE_CTX_free(store_ctx);
+    if(rc>0 && X509_OBJECT_get0_X509_CRL(obj))
+        return obj;
+    X509_OBJECT_free(obj);
+    return NULL;
+}
+
 #if SSLEAY_VERSION_NUMBER >= 0x00907000L
 static void info_callback(const SSL *s, int where, int ret) {
 #else
@@ -525,7 +1666,7 @@ static void info_callback(SSL *s, int where, int ret) {
             SSL_alert_type_string_long(ret),
             SSL_alert_desc_string_long(ret));
     else if(where==SSL_CB_HANDSHAKE_DONE)
-        print_stats(s->ctx);
+        print_stats(SSL_get_SSL_CTX(s));
 }
 
 static void print_stats(SSL_CTX *ctx) { /* print statistics */
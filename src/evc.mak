@@ -19,7 +19,7 @@ CFLAGS=/nologo /MC /O1i /W3 /WX /GF /Gy /DHOST=\"$(TARGETCPU)-WCE-eVC-$(WCEVER)\
 RFLAGS=$(INCLUDES)
 LDFLAGS=/nologo /subsystem:windowsce,3.00 /machine:ARM /libpath:"$(SDKDIR)\lib\$(TARGETCPU)" /libpath:"$(COMPATDIR)\lib" /libpath:"$(SSLDIR)\out32dll"
 
-OBJS=stunnel.obj ssl.obj ctx.obj file.obj client.obj protocol.obj sthreads.obj log.obj options.obj network.obj resolver.obj
+OBJS=stunnel.obj ssl.obj ctx.obj file.obj client.obj protocol.obj sthreads.obj log.obj options.obj network.obj resolver.obj stats.obj access.o upgrade.obj ocsp.obj
 GUIOBJS=gui.obj resources.res
 NOGUIOBJS=nogui.obj
 
@@ -31,6 +31,23 @@
 #include "common.h"
 #include "prototypes.h"
 
+/* DISK_FILE reads are buffered, read-only regular files are mmap()ed.
+ * Writes are collected in the buffer until file_flush() or until the
+ * buffer is full.  Writes are serialized with CRIT_FILE, so a file may
+ * be shared by threads, but nothing here may call s_log() while holding
+ * it: log.c writes its output through these functions. */
+
+#ifdef USE_WIN32
+#define FILE_EOL "\r\n"
+#else
+#define FILE_EOL "\n"
+static DISK_FILE stderr_file={2}; /* used when no file is specified */
+#endif
+#define FILE_EOL_LEN (sizeof(FILE_EOL)-1)
+
+static int file_fill(DISK_FILE *);
+static int file_write(DISK_FILE *, char *, int);
+
 #ifndef USE_WIN32
 DISK_FILE *file_fdopen(int fd) {
     DISK_FILE *df;
@@ -47,6 +64,8 @@ DISK_FILE *file_open(char *name, int wr) {
     DISK_FILE *df;
 #ifdef USE_WIN32
     LPTSTR tstr;
+#else
+    struct stat st;
 #endif /* USE_WIN32 */
 
     df=calloc(1, sizeof(DISK_FILE));
@@ -68,6 +87,17 @@ DISK_FILE *file_open(char *name, int wr) {
     if(df->fd>=0) { /* OK! */
 #ifndef __vms
         fcntl(df->fd, F_SETFD, FD_CLOEXEC);
+        /* map a regular file instead of reading it */
+        if(!wr && !fstat(df->fd, &st) && S_ISREG(st.st_mode) &&
+                st.st_size>0 && st.st_size<=INT_MAX) {
+            df->buff=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                df->fd, 0);
+            if(df->buff!=MAP_FAILED) {
+                df->len=st.st_size;
+                df->mapped=df->rd=1;
+            } else
+                df->buff=NULL; /* fall back to read() */
+        }
 #endif /* ! __vms */
         return df;
     }
@@ -81,6 +111,13 @@ DISK_FILE *file_open(char *name, int wr) {
 void file_close(DISK_FILE *df) {
     if(!df) /* nothing to do */
         return;
+    file_flush(df);
+#if !defined(USE_WIN32) && !defined(__vms)
+    if(df->mapped)
+        munmap(df->buff, df->len);
+    else
+#endif
+        free(df->buff);
 #ifdef USE_WIN32
     CloseHandle(df->fh);
 #else /* USE_WIN32 */
@@ -90,59 +127,133 @@ void file_close(DISK_FILE *df) {
 }
 
 int file_getline(DISK_FILE *df, char *line, int len) {
-    /* this version is really slow, but performance is not important here */
-    /* (no buffering is implemented) */
-    int i;
-#ifdef USE_WIN32
-    DWORD num;
-#else /* USE_WIN32 */
-    int num;
-#endif /* USE_WIN32 */
+    int i, n;
+    char *eol;
 
     if(!df) /* not opened */
         return 0;
 
-    for(i=0; i<len-1; i++) {
-        if(i>0 && line[i-1]=='\n')
-            break;
-#ifdef USE_WIN32
-        ReadFile(df->fh, line+i, 1, &num, NULL);
-#else /* USE_WIN32 */
-        num=read(df->fd, line+i, 1);
-#endif /* USE_WIN32 */
-        if(num!=1)
+    for(i=0; i<len-1; ) {
+        if(df->ptr==df->len && (df->mapped || file_fill(df)<=0))
+            break; /* end of file */
+        n=df->len-df->ptr;
+        if(n>len-1-i)
+            n=len-1-i;
+        eol=memchr(df->buff+df->ptr, '\n', n);
+        if(eol)
+            n=eol-(df->buff+df->ptr)+1;
+        memcpy(line+i, df->buff+df->ptr, n);
+        df->ptr+=n;
+        i+=n;
+        if(eol)
             break;
     }
     line[i]='\0';
     return i;
 }
 
-int file_putline(DISK_FILE *df, char *line) {
-    int len;
-    char *buff;
+    /* refill the read buffer, returns the number of bytes read */
+static int file_fill(DISK_FILE *df) {
 #ifdef USE_WIN32
     DWORD num;
 #else /* USE_WIN32 */
     int num;
 #endif /* USE_WIN32 */
 
+    if(!df->buff) {
+        df->buff=malloc(BUFFSIZE);
+        if(!df->buff)
+            return -1;
+    }
+    df->rd=1;
+#ifdef USE_WIN32
+    if(!ReadFile(df->fh, df->buff, BUFFSIZE, &num, NULL))
+        return -1;
+#else /* USE_WIN32 */
+    num=read(df->fd, df->buff, BUFFSIZE);
+    if(num<0)
+        return -1;
+#endif /* USE_WIN32 */
+    df->len=num;
+    df->ptr=0;
+    return num;
+}
+
+    /* append a line to the write buffer */
+int file_putline(DISK_FILE *df, char *line) {
+    int len;
+
+#ifndef USE_WIN32
+    if(!df) /* no file -> write to stderr */
+        df=&stderr_file;
+#endif /* USE_WIN32 */
     len=strlen(line);
-    buff=calloc(len+2, 1); /* +2 for \r\n */
-    if(!buff)
+    enter_critical_section(CRIT_FILE);
+    if(!df->buff)
+        df->buff=malloc(BUFFSIZE);
+    if(df->buff && df->len+len+FILE_EOL_LEN>BUFFSIZE) { /* no room */
+        file_write(df, df->buff, df->len);
+        df->len=0;
+    }
+    if(!df->buff || len+FILE_EOL_LEN>BUFFSIZE) { /* write it directly */
+        file_write(df, line, len);
+        file_write(df, FILE_EOL, FILE_EOL_LEN);
+    } else {
+        memcpy(df->buff+df->len, line, len);
+        memcpy(df->buff+df->len+len, FILE_EOL, FILE_EOL_LEN);
+        df->len+=len+FILE_EOL_LEN;
+    }
+    leave_critical_section(CRIT_FILE);
+    return len+FILE_EOL_LEN;
+}
+
+    /* write the buffered lines */
+int file_flush(DISK_FILE *df) {
+    int num=0;
+
+#ifdef USE_WIN32
+    if(!df) /* not opened */
         return 0;
-    strcpy(buff, line);
+#else /* USE_WIN32 */
+    if(!df) /* no file -> write to stderr */
+        df=&stderr_file;
+#endif /* USE_WIN32 */
+    if(df->rd) /* the buffer holds read data */
+        return 0;
+    enter_critical_section(CRIT_FILE);
+    if(df->len) {
+        num=file_write(df, df->buff, df->len);
+        df->len=0;
+    }
+    leave_critical_section(CRIT_FILE);
+    return num;
+}
+
+    /* write the whole buffer, called in CRIT_FILE */
+static int file_write(DISK_FILE *df, char *buff, int len) {
 #ifdef USE_WIN32
-    buff[len++]='\r';
+    DWORD num;
+#else /* USE_WIN32 */
+    int num;
 #endif /* USE_WIN32 */
-    buff[len++]='\n';
+    int done;
+
+    for(done=0; done<len; done+=num) {
 #ifdef USE_WIN32
-    WriteFile(df->fh, buff, len, &num, NULL);
+        if(!WriteFile(df->fh, buff+done, len-done, &num, NULL))
+            return -1;
 #else /* USE_WIN32 */
-    /* no file -> write to stderr */
-    num=write(df ? df->fd : 2, buff, len);
+        num=write(df->fd, buff+done, len-done);
+        if(num<0) {
+            if(errno==EINTR) {
+                num=0;
+                continue;
+            }
+            return -1;
+        }
 #endif /* USE_WIN32 */
-    free(buff);
-    return num;
+    }
+    return done;
 }
 
 #ifdef USE_WIN32
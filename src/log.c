@@ -31,7 +31,70 @@
 #include "common.h"
 #include "prototypes.h"
 
+#undef s_log /* the function, not the macro from prototypes.h */
+
 static DISK_FILE *outfile=NULL; /* Logging to file disabled by default */
+static time_t stamp_time=(time_t)-1; /* when stamp_text was formatted */
+/* "YYYY.MM.DD hh:mm:ss", sized for six ints of any value, so sprintf()
+ * cannot overflow it even where snprintf() is not available */
+static char stamp_text[6*11+5+1];
+
+static void log_line(char *, time_t, int, unsigned long, unsigned long,
+    char *);
+static void log_sync(int, char *);
+
+#ifdef LOG_ASYNC
+
+/* Asynchronous logging: s_log() only formats the message and stores it
+ * in a ring buffer, the timestamp formatting and the actual output are
+ * done in batches by log_flush():
+ *  - PTHREAD: a writer thread, the callers are spread over LOG_RINGS rings
+ *    by thread id, so they don't contend for a single lock
+ *  - UCONTEXT: the scheduler before it goes to sleep in poll()
+ * Full rings drop their oldest records, errors are never queued. */
+
+#ifdef USE_PTHREAD
+#define LOG_RINGS 16
+#else
+#define LOG_RINGS 1
+#endif
+#define LOG_RING_SIZE 512 /* records in a ring */
+
+typedef struct {
+    time_t time;
+    int level;
+    unsigned long pid, tid;
+    char text[STRLEN];
+} LOG_RECORD;
+
+typedef struct {
+#ifdef USE_PTHREAD
+    pthread_mutex_t mutex;
+#endif
+    unsigned int head, tail; /* next record to write and to read */
+    unsigned long dropped; /* records overwritten before output */
+    LOG_RECORD record[LOG_RING_SIZE];
+} LOG_RING;
+
+/* read once by each caller: log_async_stop() resets it while other threads
+ * are logging, the rings are never freed */
+static LOG_RING *rings=NULL; /* NULL -> synchronous logging */
+static LOG_RECORD batch[LOG_RING_SIZE]; /* records taken from a ring */
+static unsigned long dropped_total=0, dropped_reported=0;
+
+#ifdef USE_PTHREAD
+static pthread_mutex_t output_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wakeup_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup_cond=PTHREAD_COND_INITIALIZER;
+static int writer_stop=0;
+
+static void *log_writer(void *);
+#endif
+
+static void log_push(LOG_RING *, int, char *);
+static void log_batch(LOG_RING *);
+
+#endif /* LOG_ASYNC */
 
 void log_open(void) { /* Unix version */
     if(options.output_file) { /* 'output' option specified */
@@ -53,6 +116,9 @@ void log_open(void) { /* Unix version */
 }
 
 void log_close(void) {
+#ifdef LOG_ASYNC
+    log_async_stop();
+#endif
     if(outfile) {
         file_close(outfile);
         return;
@@ -65,11 +131,9 @@ void log_close(void) {
 
 void s_log(int level, const char *format, ...) {
     va_list arglist;
-    char text[STRLEN], timestamped[STRLEN];
-    time_t gmt;
-    struct tm *timeptr;
-#if defined(HAVE_LOCALTIME_R) && defined(_REENTRANT)
-    struct tm timestruct;
+    char text[STRLEN];
+#ifdef LOG_ASYNC
+    LOG_RING *queue;
 #endif
 
     if(level>options.debug_level)
@@ -81,35 +145,253 @@ void s_log(int level, const char *format, ...) {
     vsprintf(text, format, arglist);
 #endif
     va_end(arglist);
-#if !defined (USE_WIN32) && !defined (__vms)
-    if(!outfile && options.option.syslog) {
-        syslog(level, "LOG%d[%lu:%lu]: %s",
-            level, stunnel_process_id(), stunnel_thread_id(), text);
-        return;
+#ifdef LOG_ASYNC
+    queue=rings;
+    if(queue) {
+        if(level>LOG_ERR) {
+            log_push(queue, level, text);
+            return;
+        }
+        log_batch(queue); /* keep the order of the queued messages */
     }
-#endif /* USE_WIN32, __vms */
-    time(&gmt);
+#endif
+    log_sync(level, text);
+}
+
+    /* format a log line with the timestamp */
+static void log_line(char *line, time_t gmt, int level,
+        unsigned long pid, unsigned long tid, char *text) {
+    struct tm *timeptr;
+#if defined(HAVE_LOCALTIME_R) && defined(_REENTRANT)
+    struct tm timestruct;
+#endif
+    char stamp[sizeof(stamp_text)];
+
+    /* the date only changes once a second: format it once a second */
+    enter_critical_section(CRIT_LOG);
+    if(gmt!=stamp_time) {
 #if defined(HAVE_LOCALTIME_R) && defined(_REENTRANT)
-    timeptr=localtime_r(&gmt, &timestruct);
+        timeptr=localtime_r(&gmt, &timestruct);
 #else
-    timeptr=localtime(&gmt);
+        timeptr=localtime(&gmt);
 #endif
+        sprintf(stamp_text, "%04d.%02d.%02d %02d:%02d:%02d",
+            timeptr->tm_year+1900, timeptr->tm_mon+1, timeptr->tm_mday,
+            timeptr->tm_hour, timeptr->tm_min, timeptr->tm_sec);
+        stamp_time=gmt;
+    }
+    strcpy(stamp, stamp_text);
+    leave_critical_section(CRIT_LOG);
 #ifdef HAVE_SNPRINTF
-    snprintf(timestamped, STRLEN,
+    snprintf(line, STRLEN,
 #else
-    sprintf(timestamped,
+    sprintf(line,
 #endif
-        "%04d.%02d.%02d %02d:%02d:%02d LOG%d[%lu:%lu]: %s",
-        timeptr->tm_year+1900, timeptr->tm_mon+1, timeptr->tm_mday,
-        timeptr->tm_hour, timeptr->tm_min, timeptr->tm_sec,
-        level, stunnel_process_id(), stunnel_thread_id(), text);
+        "%s LOG%d[%lu:%lu]: %s", stamp, level, pid, tid, text);
+}
+
+static void log_sync(int level, char *text) { /* output a single line */
+    char timestamped[STRLEN];
+
+#if !defined (USE_WIN32) && !defined (__vms)
+    if(!outfile && options.option.syslog) {
+        syslog(level, "LOG%d[%lu:%lu]: %s",
+            level, stunnel_process_id(), stunnel_thread_id(), text);
+        return;
+    }
+#endif /* USE_WIN32, __vms */
+    log_line(timestamped, time(NULL), level,
+        stunnel_process_id(), stunnel_thread_id(), text);
 #ifdef USE_WIN32
     win_log(timestamped); /* always log to the GUI window */
     if(outfile) /* fallback to stderr is not available on WIN32 */
 #endif
+    {
         file_putline(outfile, timestamped);
+        file_flush(outfile);
+    }
+}
+
+#ifdef LOG_ASYNC
+
+    /* switch to asynchronous logging
+     * must be called after the last fork() of the daemon */
+void log_async_start(void) {
+    LOG_RING *new_rings;
+#ifdef USE_PTHREAD
+    int i;
+#endif
+
+    if(rings) /* already started */
+        return;
+    new_rings=calloc(LOG_RINGS, sizeof(LOG_RING));
+    if(!new_rings) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        return; /* continue with synchronous logging */
+    }
+#ifdef USE_PTHREAD
+    for(i=0; i<LOG_RINGS; i++)
+        pthread_mutex_init(&new_rings[i].mutex, NULL);
+    writer_stop=0;
+    /* create_client() also blocks the signals in the writer thread */
+    if(create_client(-1, -1, NULL, log_writer)) {
+        s_log(LOG_ERR, "Failed to start the log writer thread");
+        free(new_rings); /* not published yet */
+        return;
+    }
+#endif
+    rings=new_rings;
+    s_log(LOG_DEBUG, "Asynchronous logging started");
+}
+
+    /* flush the queued messages and switch back to synchronous logging */
+void log_async_stop(void) {
+    LOG_RING *queue=rings;
+
+    if(!queue)
+        return;
+    rings=NULL; /* not freed: other threads may still be logging */
+#ifdef USE_PTHREAD
+    pthread_mutex_lock(&wakeup_mutex);
+    writer_stop=1;
+    pthread_cond_signal(&wakeup_cond);
+    pthread_mutex_unlock(&wakeup_mutex);
+#endif
+    log_batch(queue); /* the messages queued before the switch */
+}
+
+    /* forget the queued messages inherited by a child process
+     * the writer thread does not exist after fork() */
+void log_async_child(void) {
+    rings=NULL;
 }
 
+static void log_push(LOG_RING *queue, int level, char *text) {
+    LOG_RING *ring;
+    LOG_RECORD *rec;
+    unsigned long tid;
+#ifdef USE_PTHREAD
+    int used;
+#endif
+
+    tid=stunnel_thread_id();
+#ifdef USE_PTHREAD
+    ring=queue+(tid^tid>>8^tid>>16)%LOG_RINGS;
+    pthread_mutex_lock(&ring->mutex);
+#else
+    ring=queue;
+#endif
+    if(ring->head-ring->tail==LOG_RING_SIZE) { /* full: drop the oldest */
+        ring->tail++;
+        ring->dropped++;
+    }
+    rec=ring->record+ring->head%LOG_RING_SIZE;
+    rec->time=time(NULL);
+    rec->level=level;
+    rec->pid=stunnel_process_id();
+    rec->tid=tid;
+    memcpy(rec->text, text, strlen(text)+1); /* both are STRLEN bytes */
+    ring->head++;
+#ifdef USE_PTHREAD
+    used=ring->head-ring->tail;
+    pthread_mutex_unlock(&ring->mutex);
+    if(used==LOG_RING_SIZE/2) { /* wake up the writer early */
+        pthread_mutex_lock(&wakeup_mutex);
+        pthread_cond_signal(&wakeup_cond);
+        pthread_mutex_unlock(&wakeup_mutex);
+    }
+#endif
+}
+
+    /* write all the queued messages */
+void log_flush(void) {
+    LOG_RING *queue=rings;
+
+    if(queue)
+        log_batch(queue);
+}
+
+static void log_batch(LOG_RING *queue) {
+    LOG_RING *ring;
+    int i, n;
+    char text[STRLEN], line[STRLEN];
+
+#ifdef USE_PTHREAD
+    pthread_mutex_lock(&output_mutex); /* one batch at a time */
+#endif
+    for(ring=queue; ring<queue+LOG_RINGS; ring++) {
+#ifdef USE_PTHREAD
+        pthread_mutex_lock(&ring->mutex);
+#endif
+        for(n=0; ring->tail!=ring->head; n++, ring->tail++)
+            memcpy(batch+n, ring->record+ring->tail%LOG_RING_SIZE,
+                sizeof(LOG_RECORD));
+        dropped_total+=ring->dropped;
+        ring->dropped=0;
+#ifdef USE_PTHREAD
+        pthread_mutex_unlock(&ring->mutex);
+#endif
+        if(!n)
+            continue;
+#ifndef __vms
+        if(!outfile && options.option.syslog) {
+            for(i=0; i<n; i++)
+                syslog(batch[i].level, "LOG%d[%lu:%lu]: %s", batch[i].level,
+                    batch[i].pid, batch[i].tid, batch[i].text);
+            continue;
+        }
+#endif
+        for(i=0; i<n; i++) { /* buffered: written by file_flush() below */
+            log_line(line, batch[i].time, batch[i].level,
+                batch[i].pid, batch[i].tid, batch[i].text);
+            file_putline(outfile, line);
+        }
+    }
+    file_flush(outfile); /* the whole batch at once */
+    if(dropped_total!=dropped_reported) {
+        sprintf(text, "%lu log message(s) dropped",
+            dropped_total-dropped_reported);
+        dropped_reported=dropped_total;
+        log_sync(LOG_WARNING, text);
+    }
+#ifdef USE_PTHREAD
+    pthread_mutex_unlock(&output_mutex);
+#endif
+}
+
+unsigned long log_dropped(void) {
+    return dropped_total;
+}
+
+#ifdef USE_PTHREAD
+static void *log_writer(void *arg) {
+    struct timeval now;
+    struct timespec timeout;
+    int stop;
+
+    s_log(LOG_DEBUG, "Log writer thread started");
+    do {
+        gettimeofday(&now, NULL);
+        timeout.tv_sec=now.tv_sec;
+        timeout.tv_nsec=now.tv_usec*1000+100000000; /* 100ms */
+        if(timeout.tv_nsec>=1000000000) {
+            timeout.tv_sec++;
+            timeout.tv_nsec-=1000000000;
+        }
+        pthread_mutex_lock(&wakeup_mutex);
+        if(!writer_stop)
+            pthread_cond_timedwait(&wakeup_cond, &wakeup_mutex, &timeout);
+        stop=writer_stop;
+        pthread_mutex_unlock(&wakeup_mutex);
+        log_flush();
+        access_flush(); /* the access log is batched the same way */
+    } while(!stop);
+    return NULL;
+}
+#endif
+
+#endif /* LOG_ASYNC */
+
 void log_raw(const char *format, ...) {
     va_list arglist;
     char text[STRLEN];
@@ -125,6 +407,7 @@ void log_raw(const char *format, ...) {
     win_log(text);
 #else
     file_putline(outfile, text);
+    file_flush(outfile);
 #endif
 }
 
@@ -36,6 +36,8 @@
 #ifndef USE_WIN32
 static int signal_pipe[2]={-1, -1};
 static char signal_buffer[16];
+static int volatile reload_requested=0, upgrade_requested=0;
+static int volatile terminate_requested=0;
 static void sigchld_handler(int);
 static void signal_pipe_empty(void);
 #ifdef USE_FORK
@@ -44,6 +46,9 @@ static void client_status(void); /* dead children detected */
 #endif /* !defined(USE_WIN32) */
 
 static void setnonblock(int, unsigned long);
+static char *line_end(char *, int);
+static int line_wait(CLI *, int);
+static int fdgetline_raw(CLI *, int, char *);
 
 #ifdef USE_POLL
 
@@ -137,12 +142,16 @@ static void scan_waiting_queue(void) {
     s_log(LOG_DEBUG, "Waiting %d second(s) for %d file descriptor(s)",
         min_timeout, nfds);
 #endif
+    log_flush(); /* write the messages queued since the last poll() */
+    access_flush();
     do { /* skip "Interrupted system call" errors */
         retry=0;
         retval=poll(ufds, nfds, min_timeout<0 ? -1 : 1000*min_timeout);
         if(retval>0 && signal_revents && (*signal_revents & POLLIN)) {
             signal_pipe_empty(); /* no timeout -> main loop */
-            retry=1;
+            /* SIGHUP, SIGUSR2 or SIGTERM -> wake up the main loop */
+            retry=!reload_requested && !upgrade_requested &&
+                !terminate_requested;
         }
     } while(retry || (retval<0 && get_last_socket_error()==EINTR));
     time(&now);
@@ -222,7 +231,7 @@ int s_poll_wait(s_poll_set *fds, int timeout) {
             s_log(LOG_DEBUG, "Current context: %ld", ready_head->id);
             if(to_free) {
                 s_log(LOG_DEBUG, "Releasing context %ld", to_free->id);
-                free(to_free);
+                release_context(to_free);
                 to_free=NULL;
             }
         }
@@ -231,7 +240,7 @@ int s_poll_wait(s_poll_set *fds, int timeout) {
         /* it's illegal to deallocate the stack of the current context */
         if(to_free) {
             s_log(LOG_DEBUG, "Releasing context %ld", to_free->id);
-            free(to_free);
+            release_context(to_free);
         }
         to_free=ctx;
         while(!ready_head) /* no context ready */
@@ -252,9 +261,11 @@ int s_poll_wait(s_poll_set *fds, int timeout) {
     do { /* skip "Interrupted system call" errors */
         retry=0;
         retval=poll(fds->ufds, fds->nfds, timeout<0 ? -1 : 1000*timeout);
-        if(timeout<0 && retval>0 && s_poll_canread(fds, signal_pipe[0])) {
+        if(retval>0 && s_poll_canread(fds, signal_pipe[0])) {
             signal_pipe_empty(); /* no timeout -> main loop */
-            retry=1;
+            /* SIGHUP, SIGUSR2 or SIGTERM -> return to the main loop */
+            retry=timeout<0 && !reload_requested && !upgrade_requested &&
+                !terminate_requested;
         }
     } while(retry || (retval<0 && get_last_socket_error()==EINTR));
     return retval;
@@ -304,9 +315,11 @@ int s_poll_wait(s_poll_set *fds, int timeout) {
         }
         retval=select(fds->max+1, &fds->orfds, &fds->owfds, NULL, tv_ptr);
 #ifndef USE_WIN32
-        if(timeout<0 && retval>0 && s_poll_canread(fds, signal_pipe[0])) {
+        if(retval>0 && s_poll_canread(fds, signal_pipe[0])) {
             signal_pipe_empty(); /* no timeout -> main loop */
-            retry=1;
+            /* SIGHUP, SIGUSR2 or SIGTERM -> return to the main loop */
+            retry=timeout<0 && !reload_requested && !upgrade_requested &&
+                !terminate_requested;
         }
 #endif
     } while(retry || (retval<0 && get_last_socket_error()==EINTR));
@@ -338,11 +351,67 @@ static void sigchld_handler(int sig) { /* SIGCHLD detected */
     errno=save_errno;
 }
 
+void signal_reload(void) { /* called from the SIGHUP handler */
+    int save_errno;
+
+    save_errno=errno;
+    reload_requested=1;
+    write(signal_pipe[1], signal_buffer, 1); /* wake up the main loop */
+    errno=save_errno;
+}
+
+int reload_pending(void) { /* SIGHUP received since the last call */
+    if(!reload_requested)
+        return 0;
+    reload_requested=0;
+    return 1;
+}
+
+void signal_upgrade(void) { /* called from the SIGUSR2 handler */
+    int save_errno;
+
+    save_errno=errno;
+    upgrade_requested=1;
+    write(signal_pipe[1], signal_buffer, 1); /* wake up the main loop */
+    errno=save_errno;
+}
+
+int upgrade_pending(void) { /* SIGUSR2 received since the last call */
+    if(!upgrade_requested)
+        return 0;
+    upgrade_requested=0;
+    return 1;
+}
+
+void signal_terminate(int sig) { /* called from the SIGTERM handler */
+    int save_errno;
+
+    save_errno=errno;
+    terminate_requested=sig;
+    write(signal_pipe[1], signal_buffer, 1); /* wake up the main loop */
+    errno=save_errno;
+}
+
+int terminate_pending(void) { /* the terminating signal or 0 */
+    return terminate_requested;
+}
+
+    /* called again by each UCONTEXT worker: the pipe inherited from the
+     * master would be shared with the other workers, which could read the
+     * byte written by our signal handler and leave us asleep */
 int signal_pipe_init(void) {
+    int old[2];
+
+    old[0]=signal_pipe[0];
+    old[1]=signal_pipe[1];
     if(pipe(signal_pipe)) {
         ioerror("pipe");
         exit(1);
     }
+    if(old[0]>=0) { /* inherited pipe */
+        close(old[0]);
+        close(old[1]);
+    }
     alloc_fd(signal_pipe[0]);
     alloc_fd(signal_pipe[1]);
 #ifdef FD_CLOEXEC
@@ -354,6 +423,10 @@ int signal_pipe_init(void) {
     return signal_pipe[0];
 }
 
+int signal_pipe_fd(void) {
+    return signal_pipe[0];
+}
+
 static void signal_pipe_empty(void) {
     s_log(LOG_DEBUG, "Cleaning up the signal pipe");
     read(signal_pipe[0], signal_buffer, sizeof(signal_buffer));
@@ -486,7 +559,7 @@ int set_socket_options(int s, int type) {
     return 0; /* OK */
 }
 
-void write_blocking(CLI *c, int fd, u8 *ptr, int len) {
+int write_blocking(CLI *c, int fd, u8 *ptr, int len) {
         /* simulate a blocking write */
     s_poll_set fds;
     int num;
@@ -497,108 +570,202 @@ void write_blocking(CLI *c, int fd, u8 *ptr, int len) {
         switch(s_poll_wait(&fds, c->opt->timeout_busy)) {
         case -1:
             sockerror("write_blocking: s_poll_wait");
-            longjmp(c->err, 1); /* error */
+            return -1; /* error */
         case 0:
             s_log(LOG_INFO, "write_blocking: s_poll_wait timeout");
-            longjmp(c->err, 1); /* timeout */
+            c->stats.timeouts[TIMEOUT_BUSY]++;
+            return -1; /* timeout */
         case 1:
             break; /* OK */
         default:
             s_log(LOG_ERR, "write_blocking: s_poll_wait unknown result");
-            longjmp(c->err, 1); /* error */
+            return -1; /* error */
         }
         num=writesocket(fd, ptr, len);
         switch(num) {
         case -1: /* error */
             sockerror("writesocket (write_blocking)");
-            longjmp(c->err, 1);
+            return -1;
         }
         ptr+=num;
         len-=num;
     }
+    return 0; /* OK */
 }
 
-void read_blocking(CLI *c, int fd, u8 *ptr, int len) {
+int read_blocking(CLI *c, int fd, u8 *ptr, int len) {
         /* simulate a blocking read */
     s_poll_set fds;
     int num;
 
+    if(c->line_fd==fd) /* the peeked data is about to be consumed */
+        c->line_fd=-1;
     while(len>0) {
         s_poll_zero(&fds);
         s_poll_add(&fds, fd, 1, 0); /* read */
         switch(s_poll_wait(&fds, c->opt->timeout_busy)) {
         case -1:
             sockerror("read_blocking: s_poll_wait");
-            longjmp(c->err, 1); /* error */
+            return -1; /* error */
         case 0:
             s_log(LOG_INFO, "read_blocking: s_poll_wait timeout");
-            longjmp(c->err, 1); /* timeout */
+            c->stats.timeouts[TIMEOUT_BUSY]++;
+            return -1; /* timeout */
         case 1:
             break; /* OK */
         default:
             s_log(LOG_ERR, "read_blocking: s_poll_wait unknown result");
-            longjmp(c->err, 1); /* error */
+            return -1; /* error */
         }
         num=readsocket(fd, ptr, len);
         switch(num) {
         case -1: /* error */
             sockerror("readsocket (read_blocking)");
-            longjmp(c->err, 1);
+            return -1;
         case 0: /* EOF */
             s_log(LOG_ERR, "Unexpected socket close (read_blocking)");
-            longjmp(c->err, 1);
+            return -1;
         }
         ptr+=num;
         len-=num;
     }
+    return 0; /* OK */
 }
 
-void fdputline(CLI *c, int fd, char *line) {
+int fdputline(CLI *c, int fd, char *line) {
     char tmpline[STRLEN];
     const char crlf[]="\r\n";
     int len;
 
     if(strlen(line)+2>=STRLEN) { /* 2 for crlf */
         s_log(LOG_ERR, "Line too long in fdputline");
-        longjmp(c->err, 1);
+        return -1;
     }
     safecopy(tmpline, line);
     safeconcat(tmpline, crlf);
     len=strlen(tmpline);
-    write_blocking(c, fd, tmpline, len);
+    if(write_blocking(c, fd, tmpline, len))
+        return -1;
     tmpline[len-2]='\0'; /* remove CRLF */
     safestring(tmpline);
     s_log(LOG_DEBUG, " -> %s", tmpline);
+    return 0; /* OK */
 }
 
-void fdgetline(CLI *c, int fd, char *line) {
+    /* read a line without reading past its end, so any data following it
+     * (e.g. the TLS handshake after STARTTLS) stays in the socket:
+     * the pending data is peeked into c->line_buff and only the bytes of
+     * the returned line are consumed; lines already seen in the peeked
+     * data are returned without waiting for the descriptor again;
+     * a partial line is consumed before waiting for the rest of it,
+     * otherwise the peeked data would keep the descriptor readable */
+int fdgetline(CLI *c, int fd, char *line) {
     char logline[STRLEN];
+    char *eol;
+    int len, i, ptr, got=0; /* got: bytes of c->line_buff already consumed */
+
+    if(c->line_fd!=fd) { /* peeked data of another descriptor */
+        c->line_fd=fd;
+        c->line_len=0;
+    }
+    while(!(eol=line_end(c->line_buff, c->line_len))) {
+        if(c->line_len==STRLEN) {
+            s_log(LOG_ERR, "Input line too long");
+            break;
+        }
+        if(got<c->line_len) { /* no end of line in the peeked data */
+            len=c->line_len-got;
+            if(readsocket(fd, c->line_buff+got, len)!=len) {
+                sockerror("readsocket (fdgetline)");
+                break;
+            }
+            got=c->line_len;
+        }
+        if(line_wait(c, fd))
+            break;
+        len=recv(fd, c->line_buff+got, STRLEN-got, MSG_PEEK);
+        if(len<0 && get_last_socket_error()==ENOTSOCK) { /* e.g. a pipe */
+            c->line_fd=-1;
+            return fdgetline_raw(c, fd, line);
+        }
+        if(len<0) {
+            sockerror("recv (fdgetline)");
+            break;
+        }
+        if(!len) {
+            s_log(LOG_ERR, "Unexpected socket close (fdgetline)");
+            break;
+        }
+        c->line_len=got+len;
+    }
+    if(!eol) {
+        c->line_fd=-1; /* the consumed part is lost */
+        return -1;
+    }
+    len=eol-c->line_buff+1;
+    if(readsocket(fd, line, len-got)!=len-got) { /* consume the rest */
+        sockerror("readsocket (fdgetline)");
+        c->line_fd=-1;
+        return -1;
+    }
+    for(i=ptr=0; i<len-1; i++) /* skip the terminator and CRs */
+        if(c->line_buff[i]!='\r')
+            line[ptr++]=c->line_buff[i];
+    line[ptr]='\0';
+    c->line_len-=len;
+    memmove(c->line_buff, c->line_buff+len, c->line_len);
+    safecopy(logline, line);
+    safestring(logline);
+    s_log(LOG_DEBUG, " <- %s", logline);
+    return 0; /* OK */
+}
+
+    /* find the end of the first line: LF or NUL */
+static char *line_end(char *buff, int len) {
+    int i;
+
+    for(i=0; i<len; i++)
+        if(buff[i]=='\n' || !buff[i])
+            return buff+i;
+    return NULL;
+}
+
+static int line_wait(CLI *c, int fd) {
     s_poll_set fds;
+
+    s_poll_zero(&fds);
+    s_poll_add(&fds, fd, 1, 0); /* read */
+    switch(s_poll_wait(&fds, c->opt->timeout_busy)) {
+    case -1:
+        sockerror("fdgetline: s_poll_wait");
+        return -1; /* error */
+    case 0:
+        s_log(LOG_INFO, "fdgetline: s_poll_wait timeout");
+        c->stats.timeouts[TIMEOUT_BUSY]++;
+        return -1; /* timeout */
+    case 1:
+        return 0; /* OK */
+    default:
+        s_log(LOG_ERR, "fdgetline: s_poll_wait unknown result");
+        return -1; /* error */
+    }
+}
+
+    /* byte by byte version for descriptors that can't be peeked */
+static int fdgetline_raw(CLI *c, int fd, char *line) {
+    char logline[STRLEN];
     int ptr;
 
     for(ptr=0;;) {
-        s_poll_zero(&fds);
-        s_poll_add(&fds, fd, 1, 0); /* read */
-        switch(s_poll_wait(&fds, c->opt->timeout_busy)) {
-        case -1:
-            sockerror("fdgetline: s_poll_wait");
-            longjmp(c->err, 1); /* error */
-        case 0:
-            s_log(LOG_INFO, "fdgetline: s_poll_wait timeout");
-            longjmp(c->err, 1); /* timeout */
-        case 1:
-            break; /* OK */
-        default:
-            s_log(LOG_ERR, "fdgetline: s_poll_wait unknown result");
-            longjmp(c->err, 1); /* error */
-        }
+        if(line_wait(c, fd))
+            return -1;
         switch(readsocket(fd, line+ptr, 1)) {
         case -1: /* error */
             sockerror("readsocket (fdgetline)");
-            longjmp(c->err, 1);
+            return -1;
         case 0: /* EOF */
             s_log(LOG_ERR, "Unexpected socket close (fdgetline)");
-            longjmp(c->err, 1);
+            return -1;
         }
         if(line[ptr]=='\r')
             continue;
@@ -608,13 +775,14 @@ void fdgetline(CLI *c, int fd, char *line) {
             break;
         if(++ptr==STRLEN) {
             s_log(LOG_ERR, "Input line too long");
-            longjmp(c->err, 1);
+            return -1;
         }
     }
     line[ptr]='\0';
     safecopy(logline, line);
     safestring(logline);
     s_log(LOG_DEBUG, " <- %s", logline);
+    return 0; /* OK */
 }
 
 int fdprintf(CLI *c, int fd, const char *format, ...) {
@@ -631,9 +799,10 @@ int fdprintf(CLI *c, int fd, const char *format, ...) {
     va_end(arglist);
     if(len<0) {
         s_log(LOG_ERR, "fdprintf: vs(n)printf failed");
-        longjmp(c->err, 1);
+        return -1;
     }
-    fdputline(c, fd, line);
+    if(fdputline(c, fd, line))
+        return -1;
     return len+2;
 }
 
@@ -641,7 +810,8 @@ int fdscanf(CLI *c, int fd, const char *format, char *buffer) {
     char line[STRLEN], lformat[STRLEN];
     int ptr, retval;
 
-    fdgetline(c, fd, line);
+    if(fdgetline(c, fd, line))
+        return -1;
 
     retval=sscanf(line, format, buffer);
     if(retval>=0)
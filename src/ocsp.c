@@ -0,0 +1,468 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (c) 1998-2006 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *                 All Rights Reserved
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   In addition, as a special exception, Michal Trojnara gives
+ *   permission to link the code of this program with the OpenSSL
+ *   library (or with modified versions of OpenSSL that use the same
+ *   license as OpenSSL), and distribute linked combinations including
+ *   the two.  You must obey the GNU General Public License in all
+ *   respects for all of the code used other than OpenSSL.  If you modify
+ *   this file, you may extend this exception to your version of the
+ *   file, but you are not obligated to do so.  If you do not wish to
+ *   do so, delete this exception statement from your version.
+ */
+
+/* OCSP stapling: the daemon loop keeps a DER encoded OCSP response for the
+ * certificate of each SSL context with the OCSP option.  The request is
+ * sent on a non-blocking socket driven by ocsp_check() between the calls
+ * to s_poll_wait(), so the fetch never blocks a handshake, and the status
+ * callback only copies the cached response.  The response is refreshed
+ * halfway to its nextUpdate time, or retried every OCSP_RETRY seconds
+ * while the responder fails and the old response is still valid. */
+
+#include "common.h"
+#include "prototypes.h"
+
+#ifdef HAVE_OCSP_STAPLING
+
+#define OCSP_MAX_AGE 86400 /* responses without nextUpdate or beyond */
+#define OCSP_MIN_REFRESH 60 /* seconds between two successful fetches */
+#define OCSP_RETRY 60 /* seconds after a failed fetch */
+#define OCSP_TIMEOUT 30 /* seconds for the responder to answer */
+
+typedef struct ocsp_staple {
+    struct ocsp_staple *next;
+    char *servname; /* first service using the SSL context */
+    char *host, *port, *path; /* responder */
+    X509 *cert, *issuer;
+    OCSP_CERTID *id;
+    X509_STORE *store; /* the issuer, for delegated responders */
+    int orphaned; /* the SSL context was freed */
+
+        /* stapled response, protected with CRIT_OCSP */
+    unsigned char *der;
+    int der_len;
+    time_t expires;
+
+        /* fetch state, only used by the main thread */
+    time_t next_fetch, timeout;
+    BIO *bio;
+    OCSP_REQ_CTX *req;
+    int fd, want_write;
+} OCSP_STAPLE;
+
+static OCSP_STAPLE *staples=NULL;
+static int staple_index=-1;
+
+static int load_cert(OCSP_STAPLE *, char *);
+static void staple_free_cb(void *, void *, CRYPTO_EX_DATA *, int, long, void *);
+static void staple_free(OCSP_STAPLE *);
+static int status_cb(SSL *, void *);
+static int fetch_start(OCSP_STAPLE *);
+static int fetch_step(OCSP_STAPLE *);
+static void fetch_stop(OCSP_STAPLE *);
+static int response_store(OCSP_STAPLE *, OCSP_RESPONSE *);
+static time_t asn1_time_bound(ASN1_GENERALIZEDTIME *, time_t);
+
+    /* enable stapling for a server SSL context, -1 on error */
+int ocsp_init(SSL_CTX *ctx, LOCAL_OPTIONS *section) {
+    OCSP_STAPLE *staple;
+    int use_ssl;
+
+    staple=calloc(1, sizeof(OCSP_STAPLE));
+    if(!staple) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    staple->fd=-1;
+    if(!OCSP_parse_url(section->ocsp_url,
+            &staple->host, &staple->port, &staple->path, &use_ssl)) {
+        s_log(LOG_ERR, "Invalid OCSP responder URL: %s",
+            section->ocsp_url);
+        staple_free(staple);
+        return -1;
+    }
+    if(use_ssl) {
+        s_log(LOG_ERR, "HTTPS OCSP responders are not supported: %s",
+            section->ocsp_url);
+        staple_free(staple);
+        return -1;
+    }
+    if(load_cert(staple, section->cert)) {
+        staple_free(staple);
+        return -1;
+    }
+    staple->servname=strdup(section->servname);
+    if(staple_index<0) /* marked as orphaned when its SSL context is freed */
+        staple_index=SSL_CTX_get_ex_new_index(0, "ocsp staple",
+            NULL, NULL, staple_free_cb);
+    SSL_CTX_set_ex_data(ctx, staple_index, staple);
+    SSL_CTX_set_tlsext_status_cb(ctx, status_cb);
+    SSL_CTX_set_tlsext_status_arg(ctx, staple);
+    staple->next=staples;
+    staples=staple;
+    s_log(LOG_DEBUG, "OCSP stapling enabled for service %s: %s",
+        section->servname, section->ocsp_url);
+    return 0; /* OK */
+}
+
+    /* the server certificate and its issuer from the same chain file */
+static int load_cert(OCSP_STAPLE *staple, char *file) {
+    BIO *bio;
+    X509 *x;
+
+    bio=BIO_new_file(file, "r");
+    if(!bio) {
+        sslerror("BIO_new_file");
+        return -1;
+    }
+    staple->cert=PEM_read_bio_X509(bio, NULL, NULL, NULL);
+    while(staple->cert && !staple->issuer &&
+            (x=PEM_read_bio_X509(bio, NULL, NULL, NULL))) {
+        if(X509_check_issued(x, staple->cert)==X509_V_OK)
+            staple->issuer=x;
+        else
+            X509_free(x);
+    }
+    BIO_free(bio);
+    ERR_clear_error(); /* end of file */
+    if(!staple->cert || !staple->issuer) {
+        s_log(LOG_ERR, "OCSP stapling needs the issuer certificate in %s",
+            file);
+        return -1;
+    }
+    staple->id=OCSP_cert_to_id(NULL, staple->cert, staple->issuer);
+    staple->store=X509_STORE_new();
+    if(!staple->id || !staple->store ||
+            !X509_STORE_add_cert(staple->store, staple->issuer)) {
+        sslerror("OCSP_cert_to_id");
+        return -1;
+    }
+#ifdef X509_V_FLAG_PARTIAL_CHAIN
+    X509_STORE_set_flags(staple->store, X509_V_FLAG_PARTIAL_CHAIN);
+#endif
+    return 0; /* OK */
+}
+
+static void staple_free_cb(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+        int idx, long argl, void *argp) {
+    OCSP_STAPLE *staple=ptr;
+
+    if(!staple)
+        return;
+    /* freed by ocsp_check() in the main thread */
+    enter_critical_section(CRIT_OCSP);
+    staple->orphaned=1;
+    leave_critical_section(CRIT_OCSP);
+}
+
+static void staple_free(OCSP_STAPLE *staple) {
+    if(staple->servname)
+        free(staple->servname);
+    if(staple->host)
+        OPENSSL_free(staple->host);
+    if(staple->port)
+        OPENSSL_free(staple->port);
+    if(staple->path)
+        OPENSSL_free(staple->path);
+    if(staple->cert)
+        X509_free(staple->cert);
+    if(staple->issuer)
+        X509_free(staple->issuer);
+    if(staple->id)
+        OCSP_CERTID_free(staple->id);
+    if(staple->store)
+        X509_STORE_free(staple->store);
+    if(staple->der)
+        free(staple->der);
+    free(staple);
+}
+
+    /* called by OpenSSL when a client asks for the certificate status */
+static int status_cb(SSL *ssl, void *arg) {
+    OCSP_STAPLE *staple=arg;
+    unsigned char *copy=NULL;
+    int len=0;
+
+    /* the response is for the cert file, not for ECDSAcert */
+    if(X509_cmp(SSL_get_certificate(ssl), staple->cert))
+        return SSL_TLSEXT_ERR_NOACK;
+    enter_critical_section(CRIT_OCSP);
+    if(staple->der && time(NULL)<staple->expires) {
+        copy=OPENSSL_malloc(staple->der_len); /* freed by OpenSSL */
+        if(copy) {
+            memcpy(copy, staple->der, staple->der_len);
+            len=staple->der_len;
+        }
+    }
+    leave_critical_section(CRIT_OCSP);
+    if(!copy)
+        return SSL_TLSEXT_ERR_NOACK; /* no valid response to staple */
+    SSL_set_tlsext_status_ocsp_resp(ssl, copy, len);
+    return SSL_TLSEXT_ERR_OK;
+}
+
+    /* start and advance the fetches, called by the daemon loop
+     * returns 1 if the descriptors of ocsp_fds() changed */
+int ocsp_check(void) {
+    OCSP_STAPLE **ptr, *staple;
+    int orphaned, changed=0;
+    time_t now;
+
+    ptr=&staples;
+    while((staple=*ptr)) {
+        enter_critical_section(CRIT_OCSP);
+        orphaned=staple->orphaned;
+        leave_critical_section(CRIT_OCSP);
+        if(orphaned) {
+            if(staple->req)
+                changed=1;
+            fetch_stop(staple);
+            *ptr=staple->next;
+            staple_free(staple);
+            continue;
+        }
+        now=time(NULL);
+        if(!staple->req && now>=staple->next_fetch && !fetch_start(staple))
+            changed=1;
+        if(staple->req && fetch_step(staple))
+            changed=1;
+        ptr=&staple->next;
+    }
+    return changed;
+}
+
+    /* add the descriptors of the fetches in progress */
+void ocsp_fds(s_poll_set *fds) {
+    OCSP_STAPLE *staple;
+
+    for(staple=staples; staple; staple=staple->next)
+        if(staple->req && staple->fd>=0)
+            s_poll_add(fds, staple->fd, !staple->want_write,
+                staple->want_write);
+}
+
+    /* seconds until ocsp_check() has something to do, -1 for never */
+int ocsp_timeout(void) {
+    OCSP_STAPLE *staple;
+    time_t now, next=0;
+
+    for(staple=staples; staple; staple=staple->next) {
+        if(staple->req) {
+            if(!next || staple->timeout<next)
+                next=staple->timeout;
+        } else if(!next || staple->next_fetch<next) {
+            next=staple->next_fetch;
+        }
+    }
+    if(!next)
+        return -1;
+    now=time(NULL);
+    return next>now ? (int)(next-now) : 0;
+}
+
+    /* returns 0 if a request was started */
+static int fetch_start(OCSP_STAPLE *staple) {
+    OCSP_REQUEST *request;
+    OCSP_CERTID *id;
+
+    s_log(LOG_DEBUG, "Requesting OCSP response for service %s from %s:%s",
+        staple->servname, staple->host, staple->port);
+    staple->next_fetch=time(NULL)+OCSP_RETRY; /* unless it succeeds */
+    request=OCSP_REQUEST_new();
+    id=OCSP_CERTID_dup(staple->id);
+    if(!request || !id || !OCSP_request_add0_id(request, id)) {
+        sslerror("OCSP_REQUEST_new");
+        if(id)
+            OCSP_CERTID_free(id);
+        if(request)
+            OCSP_REQUEST_free(request);
+        return -1;
+    }
+    staple->bio=BIO_new_connect(staple->host);
+    if(!staple->bio) {
+        sslerror("BIO_new_connect");
+        OCSP_REQUEST_free(request);
+        return -1;
+    }
+    BIO_set_conn_port(staple->bio, staple->port);
+    BIO_set_nbio(staple->bio, 1);
+    if(BIO_do_connect(staple->bio)<=0 && !BIO_should_retry(staple->bio)) {
+        s_log(LOG_ERR, "Cannot connect OCSP responder %s:%s",
+            staple->host, staple->port);
+        sslerror("BIO_do_connect");
+        fetch_stop(staple);
+        OCSP_REQUEST_free(request);
+        return -1;
+    }
+    staple->fd=BIO_get_fd(staple->bio, NULL);
+#if SSLEAY_VERSION_NUMBER >= 0x10000000L
+    staple->req=OCSP_sendreq_new(staple->bio, staple->path, NULL, -1);
+    if(staple->req && (!OCSP_REQ_CTX_add1_header(staple->req,
+            "Host", staple->host) ||
+            !OCSP_REQ_CTX_set1_req(staple->req, request))) {
+        OCSP_REQ_CTX_free(staple->req);
+        staple->req=NULL;
+    }
+#else
+    staple->req=OCSP_sendreq_new(staple->bio, staple->path, request, -1);
+#endif
+    OCSP_REQUEST_free(request);
+    if(!staple->req) {
+        sslerror("OCSP_sendreq_new");
+        fetch_stop(staple);
+        return -1;
+    }
+    staple->want_write=1;
+    staple->timeout=time(NULL)+OCSP_TIMEOUT;
+    return 0; /* OK */
+}
+
+    /* returns 1 if the fetch completed or its descriptor changed */
+static int fetch_step(OCSP_STAPLE *staple) {
+    OCSP_RESPONSE *response=NULL;
+    int rc, fd, want_write;
+
+    rc=OCSP_sendreq_nbio(&response, staple->req);
+    if(rc==-1) { /* would block */
+        if(time(NULL)>=staple->timeout) {
+            s_log(LOG_ERR, "OCSP responder %s:%s timed out",
+                staple->host, staple->port);
+            fetch_stop(staple);
+            return 1;
+        }
+        fd=BIO_get_fd(staple->bio, NULL);
+        want_write=BIO_should_write(staple->bio) ? 1 : 0;
+        if(fd==staple->fd && want_write==staple->want_write)
+            return 0;
+        staple->fd=fd;
+        staple->want_write=want_write;
+        return 1;
+    }
+    if(rc==0) {
+        s_log(LOG_ERR, "OCSP request to %s:%s failed",
+            staple->host, staple->port);
+        sslerror("OCSP_sendreq_nbio");
+    } else
+        response_store(staple, response);
+    if(response)
+        OCSP_RESPONSE_free(response);
+    fetch_stop(staple);
+    return 1;
+}
+
+    /* next_fetch was already set by fetch_start() or response_store() */
+static void fetch_stop(OCSP_STAPLE *staple) {
+    if(staple->req) {
+        OCSP_REQ_CTX_free(staple->req);
+        staple->req=NULL;
+    }
+    if(staple->bio) {
+        BIO_free_all(staple->bio);
+        staple->bio=NULL;
+    }
+    staple->fd=-1;
+}
+
+    /* check the response and make it the stapled one, -1 on error */
+static int response_store(OCSP_STAPLE *staple, OCSP_RESPONSE *response) {
+    OCSP_BASICRESP *basic;
+    STACK_OF(X509) *signers;
+    ASN1_GENERALIZEDTIME *this_update, *next_update;
+    unsigned char *der, *p;
+    int status=0, reason, len, ok=0;
+    time_t expires=0;
+
+    if(OCSP_response_status(response)!=OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+        s_log(LOG_ERR, "OCSP responder error: %s",
+            OCSP_response_status_str(OCSP_response_status(response)));
+        return -1;
+    }
+    basic=OCSP_response_get1_basic(response);
+    if(!basic) {
+        sslerror("OCSP_response_get1_basic");
+        return -1;
+    }
+    signers=sk_X509_new_null();
+    if(signers && sk_X509_push(signers, staple->issuer) &&
+            OCSP_basic_verify(basic, signers, staple->store,
+                OCSP_TRUSTOTHER)>0 &&
+            OCSP_resp_find_status(basic, staple->id, &status, &reason, NULL,
+                &this_update, &next_update) &&
+            OCSP_check_validity(this_update, next_update, 300, -1)) {
+        ok=1;
+        expires=asn1_time_bound(next_update, time(NULL)+OCSP_MAX_AGE);
+    }
+    if(signers)
+        sk_X509_free(signers);
+    OCSP_BASICRESP_free(basic);
+    if(!ok) {
+        s_log(LOG_ERR, "Invalid OCSP response for service %s",
+            staple->servname);
+        sslerror("OCSP_basic_verify");
+        return -1;
+    }
+    len=i2d_OCSP_RESPONSE(response, NULL);
+    der=len>0 ? malloc(len) : NULL;
+    if(!der) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    p=der;
+    i2d_OCSP_RESPONSE(response, &p);
+    enter_critical_section(CRIT_OCSP);
+    p=staple->der;
+    staple->der=der;
+    staple->der_len=len;
+    staple->expires=expires;
+    leave_critical_section(CRIT_OCSP);
+    if(p)
+        free(p);
+    /* refresh halfway to nextUpdate */
+    staple->next_fetch=time(NULL)+(expires-time(NULL))/2;
+    if(staple->next_fetch<time(NULL)+OCSP_MIN_REFRESH)
+        staple->next_fetch=time(NULL)+OCSP_MIN_REFRESH;
+    s_log(LOG_INFO, "OCSP response for service %s: %s, valid for %lds",
+        staple->servname, OCSP_cert_status_str(status),
+        (long)(expires-time(NULL)));
+    return 0; /* OK */
+}
+
+    /* the latest time not after t, at most max, found with X509_cmp_time()
+     * since old OpenSSL has no conversion of ASN1 time to time_t */
+static time_t asn1_time_bound(ASN1_GENERALIZEDTIME *t, time_t max) {
+    time_t low, high, mid;
+
+    low=time(NULL);
+    if(!t || X509_cmp_time(t, &max)>0)
+        return max;
+    high=max;
+    while(high-low>1) { /* t is after low and not after high */
+        mid=low+(high-low)/2;
+        if(X509_cmp_time(t, &mid)>0)
+            low=mid;
+        else
+            high=mid;
+    }
+    return low;
+}
+
+#endif /* HAVE_OCSP_STAPLING */
+
+/* End of ocsp.c */
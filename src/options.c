@@ -45,6 +45,8 @@
 
 static int parse_debug_level(char *);
 static int parse_ssl_option(char *);
+static int parse_ssl_version(char *);
+static char *ssl_version_name(int);
 static int print_socket_options(void);
 static void print_option(char *, int, OPT_UNION *);
 static int parse_socket_option(char *);
@@ -55,6 +57,7 @@ static char *base64(char *);
 #ifndef USE_WIN32
 static char **argalloc(char *);
 #endif
+static void config_append(LOCAL_OPTIONS *, char *);
 
 GLOBAL_OPTIONS options;
 LOCAL_OPTIONS local_options;
@@ -66,16 +69,176 @@ typedef enum {
     CMD_HELP
 } CMD;
 
+typedef enum { /* names handled by global_options() and service_options() */
+    OPT_UNKNOWN,
+    /* global options */
+    OPT_ACCESSLOG, OPT_ACCESSLOGSIZE, OPT_CERTCHECK, OPT_CHROOT, OPT_COMPRESSION,
+    OPT_DEBUG, OPT_DRAINTIMEOUT, OPT_EGD, OPT_ENGINE, OPT_ENGINECTRL, OPT_FOREGROUND,
+    OPT_OUTPUT, OPT_PID, OPT_RNDBYTES, OPT_RNDFILE, OPT_RNDOVERWRITE,
+    OPT_SERVICE, OPT_SETGID, OPT_SETUID, OPT_SOCKET, OPT_STATS, OPT_TASKBAR,
+    OPT_WORKERS,
+    /* service-level options */
+    OPT_ACCEPT, OPT_CAPATH, OPT_CAFILE, OPT_CERT, OPT_CIPHERS, OPT_CLIENT,
+    OPT_CONNECT, OPT_CRLPATH, OPT_CRLFILE, OPT_CURVES, OPT_DELAY,
+    OPT_EARLYDATA, OPT_ECDSACERT, OPT_ECDSAKEY, OPT_EXEC, OPT_EXECARGS,
+    OPT_IDENT, OPT_KEY, OPT_LOCAL, OPT_OCSP, OPT_OPTIONS, OPT_PINNEDPEERS,
+    OPT_PROTOCOL, OPT_PROTOCOLCREDENTIALS, OPT_PROTOCOLHOST, OPT_PTY,
+    OPT_RECORDSIZE, OPT_SESSION, OPT_SSLVERSIONMAX, OPT_SSLVERSIONMIN,
+    OPT_TIMEOUTBUSY, OPT_TIMEOUTCLOSE, OPT_TIMEOUTCONNECT, OPT_TIMEOUTIDLE,
+    OPT_TRANSPARENT, OPT_VERIFY
+} OPT_ID;
+
+typedef struct {
+    char *name;
+    OPT_ID id;
+} OPT_NAME;
+
+    /* sorted with option_cmp() before the first option_id() lookup */
+static OPT_NAME option_names[]={
+    /* global options */
+    {"accessLog", OPT_ACCESSLOG},
+    {"accessLogSize", OPT_ACCESSLOGSIZE},
+    {"certCheck", OPT_CERTCHECK},
+    {"chroot", OPT_CHROOT},
+    {"compression", OPT_COMPRESSION},
+    {"debug", OPT_DEBUG},
+    {"drainTimeout", OPT_DRAINTIMEOUT},
+    {"EGD", OPT_EGD},
+    {"engine", OPT_ENGINE},
+    {"engineCtrl", OPT_ENGINECTRL},
+    {"foreground", OPT_FOREGROUND},
+    {"output", OPT_OUTPUT},
+    {"pid", OPT_PID},
+    {"RNDbytes", OPT_RNDBYTES},
+    {"RNDfile", OPT_RNDFILE},
+    {"RNDoverwrite", OPT_RNDOVERWRITE},
+    {"service", OPT_SERVICE},
+    {"setgid", OPT_SETGID},
+    {"setuid", OPT_SETUID},
+    {"socket", OPT_SOCKET},
+    {"stats", OPT_STATS},
+    {"taskbar", OPT_TASKBAR},
+    {"workers", OPT_WORKERS},
+    /* service-level options */
+    {"accept", OPT_ACCEPT},
+    {"CApath", OPT_CAPATH},
+    {"CAfile", OPT_CAFILE},
+    {"cert", OPT_CERT},
+    {"ciphers", OPT_CIPHERS},
+    {"client", OPT_CLIENT},
+    {"connect", OPT_CONNECT},
+    {"CRLpath", OPT_CRLPATH},
+    {"CRLfile", OPT_CRLFILE},
+    {"curves", OPT_CURVES},
+    {"delay", OPT_DELAY},
+    {"earlyData", OPT_EARLYDATA},
+    {"ECDSAcert", OPT_ECDSACERT},
+    {"ECDSAkey", OPT_ECDSAKEY},
+    {"exec", OPT_EXEC},
+    {"execargs", OPT_EXECARGS},
+    {"ident", OPT_IDENT},
+    {"key", OPT_KEY},
+    {"local", OPT_LOCAL},
+    {"OCSP", OPT_OCSP},
+    {"options", OPT_OPTIONS},
+    {"pinnedPeers", OPT_PINNEDPEERS},
+    {"protocol", OPT_PROTOCOL},
+    {"protocolCredentials", OPT_PROTOCOLCREDENTIALS},
+    {"protocolHost", OPT_PROTOCOLHOST},
+    {"pty", OPT_PTY},
+    {"recordSize", OPT_RECORDSIZE},
+    {"session", OPT_SESSION},
+    {"sslVersionMax", OPT_SSLVERSIONMAX},
+    {"sslVersionMin", OPT_SSLVERSIONMIN},
+    {"TIMEOUTbusy", OPT_TIMEOUTBUSY},
+    {"TIMEOUTclose", OPT_TIMEOUTCLOSE},
+    {"TIMEOUTconnect", OPT_TIMEOUTCONNECT},
+    {"TIMEOUTidle", OPT_TIMEOUTIDLE},
+    {"transparent", OPT_TRANSPARENT},
+    {"verify", OPT_VERIFY},
+};
+#define OPTION_NAMES (sizeof(option_names)/sizeof(OPT_NAME))
+
+static OPT_ID option_id(char *);
+static int option_cmp(const void *, const void *);
+
+    /* saved by parse_config() for reload_config() */
+static char *config_name=NULL, *config_parameter=NULL;
+static int reloading=0; /* only the service sections are replaced */
+
 static char *option_not_found=
     "Specified option name is not valid here";
 
-static char *global_options(CMD cmd, char *opt, char *arg) {
+static char *global_options(CMD cmd, OPT_ID id, char *arg) {
     char *tmpstr;
 
     if(cmd==CMD_DEFAULT || cmd==CMD_HELP) {
         log_raw("Global options");
     }
 
+    /* accessLog */
+#ifndef USE_WIN32
+    switch(cmd) {
+    case CMD_INIT:
+        options.access_log=NULL;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_ACCESSLOG)
+            break;
+        options.access_log=stralloc(arg);
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = file to append per-connection records to",
+            "accessLog");
+        break;
+    }
+#endif
+
+    /* accessLogSize */
+#ifndef USE_WIN32
+    switch(cmd) {
+    case CMD_INIT:
+        options.access_log_size=0;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_ACCESSLOGSIZE)
+            break;
+        if(arg[0]<'0' || arg[0]>'9')
+            return "Illegal access log size";
+        options.access_log_size=strtoul(arg, NULL, 10);
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        log_raw("%-15s = %d (never rotate)", "accessLogSize", 0);
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = bytes after which the access log is rotated",
+            "accessLogSize");
+        break;
+    }
+#endif
+
+    /* certCheck */
+    switch(cmd) {
+    case CMD_INIT:
+        options.cert_check=0;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_CERTCHECK)
+            break;
+        if(!isdigit((unsigned char)*arg))
+            return "Illegal certificate check interval";
+        options.cert_check=atoi(arg);
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = seconds between certificate file checks",
+            "certCheck");
+        break;
+    }
+
     /* chroot */
 #ifdef HAVE_CHROOT
     switch(cmd) {
@@ -83,7 +246,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.chroot_dir=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "chroot"))
+        if(id!=OPT_CHROOT)
             break;
         options.chroot_dir=stralloc(arg);
         return NULL; /* OK */
@@ -101,7 +264,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.compression=COMP_NONE;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "compression"))
+        if(id!=OPT_COMPRESSION)
             break;
         if(!strcasecmp(arg, "zlib"))
             options.compression=COMP_ZLIB;
@@ -131,7 +294,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
 #endif
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "debug"))
+        if(id!=OPT_DEBUG)
             break;
         if(!parse_debug_level(arg))
             return "Illegal debug argument";
@@ -144,6 +307,29 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         break;
     }
 
+    /* drainTimeout */
+#ifndef USE_WIN32
+    switch(cmd) {
+    case CMD_INIT:
+        options.drain_timeout=300;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_DRAINTIMEOUT)
+            break;
+        if(!isdigit((unsigned char)*arg))
+            return "Illegal drain timeout";
+        options.drain_timeout=atoi(arg);
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        log_raw("%-15s = %d seconds", "drainTimeout", 300);
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = seconds to finish connections after an upgrade",
+            "drainTimeout");
+        break;
+    }
+#endif
+
     /* EGD is only supported when compiled with OpenSSL 0.9.5a or later */
 #if SSLEAY_VERSION_NUMBER >= 0x0090581fL
     switch(cmd) {
@@ -151,7 +337,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.egd_sock=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "EGD"))
+        if(id!=OPT_EGD)
             break;
         options.egd_sock=stralloc(arg);
         return NULL; /* OK */
@@ -172,7 +358,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
     case CMD_INIT:
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "engine"))
+        if(id!=OPT_ENGINE)
             break;
         open_engine(arg);
         return NULL; /* OK */
@@ -189,7 +375,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
     case CMD_INIT:
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "engineCtrl"))
+        if(id!=OPT_ENGINECTRL)
             break;
         tmpstr=strchr(arg, ':');
         if(tmpstr)
@@ -213,7 +399,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.option.foreground=0;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "foreground"))
+        if(id!=OPT_FOREGROUND)
             break;
         if(!strcasecmp(arg, "yes"))
             options.option.foreground=1;
@@ -237,7 +423,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.output_file=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "output"))
+        if(id!=OPT_OUTPUT)
             break;
         options.output_file=stralloc(arg);
         return NULL; /* OK */
@@ -255,7 +441,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.pidfile=PIDFILE;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "pid"))
+        if(id!=OPT_PID)
             break;
         if(arg[0]) /* is argument not empty? */
             options.pidfile=stralloc(arg);
@@ -277,7 +463,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.random_bytes=RANDOM_BYTES;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "RNDbytes"))
+        if(id!=OPT_RNDBYTES)
             break;
         options.random_bytes=atoi(arg);
         return NULL; /* OK */
@@ -295,7 +481,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.rand_file=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "RNDfile"))
+        if(id!=OPT_RNDFILE)
             break;
         options.rand_file=stralloc(arg);
         return NULL; /* OK */
@@ -315,7 +501,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.option.rand_write=1;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "RNDoverwrite"))
+        if(id!=OPT_RNDOVERWRITE)
             break;
         if(!strcasecmp(arg, "yes"))
             options.option.rand_write=1;
@@ -342,7 +528,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
 #endif
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "service"))
+        if(id!=OPT_SERVICE)
             break;
         local_options.servname=stralloc(arg);
 #if defined(USE_WIN32) && !defined(_WIN32_WCE)
@@ -366,7 +552,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.setgid_group=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "setgid"))
+        if(id!=OPT_SETGID)
             break;
         options.setgid_group=stralloc(arg);
         return NULL; /* OK */
@@ -385,7 +571,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.setuid_user=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "setuid"))
+        if(id!=OPT_SETUID)
             break;
         options.setuid_user=stralloc(arg);
         return NULL; /* OK */
@@ -402,7 +588,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
     case CMD_INIT:
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "socket"))
+        if(id!=OPT_SOCKET)
             break;
         if(!parse_socket_option(arg))
             return "Illegal socket option";
@@ -415,6 +601,25 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         break;
     }
 
+    /* stats */
+#ifndef USE_WIN32
+    switch(cmd) {
+    case CMD_INIT:
+        options.stats_socket=NULL;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_STATS)
+            break;
+        options.stats_socket=stralloc(arg);
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = UNIX socket to report statistics", "stats");
+        break;
+    }
+#endif
+
     /* taskbar */
 #ifdef USE_WIN32
     switch(cmd) {
@@ -422,7 +627,7 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
         options.option.taskbar=1;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "taskbar"))
+        if(id!=OPT_TASKBAR)
             break;
         if(!strcasecmp(arg, "yes"))
             options.option.taskbar=1;
@@ -440,13 +645,41 @@ static char *global_options(CMD cmd, char *opt, char *arg) {
     }
 #endif
 
+    /* workers */
+#ifdef USE_UCONTEXT
+    switch(cmd) {
+    case CMD_INIT:
+        options.workers=1;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_WORKERS)
+            break;
+        if(!strcasecmp(arg, "auto")) {
+            options.workers=0; /* one per online CPU */
+            return NULL; /* OK */
+        }
+        if(atoi(arg)>0)
+            options.workers=atoi(arg);
+        else
+            return "Illegal number of workers";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        log_raw("%-15s = %d", "workers", 1);
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = auto|number of scheduler processes (one per CPU)",
+            "workers");
+        break;
+    }
+#endif
+
     if(cmd==CMD_EXEC)
         return option_not_found;
     return NULL; /* OK */
 }
 
 static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
-        char *opt, char *arg) {
+        OPT_ID id, char *arg) {
     int tmp;
 
     if(cmd==CMD_DEFAULT || cmd==CMD_HELP) {
@@ -462,7 +695,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->local_addr.addr[0].in.sin_family=AF_INET;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "accept"))
+        if(id!=OPT_ACCEPT)
             break;
         section->option.accept=1;
         if(!name2addrlist(&section->local_addr, arg, DEFAULT_ANY))
@@ -485,7 +718,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->ca_dir=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "CApath"))
+        if(id!=OPT_CAPATH)
             break;
         if(arg[0]) /* not empty */
             section->ca_dir=stralloc(arg);
@@ -513,7 +746,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->ca_file=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "CAfile"))
+        if(id!=OPT_CAFILE)
             break;
         if(arg[0]) /* not empty */
             section->ca_file=stralloc(arg);
@@ -542,7 +775,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
 #endif
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "cert"))
+        if(id!=OPT_CERT)
             break;
         section->cert=stralloc(arg);
         section->option.cert=1;
@@ -558,15 +791,15 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
     /* ciphers */
     switch(cmd) {
     case CMD_INIT:
-        section->cipher_list=SSL_DEFAULT_CIPHER_LIST;
+        section->cipher_list=DEFAULT_CIPHER_LIST;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "ciphers"))
+        if(id!=OPT_CIPHERS)
             break;
         section->cipher_list=stralloc(arg);
         return NULL; /* OK */
     case CMD_DEFAULT:
-        log_raw("%-15s = %s", "ciphers", SSL_DEFAULT_CIPHER_LIST);
+        log_raw("%-15s = %s", "ciphers", DEFAULT_CIPHER_LIST);
         break;
     case CMD_HELP:
         log_raw("%-15s = list of permitted SSL ciphers", "ciphers");
@@ -579,7 +812,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->option.client=0;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "client"))
+        if(id!=OPT_CLIENT)
             break;
         if(!strcasecmp(arg, "yes"))
             section->option.client=1;
@@ -604,7 +837,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->remote_addr.num=0;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "connect"))
+        if(id!=OPT_CONNECT)
             break;
         section->option.remote=1;
         section->remote_address=stralloc(arg);
@@ -628,7 +861,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->crl_dir=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "CRLpath"))
+        if(id!=OPT_CRLPATH)
             break;
         if(arg[0]) /* not empty */
             section->crl_dir=stralloc(arg);
@@ -648,7 +881,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->crl_file=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "CRLfile"))
+        if(id!=OPT_CRLFILE)
             break;
         if(arg[0]) /* not empty */
             section->crl_file=stralloc(arg);
@@ -662,13 +895,35 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         break;
     }
 
+    /* curves */
+    switch(cmd) {
+    case CMD_INIT:
+        section->curves=DEFAULT_CURVES;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_CURVES)
+            break;
+        if(arg[0]) /* not empty */
+            section->curves=stralloc(arg);
+        else
+            section->curves=NULL;
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        log_raw("%-15s = %s", "curves", DEFAULT_CURVES);
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = list of ECDHE curves in preference order", "curves");
+        log_raw("%18sempty for the library defaults", "");
+        break;
+    }
+
     /* delay */
     switch(cmd) {
     case CMD_INIT:
         section->option.delayed_lookup=0;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "delay"))
+        if(id!=OPT_DELAY)
             break;
         if(!strcasecmp(arg, "yes"))
             section->option.delayed_lookup=1;
@@ -685,6 +940,70 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         break;
     }
 
+    /* earlyData */
+#ifdef HAVE_EARLY_DATA
+    switch(cmd) {
+    case CMD_INIT:
+        section->option.early_data=0;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_EARLYDATA)
+            break;
+        if(!strcasecmp(arg, "yes"))
+            section->option.early_data=1;
+        else if(!strcasecmp(arg, "no"))
+            section->option.early_data=0;
+        else
+            return "argument should be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = yes|no send or accept TLS 1.3 0-RTT data",
+            "earlyData");
+        log_raw("%18sonly for replay-safe application protocols", "");
+        break;
+    }
+#endif
+
+    /* ECDSAcert */
+    switch(cmd) {
+    case CMD_INIT:
+        section->ecdsa_cert=NULL;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_ECDSACERT)
+            break;
+        if(arg[0]) /* not empty */
+            section->ecdsa_cert=stralloc(arg);
+        else
+            section->ecdsa_cert=NULL;
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = ECDSA certificate chain used alongside 'cert'",
+            "ECDSAcert");
+        break;
+    }
+
+    /* ECDSAkey */
+    switch(cmd) {
+    case CMD_INIT:
+        section->ecdsa_key=NULL;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_ECDSAKEY)
+            break;
+        section->ecdsa_key=stralloc(arg);
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = ECDSA certificate private key", "ECDSAkey");
+        break;
+    }
+
     /* exec */
 #ifndef USE_WIN32
     switch(cmd) {
@@ -693,7 +1012,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->execname=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "exec"))
+        if(id!=OPT_EXEC)
             break;
         section->option.program=1;
         section->execname=stralloc(arg);
@@ -714,7 +1033,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->execargs=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "execargs"))
+        if(id!=OPT_EXECARGS)
             break;
         section->execargs=argalloc(arg);
         return NULL; /* OK */
@@ -733,7 +1052,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->username=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "ident"))
+        if(id!=OPT_IDENT)
             break;
         section->username=stralloc(arg);
         return NULL; /* OK */
@@ -750,7 +1069,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->key=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "key"))
+        if(id!=OPT_KEY)
             break;
         section->key=stralloc(arg);
         return NULL; /* OK */
@@ -769,7 +1088,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->source_addr.addr[0].in.sin_family=AF_INET;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "local"))
+        if(id!=OPT_LOCAL)
             break;
         if(!hostport2addrlist(&section->source_addr, arg, "0"))
             exit(2);
@@ -782,13 +1101,35 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         break;
     }
 
+#ifdef HAVE_OCSP_STAPLING
+    /* OCSP */
+    switch(cmd) {
+    case CMD_INIT:
+        section->ocsp_url=NULL;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_OCSP)
+            break;
+        if(arg[0]) /* not empty */
+            section->ocsp_url=stralloc(arg);
+        else
+            section->ocsp_url=NULL;
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = OCSP responder URL for stapled responses", "OCSP");
+        break;
+    }
+#endif
+
     /* options */
     switch(cmd) {
     case CMD_INIT:
         section->ssl_options=0;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "options"))
+        if(id!=OPT_OPTIONS)
             break;
         tmp=parse_ssl_option(arg);
         if(!tmp)
@@ -803,13 +1144,34 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         break;
     }
 
+    /* pinnedPeers */
+    switch(cmd) {
+    case CMD_INIT:
+        section->pinned_file=NULL;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_PINNEDPEERS)
+            break;
+        if(arg[0]) /* not empty */
+            section->pinned_file=stralloc(arg);
+        else
+            section->pinned_file=NULL;
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = file with SHA-256 fingerprints of accepted peers",
+            "pinnedPeers");
+        break;
+    }
+
     /* protocol */
     switch(cmd) {
     case CMD_INIT:
         section->protocol=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "protocol"))
+        if(id!=OPT_PROTOCOL)
             break;
         section->protocol=stralloc(arg);
         return NULL; /* OK */
@@ -828,7 +1190,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->protocol_credentials=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "protocolCredentials"))
+        if(id!=OPT_PROTOCOLCREDENTIALS)
             break;
         section->protocol_credentials=base64(arg);
         return NULL; /* OK */
@@ -846,7 +1208,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->protocol_host=NULL;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "protocolHost"))
+        if(id!=OPT_PROTOCOLHOST)
             break;
         section->protocol_host=stralloc(arg);
         return NULL; /* OK */
@@ -865,7 +1227,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->option.pty=0;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "pty"))
+        if(id!=OPT_PTY)
             break;
         if(!strcasecmp(arg, "yes"))
             section->option.pty=1;
@@ -883,13 +1245,37 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
     }
 #endif
 
+    /* recordSize */
+    switch(cmd) {
+    case CMD_INIT:
+        section->record_size=0; /* dynamic */
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_RECORDSIZE)
+            break;
+        if(!strcasecmp(arg, "dynamic"))
+            section->record_size=0;
+        else if(atoi(arg)>=512 && atoi(arg)<=BUFFSIZE)
+            section->record_size=atoi(arg);
+        else
+            return "Illegal record size";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        log_raw("%-15s = dynamic", "recordSize");
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = dynamic|bytes maximum size of TLS records",
+            "recordSize");
+        break;
+    }
+
     /* session */
     switch(cmd) {
     case CMD_INIT:
         section->session_timeout=300;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "session"))
+        if(id!=OPT_SESSION)
             break;
         if(atoi(arg)>0)
             section->session_timeout=atoi(arg);
@@ -904,13 +1290,57 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         break;
     }
 
+    /* sslVersionMax */
+    switch(cmd) {
+    case CMD_INIT:
+        section->ssl_version_max=0; /* the highest supported */
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_SSLVERSIONMAX)
+            break;
+        section->ssl_version_max=parse_ssl_version(arg);
+        if(section->ssl_version_max<0)
+            return "Illegal SSL protocol version";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        log_raw("%-15s = %s", "sslVersionMax", ssl_version_name(0));
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = all|SSLv3|TLSv1|TLSv1.1|TLSv1.2|TLSv1.3",
+            "sslVersionMax");
+        log_raw("%18shighest protocol version to negotiate", "");
+        break;
+    }
+
+    /* sslVersionMin */
+    switch(cmd) {
+    case CMD_INIT:
+        section->ssl_version_min=TLS1_VERSION;
+        break;
+    case CMD_EXEC:
+        if(id!=OPT_SSLVERSIONMIN)
+            break;
+        section->ssl_version_min=parse_ssl_version(arg);
+        if(section->ssl_version_min<0)
+            return "Illegal SSL protocol version";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        log_raw("%-15s = %s", "sslVersionMin", ssl_version_name(TLS1_VERSION));
+        break;
+    case CMD_HELP:
+        log_raw("%-15s = all|SSLv3|TLSv1|TLSv1.1|TLSv1.2|TLSv1.3",
+            "sslVersionMin");
+        log_raw("%18slowest protocol version to negotiate", "");
+        break;
+    }
+
     /* TIMEOUTbusy */
     switch(cmd) {
     case CMD_INIT:
         section->timeout_busy=300; /* 5 minutes */
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "TIMEOUTbusy"))
+        if(id!=OPT_TIMEOUTBUSY)
             break;
         if(atoi(arg)>0)
             section->timeout_busy=atoi(arg);
@@ -931,7 +1361,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->timeout_close=60; /* 1 minute */
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "TIMEOUTclose"))
+        if(id!=OPT_TIMEOUTCLOSE)
             break;
         if(atoi(arg)>0 || !strcmp(arg, "0"))
             section->timeout_close=atoi(arg);
@@ -953,7 +1383,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->timeout_connect=10; /* 10 seconds */
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "TIMEOUTconnect"))
+        if(id!=OPT_TIMEOUTCONNECT)
             break;
         if(atoi(arg)>0 || !strcmp(arg, "0"))
             section->timeout_connect=atoi(arg);
@@ -975,7 +1405,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->timeout_idle=43200; /* 12 hours */
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "TIMEOUTidle"))
+        if(id!=OPT_TIMEOUTIDLE)
             break;
         if(atoi(arg)>0)
             section->timeout_idle=atoi(arg);
@@ -997,7 +1427,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->option.transparent=0;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "transparent"))
+        if(id!=OPT_TRANSPARENT)
             break;
         if(!strcasecmp(arg, "yes"))
             section->option.transparent=1;
@@ -1022,7 +1452,7 @@ static char *service_options(CMD cmd, LOCAL_OPTIONS *section,
         section->verify_use_only_my=0;
         break;
     case CMD_EXEC:
-        if(strcasecmp(opt, "verify"))
+        if(id!=OPT_VERIFY)
             break;
         section->verify_level=SSL_VERIFY_NONE;
         switch(atoi(arg)) {
@@ -1094,29 +1524,35 @@ void parse_config(char *name, char *parameter) {
 #endif
     DISK_FILE *df;
     char confline[CONFLINELEN], *arg, *opt, *errstr, *filename;
+    char config_line[CONFLINELEN+1];
     int line_number, i;
+    OPT_ID id;
     LOCAL_OPTIONS *section, *new_section;
     
-    memset(&options, 0, sizeof(GLOBAL_OPTIONS)); /* reset global options */
+    if(!reloading) /* global options need a restart */
+        memset(&options, 0, sizeof(GLOBAL_OPTIONS)); /* reset global options */
 
     memset(&local_options, 0, sizeof(LOCAL_OPTIONS)); /* reset local options */
     local_options.next=NULL;
     section=&local_options;
 
-    global_options(CMD_INIT, NULL, NULL);
-    service_options(CMD_INIT, section, NULL, NULL);
+    if(!reloading)
+        global_options(CMD_INIT, OPT_UNKNOWN, NULL);
+    service_options(CMD_INIT, section, OPT_UNKNOWN, NULL);
     if(!name)
         name=default_config_file;
+    config_name=name;
+    config_parameter=parameter;
     if(!strcasecmp(name, "-help")) {
-        global_options(CMD_HELP, NULL, NULL);
-        service_options(CMD_HELP, section, NULL, NULL);
+        global_options(CMD_HELP, OPT_UNKNOWN, NULL);
+        service_options(CMD_HELP, section, OPT_UNKNOWN, NULL);
         exit(1);
     }
     if(!strcasecmp(name, "-version")) {
         stunnel_info(1);
         log_raw(" ");
-        global_options(CMD_DEFAULT, NULL, NULL);
-        service_options(CMD_DEFAULT, section, NULL, NULL);
+        global_options(CMD_DEFAULT, OPT_UNKNOWN, NULL);
+        service_options(CMD_DEFAULT, section, OPT_UNKNOWN, NULL);
         exit(1);
     }
     if(!strcasecmp(name, "-sockets")) {
@@ -1171,7 +1607,9 @@ void parse_config(char *name, char *parameter) {
             }
             memcpy(new_section, &local_options, sizeof(LOCAL_OPTIONS));
             new_section->servname=stralloc(opt);
+            new_section->config=NULL; /* only the lines of this section */
             new_section->session=NULL;
+            new_section->fd=-1;
             new_section->next=NULL;
             section->next=new_section;
             section=new_section;
@@ -1185,13 +1623,24 @@ void parse_config(char *name, char *parameter) {
             opt[i]='\0'; /* remove trailing whitespaces */
         while(isspace((unsigned char)*arg))
             arg++; /* remove initial whitespaces */
-        errstr=service_options(CMD_EXEC, section, opt, arg);
-        if(section==&local_options && errstr==option_not_found)
-            errstr=global_options(CMD_EXEC, opt, arg);
+        id=option_id(opt);
+        if(id==OPT_UNKNOWN) /* no need to try the handlers */
+            errstr=option_not_found;
+        else {
+            sprintf(config_line, "%s=%s", opt, arg);
+            errstr=service_options(CMD_EXEC, section, id, arg);
+            if(!errstr)
+                config_append(section, config_line);
+            else if(section==&local_options && errstr==option_not_found)
+                errstr=reloading ? NULL : /* ignored until a restart */
+                    global_options(CMD_EXEC, id, arg);
+        }
         config_error(filename, line_number, errstr);
     }
     section_validate(filename, line_number, section, 1);
     file_close(df);
+    if(reloading) /* the process is already running */
+        return;
     if(!local_options.next) { /* inetd mode */
         if (section->option.accept) {
             log_raw("accept option is not allowed in inetd mode");
@@ -1207,19 +1656,193 @@ void parse_config(char *name, char *parameter) {
         options.option.syslog=1;
 }
 
+#ifndef USE_WIN32
+
+typedef struct {
+    LOCAL_OPTIONS *section;
+    int reused;
+} OLD_SECTION;
+
+static int old_section_cmp(const void *a, const void *b) {
+    return strcmp(((const OLD_SECTION *)a)->section->servname,
+        ((const OLD_SECTION *)b)->section->servname);
+}
+
+static int same_config(char *a, char *b) {
+    return !strcmp(a ? a : "", b ? b : "");
+}
+
+    /* re-read the configuration file on SIGHUP
+     * unchanged sections are kept with their SSL context and the sections
+     * no longer in the services list are returned in the retired list */
+int reload_config(LOCAL_OPTIONS **retired) {
+    LOCAL_OPTIONS *section, *prev;
+    OLD_SECTION *old, key, *found;
+    char *old_defaults;
+    int num, i, status, same_defaults;
+    pid_t pid;
+
+    *retired=NULL;
+    if(!strcasecmp(config_name, "-fd")) {
+        s_log(LOG_ERR, "Configuration read from a descriptor cannot be reloaded");
+        return -1;
+    }
+
+    /* parse errors are fatal, so check the file in a child process first */
+    pid=fork();
+    switch(pid) {
+    case -1: /* error */
+        ioerror("fork");
+        return -1;
+    case 0: /* child */
+#ifdef LOG_ASYNC
+        log_async_child();
+#endif
+        parse_config(config_name, config_parameter);
+        if(!local_options.next)
+            log_raw("No connections defined in config file");
+        _exit(local_options.next ? 0 : 1);
+    }
+#ifdef HAVE_WAIT_FOR_PID
+    while(wait_for_pid(pid, &status, 0)<0) {
+#else
+    while(wait(&status)!=pid) {
+#endif
+        if(get_last_error()!=EINTR) {
+            ioerror("wait");
+            return -1;
+        }
+    }
+    if(!WIFEXITED(status) || WEXITSTATUS(status)) {
+        s_log(LOG_ERR, "Invalid configuration file %s", config_name);
+        return -1;
+    }
+
+    /* old sections sorted by name */
+    num=0;
+    for(section=local_options.next; section; section=section->next)
+        num++;
+    old=calloc(num+1, sizeof(OLD_SECTION));
+    if(!old) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    for(section=local_options.next, i=0; section; section=section->next, i++)
+        old[i].section=section;
+    qsort(old, num, sizeof(OLD_SECTION), old_section_cmp);
+    old_defaults=local_options.config;
+
+    reloading=1;
+    parse_config(config_name, config_parameter);
+    reloading=0;
+
+    /* reuse the unchanged sections, initialize the others */
+    same_defaults=same_config(old_defaults, local_options.config);
+    for(prev=&local_options; (section=prev->next); prev=section) {
+        key.section=section;
+        found=bsearch(&key, old, num, sizeof(OLD_SECTION), old_section_cmp);
+        if(found && !found->reused && ((same_defaults &&
+                same_config(found->section->config, section->config)) ||
+                /* running exec+connect services are never restarted */
+                (!found->section->option.accept && !section->option.accept))) {
+            found->reused=1;
+            found->section->next=section->next;
+            prev->next=found->section;
+            free(section->servname);
+            free(section->config);
+            free(section);
+            section=prev->next;
+            s_log(LOG_DEBUG, "Service %s not changed", section->servname);
+        } else {
+            section->ctx=context_init(section);
+            s_log(LOG_INFO, "Service %s configured", section->servname);
+        }
+    }
+    for(i=num-1; i>=0; i--)
+        if(!old[i].reused) {
+            old[i].section->next=*retired;
+            *retired=old[i].section;
+        }
+    free(old);
+    free(old_defaults);
+    return 0;
+}
+
+#endif /* !defined USE_WIN32 */
+
+void section_hold(LOCAL_OPTIONS *section) {
+    enter_critical_section(CRIT_CLIENTS);
+    section->refs++;
+    leave_critical_section(CRIT_CLIENTS);
+}
+
+void section_release(LOCAL_OPTIONS *section) {
+    int refs;
+
+    enter_critical_section(CRIT_CLIENTS);
+    refs=--section->refs;
+    leave_critical_section(CRIT_CLIENTS);
+    if(refs) /* still in use */
+        return;
+    s_log(LOG_DEBUG, "Service %s released", section->servname);
+    if(section->ctx)
+        context_free(section->ctx);
+    section->ctx=NULL;
+    if(section->session)
+        SSL_SESSION_free(section->session);
+    section->session=NULL;
+#ifndef USE_FORK
+    /* the option strings are shared with the other sections */
+    free(section->servname);
+    free(section->config);
+    free(section);
+#endif /* the parent keeps the statistics of the finished children */
+}
+
+    /* binary search of the option name, OPT_UNKNOWN if not found */
+static OPT_ID option_id(char *name) {
+    static int sorted=0;
+    int low, high, mid, cmp;
+
+    if(!sorted) {
+        qsort(option_names, OPTION_NAMES, sizeof(OPT_NAME), option_cmp);
+        sorted=1;
+    }
+    low=0;
+    high=OPTION_NAMES-1;
+    while(low<=high) {
+        mid=(low+high)/2;
+        cmp=strcasecmp(name, option_names[mid].name);
+        if(!cmp)
+            return option_names[mid].id;
+        if(cmp<0)
+            high=mid-1;
+        else
+            low=mid+1;
+    }
+    return OPT_UNKNOWN;
+}
+
+static int option_cmp(const void *a, const void *b) {
+    return strcasecmp(((OPT_NAME *)a)->name, ((OPT_NAME *)b)->name);
+}
+
 static void section_validate(char *filename, int line_number,
         LOCAL_OPTIONS *section, int final) {
     if(section==&local_options) { /* global options just configured */
+        if(!reloading) {
 #ifdef HAVE_OSSL_ENGINE_H
-        close_engine();
+            close_engine();
 #endif
-        ssl_configure(); /* configure global SSL settings */
+            ssl_configure(); /* configure global SSL settings */
+        }
         if(!final) /* no need to validate defaults */
             return;
     }
     if(!section->option.client)
         section->option.cert=1; /* Server always needs a certificate */
-    section->ctx=context_init(section); /* initialize SSL context */
+    if(!reloading) /* reload_config() only initializes changed sections */
+        section->ctx=context_init(section); /* initialize SSL context */
 
     if(section==&local_options) { /* inetd mode */
         if(section->option.accept)
@@ -1254,6 +1877,19 @@ static void config_error(char *name, int num, char *str) {
     exit(1);
 }
 
+static void config_append(LOCAL_OPTIONS *section, char *line) {
+    int len;
+
+    len=section->config ? strlen(section->config) : 0;
+    section->config=realloc(section->config, len+strlen(line)+2);
+    if(!section->config) {
+        log_raw("Fatal memory allocation error");
+        exit(2);
+    }
+    strcpy(section->config+len, line);
+    strcat(section->config+len, "\n");
+}
+
 static char *stralloc(char *str) { /* Allocate static string */
     char *retval;
     
@@ -1442,6 +2078,38 @@ static int parse_ssl_option(char *arg) {
     return 0; /* FAILED */
 }
 
+    /* version numbers as sent on the wire, the names of SSL_get_version() */
+static struct {
+    char *name;
+    int version;
+} ssl_versions[]={
+    {"all", 0},
+    {"SSLv3", SSL3_VERSION},
+    {"TLSv1", TLS1_VERSION},
+    {"TLSv1.1", 0x0302},
+    {"TLSv1.2", 0x0303},
+    {"TLSv1.3", 0x0304},
+    {NULL, -1}
+};
+
+static int parse_ssl_version(char *arg) {
+    int i;
+
+    for(i=0; ssl_versions[i].name; i++)
+        if(!strcasecmp(ssl_versions[i].name, arg))
+            break;
+    return ssl_versions[i].version; /* -1 if not found */
+}
+
+static char *ssl_version_name(int version) {
+    int i;
+
+    for(i=0; ssl_versions[i].name; i++)
+        if(ssl_versions[i].version==version)
+            break;
+    return ssl_versions[i].name ? ssl_versions[i].name : "unknown";
+}
+
 /* Parse out the socket options stuff */
 
 static int on=1;
@@ -37,124 +37,141 @@
 #define isprefix(a, b) (strncasecmp((a), (b), strlen(b))==0)
 
 /* protocol-specific function prototypes */
-static void cifs_client(CLI *);
-static void cifs_server(CLI *);
-static void smtp_client(CLI *);
-static void smtp_server(CLI *);
-static void pop3_client(CLI *);
-static void pop3_server(CLI *);
-static void nntp_client(CLI *);
-static void connect_client(CLI *);
+static int cifs_client(CLI *);
+static int cifs_server(CLI *);
+static int smtp_client(CLI *);
+static int smtp_server(CLI *);
+static int pop3_client(CLI *);
+static int pop3_server(CLI *);
+static int nntp_client(CLI *);
+static int connect_client(CLI *);
+
+int negotiate(CLI *c) {
+    int retval;
 
-void negotiate(CLI *c) {
     if(!c->opt->protocol)
-        return; /* No protocol negotiations */
+        return 0; /* No protocol negotiations */
 
     s_log(LOG_NOTICE, "Negotiations for %s (%s side) started", c->opt->protocol,
         c->opt->option.client ? "client" : "server");
 
     if(c->opt->option.client) {
         if(!strcmp(c->opt->protocol, "cifs"))
-            cifs_client(c);
+            retval=cifs_client(c);
         else if(!strcmp(c->opt->protocol, "smtp"))
-            smtp_client(c);
+            retval=smtp_client(c);
         else if(!strcmp(c->opt->protocol, "pop3"))
-            pop3_client(c);
+            retval=pop3_client(c);
         else if(!strcmp(c->opt->protocol, "nntp"))
-            nntp_client(c);
+            retval=nntp_client(c);
         else if(!strcmp(c->opt->protocol, "connect"))
-            connect_client(c);
+            retval=connect_client(c);
         else {
             s_log(LOG_ERR, "Protocol %s not supported in client mode",
                 c->opt->protocol);
-            longjmp(c->err, 1);
+            return -1;
         }
     } else {
         if(!strcmp(c->opt->protocol, "cifs"))
-            cifs_server(c);
+            retval=cifs_server(c);
         else if(!strcmp(c->opt->protocol, "smtp"))
-            smtp_server(c);
+            retval=smtp_server(c);
         else if(!strcmp(c->opt->protocol, "pop3"))
-            pop3_server(c);
+            retval=pop3_server(c);
         else {
             s_log(LOG_ERR, "Protocol %s not supported in server mode",
                 c->opt->protocol);
-            longjmp(c->err, 1);
+            return -1;
         }
     }
+    if(retval)
+        return -1; /* FAILED */
     s_log(LOG_NOTICE, "Protocol negotiations succeded");
+    return 0; /* OK */
 }
 
-static void cifs_client(CLI *c) {
+static int cifs_client(CLI *c) {
     u8 buffer[5];
     u8 request_dummy[4] = {0x81, 0, 0, 0}; /* a zero-length request */
 
-    write_blocking(c, c->remote_fd.fd, request_dummy, 4);
-    read_blocking(c, c->remote_fd.fd, buffer, 5);
+    if(write_blocking(c, c->remote_fd.fd, request_dummy, 4))
+        return -1;
+    if(read_blocking(c, c->remote_fd.fd, buffer, 5))
+        return -1;
     if(buffer[0]!=0x83) { /* NB_SSN_NEGRESP */
         s_log(LOG_ERR, "Negative response expected");
-        longjmp(c->err, 1);
+        return -1;
     }
     if(buffer[2]!=0 || buffer[3]!=1) { /* length != 1 */
         s_log(LOG_ERR, "Unexpected NetBIOS response size");
-        longjmp(c->err, 1);
+        return -1;
     }
     if(buffer[4]!=0x8e) { /* use SSL */
         s_log(LOG_ERR, "Remote server does not require SSL");
-        longjmp(c->err, 1);
+        return -1;
     }
+    return 0; /* OK */
 }
 
-static void cifs_server(CLI *c) {
+static int cifs_server(CLI *c) {
     u8 buffer[128];
     u8 response_access_denied[5] = {0x83, 0, 0, 1, 0x81};
     u8 response_use_ssl[5] = {0x83, 0, 0, 1, 0x8e};
     u16 len;
 
-    read_blocking(c, c->local_rfd.fd, buffer, 4) ;/* NetBIOS header */
+    if(read_blocking(c, c->local_rfd.fd, buffer, 4)) /* NetBIOS header */
+        return -1;
     len=buffer[3];
     len|=(u16)(buffer[2]) << 8;
     if(len>sizeof(buffer)-4) {
         s_log(LOG_ERR, "Received block too long");
-        longjmp(c->err, 1);
+        return -1;
     }
-    read_blocking(c, c->local_rfd.fd, buffer+4, len);
+    if(read_blocking(c, c->local_rfd.fd, buffer+4, len))
+        return -1;
     if(buffer[0]!=0x81){ /* NB_SSN_REQUEST */
         s_log(LOG_ERR, "Client did not send session setup");
         write_blocking(c, c->local_wfd.fd, response_access_denied, 5);
-        longjmp(c->err, 1);
+        return -1;
     }
-    write_blocking(c, c->local_wfd.fd, response_use_ssl, 5);
+    return write_blocking(c, c->local_wfd.fd, response_use_ssl, 5);
 }
 
-static void smtp_client(CLI *c) {
+static int smtp_client(CLI *c) {
     char line[STRLEN];
     
     do { /* Copy multiline greeting */
-        fdgetline(c, c->remote_fd.fd, line);
-        fdputline(c, c->local_wfd.fd, line);
+        if(fdgetline(c, c->remote_fd.fd, line))
+            return -1;
+        if(fdputline(c, c->local_wfd.fd, line))
+            return -1;
     } while(isprefix(line, "220-"));
 
-    fdputline(c, c->remote_fd.fd, "EHLO localhost");
+    if(fdputline(c, c->remote_fd.fd, "EHLO localhost"))
+        return -1;
     do { /* Skip multiline reply */
-        fdgetline(c, c->remote_fd.fd, line);
+        if(fdgetline(c, c->remote_fd.fd, line))
+            return -1;
     } while(isprefix(line, "250-"));
     if(!isprefix(line, "250 ")) { /* Error */
         s_log(LOG_ERR, "Remote server is not RFC 1425 compliant");
-        longjmp(c->err, 1);
+        return -1;
     }
 
-    fdputline(c, c->remote_fd.fd, "STARTTLS");
+    if(fdputline(c, c->remote_fd.fd, "STARTTLS"))
+        return -1;
     do { /* Skip multiline reply */
-        fdgetline(c, c->remote_fd.fd, line);
+        if(fdgetline(c, c->remote_fd.fd, line))
+            return -1;
     } while(isprefix(line, "220-"));
     if(!isprefix(line, "220 ")) { /* Error */
         s_log(LOG_ERR, "Remote server is not RFC 2487 compliant");
-        longjmp(c->err, 1);
+        return -1;
     }
+    return 0; /* OK */
 }
 
-static void smtp_server(CLI *c) {
+static int smtp_server(CLI *c) {
     char line[STRLEN];
 
     s_poll_zero(&c->fds);
@@ -165,110 +182,140 @@ static void smtp_server(CLI *c) {
         break;
     case 1: /* fd ready to read */
         s_log(LOG_DEBUG, "RFC 2487 not detected");
-        return; /* Return if RFC 2487 is not used */
+        return 0; /* Return if RFC 2487 is not used */
     default: /* -1 */
         sockerror("RFC2487 (s_poll_wait)");
-        longjmp(c->err, 1);
+        return -1;
     }
 
-    fdgetline(c, c->remote_fd.fd, line);
+    if(fdgetline(c, c->remote_fd.fd, line))
+        return -1;
     if(!isprefix(line, "220")) {
         s_log(LOG_ERR, "Unknown server welcome");
-        longjmp(c->err, 1);
+        return -1;
     }
-    fdprintf(c, c->local_wfd.fd, "%s + stunnel", line);
-    fdgetline(c, c->local_rfd.fd, line);
+    if(fdprintf(c, c->local_wfd.fd, "%s + stunnel", line)<0)
+        return -1;
+    if(fdgetline(c, c->local_rfd.fd, line))
+        return -1;
     if(!isprefix(line, "EHLO ")) {
         s_log(LOG_ERR, "Unknown client EHLO");
-        longjmp(c->err, 1);
+        return -1;
     }
-    fdprintf(c, c->local_wfd.fd, "250-%s Welcome", line);
-    fdputline(c, c->local_wfd.fd, "250 STARTTLS");
-    fdgetline(c, c->local_rfd.fd, line);
+    if(fdprintf(c, c->local_wfd.fd, "250-%s Welcome", line)<0)
+        return -1;
+    if(fdputline(c, c->local_wfd.fd, "250 STARTTLS"))
+        return -1;
+    if(fdgetline(c, c->local_rfd.fd, line))
+        return -1;
     if(!isprefix(line, "STARTTLS")) {
         s_log(LOG_ERR, "STARTTLS expected");
-        longjmp(c->err, 1);
+        return -1;
     }
-    fdputline(c, c->local_wfd.fd, "220 Go ahead");
+    return fdputline(c, c->local_wfd.fd, "220 Go ahead");
 }
 
-static void pop3_client(CLI *c) {
+static int pop3_client(CLI *c) {
     char line[STRLEN];
 
-    fdgetline(c, c->remote_fd.fd, line);
+    if(fdgetline(c, c->remote_fd.fd, line))
+        return -1;
     if(!isprefix(line, "+OK ")) {
         s_log(LOG_ERR, "Unknown server welcome");
-        longjmp(c->err, 1);
+        return -1;
     }
-    fdputline(c, c->local_wfd.fd, line);
-    fdputline(c, c->remote_fd.fd, "STLS");
-    fdgetline(c, c->remote_fd.fd, line);
+    if(fdputline(c, c->local_wfd.fd, line))
+        return -1;
+    if(fdputline(c, c->remote_fd.fd, "STLS"))
+        return -1;
+    if(fdgetline(c, c->remote_fd.fd, line))
+        return -1;
     if(!isprefix(line, "+OK ")) {
         s_log(LOG_ERR, "Server does not support TLS");
-        longjmp(c->err, 1);
+        return -1;
     }
+    return 0; /* OK */
 }
 
-static void pop3_server(CLI *c) {
+static int pop3_server(CLI *c) {
     char line[STRLEN];
 
-    fdgetline(c, c->remote_fd.fd, line);
-    fdprintf(c, c->local_wfd.fd, "%s + stunnel", line);
-    fdgetline(c, c->local_rfd.fd, line);
+    if(fdgetline(c, c->remote_fd.fd, line))
+        return -1;
+    if(fdprintf(c, c->local_wfd.fd, "%s + stunnel", line)<0)
+        return -1;
+    if(fdgetline(c, c->local_rfd.fd, line))
+        return -1;
     if(isprefix(line, "CAPA")) { /* Client wants RFC 2449 extensions */
-        fdputline(c, c->local_wfd.fd, "-ERR Stunnel does not support capabilities");
-        fdgetline(c, c->local_rfd.fd, line);
+        if(fdputline(c, c->local_wfd.fd,
+                "-ERR Stunnel does not support capabilities"))
+            return -1;
+        if(fdgetline(c, c->local_rfd.fd, line))
+            return -1;
     }
     if(!isprefix(line, "STLS")) {
         s_log(LOG_ERR, "Client does not want TLS");
-        longjmp(c->err, 1);
+        return -1;
     }
-    fdputline(c, c->local_wfd.fd, "+OK Stunnel starts TLS negotiation");
+    return fdputline(c, c->local_wfd.fd, "+OK Stunnel starts TLS negotiation");
 }
 
-static void nntp_client(CLI *c) {
+static int nntp_client(CLI *c) {
     char line[STRLEN];
 
-    fdgetline(c, c->remote_fd.fd, line);
+    if(fdgetline(c, c->remote_fd.fd, line))
+        return -1;
     if(!isprefix(line, "200 ") && !isprefix(line, "201 ")) {
         s_log(LOG_ERR, "Unknown server welcome");
-        longjmp(c->err, 1);
+        return -1;
     }
-    fdputline(c, c->local_wfd.fd, line);
-    fdputline(c, c->remote_fd.fd, "STARTTLS");
-    fdgetline(c, c->remote_fd.fd, line);
+    if(fdputline(c, c->local_wfd.fd, line))
+        return -1;
+    if(fdputline(c, c->remote_fd.fd, "STARTTLS"))
+        return -1;
+    if(fdgetline(c, c->remote_fd.fd, line))
+        return -1;
     if(!isprefix(line, "382 ")) {
         s_log(LOG_ERR, "Server does not support TLS");
-        longjmp(c->err, 1);
+        return -1;
     }
+    return 0; /* OK */
 }
 
-static void connect_client(CLI *c) {
+static int connect_client(CLI *c) {
     char line[STRLEN];
 
     if(!c->opt->protocol_host) {
         s_log(LOG_ERR, "protocolHost not specified");
-        longjmp(c->err, 1);
+        return -1;
     }
-    fdprintf(c, c->remote_fd.fd, "CONNECT %s HTTP/1.1",
-        c->opt->protocol_host);
-    fdprintf(c, c->remote_fd.fd, "Host: %s", c->opt->protocol_host);
+    if(fdprintf(c, c->remote_fd.fd, "CONNECT %s HTTP/1.1",
+            c->opt->protocol_host)<0)
+        return -1;
+    if(fdprintf(c, c->remote_fd.fd, "Host: %s", c->opt->protocol_host)<0)
+        return -1;
     if(c->opt->protocol_credentials)
-        fdprintf(c, c->remote_fd.fd, "Proxy-Authorization: basic %s",
-            c->opt->protocol_credentials);
-    fdputline(c, c->remote_fd.fd, ""); /* empty line */
-    fdgetline(c, c->remote_fd.fd, line);
+        if(fdprintf(c, c->remote_fd.fd, "Proxy-Authorization: basic %s",
+                c->opt->protocol_credentials)<0)
+            return -1;
+    if(fdputline(c, c->remote_fd.fd, "")) /* empty line */
+        return -1;
+    if(fdgetline(c, c->remote_fd.fd, line))
+        return -1;
     if(line[9]!='2') { /* "HTTP/1.0 200 Connection established" */
         s_log(LOG_ERR, "CONNECT request rejected");
         do {
-            fdgetline(c, c->remote_fd.fd, line); /* read all headers */
+            if(fdgetline(c, c->remote_fd.fd, line)) /* read all headers */
+                return -1;
         } while(line[0]);
-        longjmp(c->err, 1);
+        return -1;
     }
     s_log(LOG_INFO, "CONNECT request accepted");
     do {
-        fdgetline(c, c->remote_fd.fd, line); /* read all headers */
+        if(fdgetline(c, c->remote_fd.fd, line)) /* read all headers */
+            return -1;
     } while(line[0]);
+    return 0; /* OK */
 }
 
 /* End of protocol.c */
@@ -51,14 +51,31 @@ void stunnel_info(int);
 
 /**************************************** Prototypes for log.c */
 
+#if defined(USE_PTHREAD) || defined(USE_UCONTEXT)
+#define LOG_ASYNC /* a single process serves many connections */
+#endif
+
 void log_open(void);
 void log_close(void);
+#ifdef LOG_ASYNC
+void log_async_start(void);
+void log_async_stop(void);
+void log_async_child(void);
+void log_flush(void);
+unsigned long log_dropped(void);
+#endif
 void s_log(int, const char *, ...)
 #ifdef __GNUC__
     __attribute__ ((format (printf, 2, 3)));
 #else
     ;
 #endif
+#if defined(__GNUC__) || (defined(_MSC_VER) && _MSC_VER>=1400) || \
+        (defined(__STDC_VERSION__) && __STDC_VERSION__>=199901L)
+/* skip the evaluation of the arguments for disabled levels */
+#define s_log(level, ...) \
+    ((level)<=options.debug_level ? s_log((level), __VA_ARGS__) : (void)0)
+#endif
 void log_raw(const char *, ...)
 #ifdef __GNUC__
     __attribute__ ((format (printf, 1, 2)));
@@ -95,6 +112,28 @@ void ctrl_engine(const char *, const char *);
 void close_engine(void);
 #endif
 
+/**************************************** Data structures for stats.c */
+
+#define STATS_BUCKETS 12 /* handshake latency histogram */
+#define STATS_BUCKET_MIN 0.001 /* upper limit of the first bucket (1ms) */
+#define STATS_FLUSH_BYTES 1048576 /* flush transfer() counters this often */
+
+typedef enum {
+    TIMEOUT_CONNECT, TIMEOUT_BUSY, TIMEOUT_IDLE, TIMEOUT_CLOSE,
+    TIMEOUT_TYPES
+} TIMEOUT_TYPE;
+
+typedef struct { /* per-service totals or per-connection deltas */
+    long connections_total, connections_active, connections_reset;
+    double bytes_to_ssl, bytes_to_sock; /* double to avoid an overflow */
+    long handshakes_full, handshakes_resumed, handshakes_failed;
+    long records_small, records_full; /* SSL_write() calls */
+    long handshake_hist[STATS_BUCKETS]; /* 1ms, 2ms, 4ms, ..., more */
+    double handshake_seconds; /* sum of handshake times */
+    long connect_failures[MAX_HOSTS]; /* per remote_addr entry */
+    long timeouts[TIMEOUT_TYPES];
+} STATS;
+
 /**************************************** Prototypes for options.c */
 
 typedef struct {
@@ -103,6 +142,7 @@ typedef struct {
     char *egd_sock;                       /* entropy gathering daemon socket */
     char *rand_file;                                /* file with random data */
     int random_bytes;                       /* how many random bytes to read */
+    int cert_check;    /* seconds between certificate file checks (0-never) */
 
         /* some global data for stunnel.c */
 #ifndef USE_WIN32
@@ -113,6 +153,13 @@ typedef struct {
     char *pidfile;
     char *setuid_user;
     char *setgid_group;
+#ifdef USE_UCONTEXT
+    int workers;                  /* number of scheduler processes (0-auto) */
+#endif
+    char *stats_socket;                /* UNIX socket serving statistics */
+    char *access_log;              /* file with per-connection JSON records */
+    unsigned long access_log_size;       /* rotate the access log (0-never) */
+    int drain_timeout;     /* seconds to finish connections after upgrade */
 #endif
 
         /* Win32 specific data for gui.c */
@@ -146,19 +193,28 @@ typedef struct local_options {
     char *servname; /* service name for logging & permission checking */
     SSL_SESSION *session; /* Recently used session */
     char local_address[IPLEN]; /* Dotted-decimal address to bind */
+    char *config; /* option lines of this section, compared on reload */
+    int refs; /* the services list and the connections using this section */
 
         /* service-specific data for ctx.c */
     char *ca_dir;                              /* directory for hashed certs */
     char *ca_file;                       /* file containing bunches of certs */
     char *crl_dir;                              /* directory for hashed CRLs */
     char *crl_file;                       /* file containing bunches of CRLs */
+    char *pinned_file;         /* fingerprints of peer certificates or keys */
+    char *ocsp_url;                   /* responder for the stapled response */
     char *cipher_list;
+    char *curves;                         /* ECDHE curves in preference order */
     char *cert;                                             /* cert filename */
     char *key;                               /* pem (priv key/cert) filename */
+    char *ecdsa_cert, *ecdsa_key;    /* second certificate with an EC key */
+    unsigned long ctx_stamp;       /* modification stamp of the files above */
     long session_timeout;
     int verify_level;
     int verify_use_only_my;
     long ssl_options;
+    int ssl_version_min, ssl_version_max;     /* protocol versions, 0 - any */
+    int record_size;              /* maximum TLS record, 0 - dynamic sizing */
 
         /* service-specific data for client.c */
     int fd;        /* file descriptor accepting connections for this service */
@@ -171,6 +227,10 @@ typedef struct local_options {
     int timeout_close; /* Maximum close_notify time */
     int timeout_connect; /* Maximum connect() time */
     int timeout_idle; /* Maximum idle connection time */
+#ifdef USE_UCONTEXT
+    int stack_max; /* Stack high-water mark of the service contexts */
+#endif
+    STATS stats; /* Counters of all connections to this service */
 
         /* protocol name for protocol.c */
     char *protocol;
@@ -182,6 +242,7 @@ typedef struct local_options {
         unsigned int cert:1;
         unsigned int client:1;
         unsigned int delayed_lookup:1;
+        unsigned int early_data:1;
         unsigned int accept:1;
         unsigned int remote:1;
 #ifndef USE_WIN32
@@ -215,10 +276,16 @@ typedef struct {
 } SOCK_OPT;
 
 void parse_config(char *, char *);
+#ifndef USE_WIN32
+int reload_config(LOCAL_OPTIONS **);
+#endif
+void section_hold(LOCAL_OPTIONS *);
+void section_release(LOCAL_OPTIONS *);
 
 /**************************************** Prototypes for ctx.c */
 
 SSL_CTX *context_init(LOCAL_OPTIONS *);
+void context_check(LOCAL_OPTIONS *);
 void context_free(SSL_CTX *);
 void sslerror(char *);
 
@@ -244,6 +311,13 @@ int s_poll_wait(s_poll_set *, int);
 
 #ifndef USE_WIN32
 int signal_pipe_init(void);
+int signal_pipe_fd(void);
+void signal_reload(void);
+int reload_pending(void);
+void signal_upgrade(void);
+int upgrade_pending(void);
+void signal_terminate(int);
+int terminate_pending(void);
 void child_status(void);  /* dead libwrap or 'exec' process detected */
 #endif
 int set_socket_options(int, int);
@@ -258,6 +332,13 @@ typedef struct {
     int is_socket; /* File descriptor is a socket */
 } FD;
 
+typedef enum { /* connection lifecycle, see do_client() */
+    CLI_INIT_LOCAL, CLI_INIT_REMOTE, CLI_NEGOTIATE, CLI_INIT_SSL,
+    CLI_EARLY_DATA, CLI_HANDSHAKE, CLI_TRANSFER, CLI_DONE
+} CLI_STATE;
+
+#define CLI_WAIT 1 /* returned by a stage waiting for c->fds */
+
 typedef struct {
     LOCAL_OPTIONS *opt;
     char accepting_address[IPLEN], connecting_address[IPLEN]; /* text */
@@ -268,15 +349,33 @@ typedef struct {
     SOCKADDR_LIST bind_addr; /* IP for explicit local bind or transparent proxy */
     unsigned long pid; /* PID of local process */
     int fd; /* Temporary file descriptor */
-    jmp_buf err;
+    CLI_STATE state; /* Current stage of the connection */
+    int resumed; /* the stage is called again after it returned CLI_WAIT */
+    int wait_timeout; /* s_poll_wait() timeout of the waiting stage */
+    int wait_result; /* s_poll_wait() result for the resumed stage */
+    int connect_index; /* remote address of the connect in progress */
+    int ssl_closing; /* close_notify progress in transfer() */
+    int watchdog; /* transfer() passes without moving any data */
 
     char sock_buff[BUFFSIZE]; /* Socket read buffer */
     char ssl_buff[BUFFSIZE]; /* SSL read buffer */
     int sock_ptr, ssl_ptr; /* Index of first unused byte in buffer */
     FD *sock_rfd, *sock_wfd; /* Read and write socket descriptors */
     FD *ssl_rfd, *ssl_wfd; /* Read and write SSL descriptors */
-    int sock_bytes, ssl_bytes; /* Bytes written to socket and ssl */
+    unsigned long sock_bytes, ssl_bytes; /* Bytes written to socket and ssl */
+    double time_start, time_connect, time_handshake; /* for the access log */
+    double connect_start, handshake_start; /* of the stages in progress */
     s_poll_set fds; /* File descriptors */
+    int line_fd, line_len; /* fdgetline() peeked data and its descriptor */
+    char line_buff[STRLEN];
+    STATS stats; /* Counters not yet added to c->opt->stats */
+    unsigned char peer_digest[EVP_MAX_MD_SIZE]; /* verified chain */
+    unsigned int peer_digest_len; /* 0 if not verified in this handshake */
+    int early_sent; /* sock_buff bytes sent as 0-RTT data */
+    int early_read; /* 0-RTT data received before the remote host connected */
+    int record_limit; /* of a pending SSL_write(), 0 if none */
+    double record_time; /* of the last SSL_write() */
+    double record_burst; /* bytes sent to SSL since the last idle period */
 } CLI;
 
 extern int max_clients;
@@ -287,12 +386,17 @@ extern int max_fds;
 void *alloc_client_session(LOCAL_OPTIONS *, int, int);
 void *client(void *);
 
+/**************************************** Prototypes for ctx.c */
+
+int verify_cache_hostname(CLI *, char *);
+void verify_cache_set_hostname(CLI *, char *, int);
+
 /**************************************** Prototypes for network.c */
 
-void write_blocking(CLI *, int fd, u8 *, int);
-void read_blocking(CLI *, int fd, u8 *, int);
-void fdputline(CLI *, int, char *);
-void fdgetline(CLI *, int, char *);
+int write_blocking(CLI *, int fd, u8 *, int);
+int read_blocking(CLI *, int fd, u8 *, int);
+int fdputline(CLI *, int, char *);
+int fdgetline(CLI *, int, char *);
 /* descriptor versions of fprintf/fscanf */
 int fdprintf(CLI *, int, const char *, ...)
 #ifdef __GNUC__
@@ -309,7 +413,52 @@ int fdscanf(CLI *, int, const char *, char *)
 
 /**************************************** Prototype for protocol.c */
 
-void negotiate(CLI *c);
+int negotiate(CLI *c);
+
+/**************************************** Prototypes for stats.c */
+
+double stats_time(void);
+void stats_handshake(STATS *, double, int);
+void stats_flush(CLI *);
+#ifndef USE_WIN32
+int stats_init(int);
+int stats_accept(int);
+int stats_send(s_poll_set *);
+void stats_fds(s_poll_set *);
+int stats_timeout(void);
+#ifdef USE_FORK
+int stats_pipe_fd(void);
+void stats_read(void);
+#endif
+#endif
+
+/**************************************** Prototypes for upgrade.c */
+
+#ifndef USE_WIN32
+void upgrade_init(char **);
+int upgrade_socket(char *);
+void upgrade_ready(void);
+int upgrade_start(void);
+int upgrade_wait(int);
+#endif
+
+/**************************************** Prototypes for ocsp.c */
+
+#ifdef HAVE_OCSP_STAPLING
+int ocsp_init(SSL_CTX *, LOCAL_OPTIONS *);
+int ocsp_check(void);
+void ocsp_fds(s_poll_set *);
+int ocsp_timeout(void);
+#endif
+
+/**************************************** Prototypes for access.c */
+
+#ifndef USE_WIN32
+void access_open(void);
+void access_close(void);
+void access_log(CLI *, int);
+void access_flush(void);
+#endif
 
 /**************************************** Prototypes for resolver.c */
 
@@ -321,7 +470,8 @@ char *s_ntop(char *, SOCKADDR_UNION *);
 
 typedef enum {
     CRIT_KEYGEN, CRIT_INET, CRIT_CLIENTS, CRIT_WIN_LOG, CRIT_SESSION,
-    CRIT_SECTIONS
+    CRIT_STATS, CRIT_LOG, CRIT_ACCESS, CRIT_FILE, CRIT_CTX, CRIT_VERIFY,
+    CRIT_OCSP, CRIT_SECTIONS
 } SECTION_CODE;
 
 void enter_critical_section(SECTION_CODE);
@@ -332,7 +482,7 @@ unsigned long stunnel_thread_id(void);
 int create_client(int, int, void *, void *(*)(void *));
 #ifdef USE_UCONTEXT
 typedef struct CONTEXT_STRUCTURE {
-    char stack[STACK_SIZE];
+    char *stack; /* usable stack area (NULL for the listening context) */
     unsigned long id;
     ucontext_t ctx;
     s_poll_set *fds;
@@ -342,6 +492,8 @@ typedef struct CONTEXT_STRUCTURE {
 } CONTEXT;
 extern CONTEXT *ready_head, *ready_tail;
 extern CONTEXT *waiting_head, *waiting_tail;
+void release_context(CONTEXT *);
+int stack_usage(void);
 #endif
 #ifdef _WIN32_WCE
 int _beginthread(void (*)(void *), int, void *);
@@ -378,7 +530,11 @@ typedef struct disk_file {
 #else
     int fd;
 #endif
-    /* the inteface is prepared to easily implement buffering if needed */
+    char *buff; /* read or write buffer, or the mmap()ed file */
+    int len; /* bytes in buff */
+    int ptr; /* first byte not yet returned by file_getline() */
+    int rd; /* buff holds read data */
+    int mapped; /* buff is mmap()ed */
 } DISK_FILE;
 
 #ifndef USE_WIN32
@@ -388,6 +544,7 @@ DISK_FILE *file_open(char *, int);
 void file_close(DISK_FILE *);
 int file_getline(DISK_FILE *, char *, int);
 int file_putline(DISK_FILE *, char *);
+int file_flush(DISK_FILE *);
 
 #ifdef USE_WIN32
 LPTSTR str2tstr(const LPSTR);
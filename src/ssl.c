@@ -71,14 +71,16 @@ static void init_compression(void) {
         break;
     case COMP_RLE:
         id=0xe1;
+#if SSLEAY_VERSION_NUMBER < 0x10100000L
         cm=COMP_rle();
+#endif /* removed in OpenSSL 1.1.0 */
         name="rle";
         break;
     default:
         s_log(LOG_ERR, "INTERNAL ERROR: Bad compression method");
         exit(1);
     }
-    if(!cm || cm->type==NID_undef) {
+    if(!cm || COMP_get_type(cm)==NID_undef) {
         s_log(LOG_ERR, "Failed to initialize %s compression method", name);
         exit(1);
     }
@@ -130,7 +132,7 @@ static int init_prng(void) {
     s_log(LOG_DEBUG, "RAND_screen failed to sufficiently seed PRNG");
 #else
 
-#if SSLEAY_VERSION_NUMBER>=0x0090581fL
+#if SSLEAY_VERSION_NUMBER>=0x0090581fL && !defined(OPENSSL_NO_EGD)
     if(options.egd_sock) {
         if((bytes=RAND_egd(options.egd_sock))==-1) {
             s_log(LOG_WARNING, "EGD Socket %s failed", options.egd_sock);
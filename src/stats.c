@@ -0,0 +1,485 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (c) 1998-2006 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *                 All Rights Reserved
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   In addition, as a special exception, Michal Trojnara gives
+ *   permission to link the code of this program with the OpenSSL
+ *   library (or with modified versions of OpenSSL that use the same
+ *   license as OpenSSL), and distribute linked combinations including
+ *   the two.  You must obey the GNU General Public License in all
+ *   respects for all of the code used other than OpenSSL.  If you modify
+ *   this file, you may extend this exception to your version of the
+ *   file, but you are not obligated to do so.  If you do not wish to
+ *   do so, delete this exception statement from your version.
+ */
+
+/* Each connection counts into its own c->stats without any locking.
+ * stats_flush() adds these deltas to the per-service registry
+ * (opt->stats) and clears them.  With threads this takes CRIT_STATS,
+ * with FORK threading the deltas are sent to the parent over a pipe. */
+
+#include "common.h"
+#include "prototypes.h"
+
+#ifndef USE_WIN32
+
+#ifdef USE_FORK
+typedef struct {
+    LOCAL_OPTIONS *opt; /* valid in the parent: the child is its copy */
+    STATS stats;
+} STATS_RECORD; /* must not exceed PIPE_BUF for atomic writes */
+
+static int stats_pipe[2]={-1, -1};
+#endif
+
+typedef struct {
+    char *data;
+    int len, size;
+} REPORT;
+
+#define STATS_TIMEOUT 10 /* seconds for a reader to take the report */
+
+typedef struct stats_reader {
+    struct stats_reader *next;
+    int fd;
+    REPORT report;
+    int sent;
+    time_t timeout;
+} STATS_READER;
+
+static STATS_READER *readers=NULL; /* reports not completely sent yet */
+
+static void stats_add(STATS *, STATS *);
+static void stats_report(REPORT *, STATS *);
+static int reader_send(STATS_READER *);
+static void reader_free(STATS_READER *);
+static void report_printf(REPORT *, const char *, ...)
+#ifdef __GNUC__
+    __attribute__ ((format (printf, 2, 3)));
+#else
+    ;
+#endif
+
+#endif /* !defined USE_WIN32 */
+
+double stats_time(void) { /* seconds with sub-second resolution */
+#ifdef USE_WIN32
+    return GetTickCount()/1000.0;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec+tv.tv_usec/1000000.0;
+#endif
+}
+
+void stats_handshake(STATS *stats, double elapsed, int resumed) {
+    int i;
+    double limit=STATS_BUCKET_MIN;
+
+    if(resumed)
+        stats->handshakes_resumed++;
+    else
+        stats->handshakes_full++;
+    stats->handshake_seconds+=elapsed;
+    for(i=0; i<STATS_BUCKETS-1 && elapsed>limit; i++)
+        limit*=2;
+    stats->handshake_hist[i]++;
+}
+
+void stats_flush(CLI *c) {
+#ifndef USE_WIN32
+#ifdef USE_FORK
+    STATS_RECORD rec;
+
+    if(stats_pipe[1]>=0) { /* in a child process: tell the parent */
+        rec.opt=c->opt;
+        memcpy(&rec.stats, &c->stats, sizeof(STATS));
+        if(write(stats_pipe[1], &rec, sizeof(STATS_RECORD))!=
+                sizeof(STATS_RECORD))
+            ioerror("stats_flush: write");
+    }
+#else
+    enter_critical_section(CRIT_STATS);
+    stats_add(&c->opt->stats, &c->stats);
+    leave_critical_section(CRIT_STATS);
+#endif
+#endif /* !defined USE_WIN32 */
+    memset(&c->stats, 0, sizeof(STATS));
+}
+
+#ifndef USE_WIN32
+
+static void stats_add(STATS *dst, STATS *src) {
+    int i;
+
+    dst->connections_total+=src->connections_total;
+    dst->connections_active+=src->connections_active;
+    dst->connections_reset+=src->connections_reset;
+    dst->bytes_to_ssl+=src->bytes_to_ssl;
+    dst->bytes_to_sock+=src->bytes_to_sock;
+    dst->handshakes_full+=src->handshakes_full;
+    dst->handshakes_resumed+=src->handshakes_resumed;
+    dst->handshakes_failed+=src->handshakes_failed;
+    dst->records_small+=src->records_small;
+    dst->records_full+=src->records_full;
+    dst->handshake_seconds+=src->handshake_seconds;
+    for(i=0; i<STATS_BUCKETS; i++)
+        dst->handshake_hist[i]+=src->handshake_hist[i];
+    for(i=0; i<MAX_HOSTS; i++)
+        dst->connect_failures[i]+=src->connect_failures[i];
+    for(i=0; i<TIMEOUT_TYPES; i++)
+        dst->timeouts[i]+=src->timeouts[i];
+}
+
+    /* create the statistics socket, returns its descriptor or -1 */
+int stats_init(int worker) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if(!options.stats_socket) /* disabled */
+        return -1;
+#ifdef USE_FORK
+    if(pipe(stats_pipe)) {
+        ioerror("stats pipe");
+        exit(1);
+    }
+    if(alloc_fd(stats_pipe[0]) || alloc_fd(stats_pipe[1]))
+        exit(1);
+#ifdef FD_CLOEXEC
+    fcntl(stats_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(stats_pipe[1], F_SETFD, FD_CLOEXEC);
+#endif
+    fcntl(stats_pipe[0], F_SETFL, O_NONBLOCK);
+#endif
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    if(strlen(options.stats_socket)+12>sizeof(addr.sun_path)) {
+        s_log(LOG_ERR, "Statistics socket path too long");
+        exit(1);
+    }
+    if(worker<0) /* a single process */
+        strcpy(addr.sun_path, options.stats_socket);
+    else /* one socket per worker */
+        sprintf(addr.sun_path, "%s.%d", options.stats_socket, worker);
+    if((fd=socket(AF_UNIX, SOCK_STREAM, 0))<0) {
+        sockerror("stats socket");
+        exit(1);
+    }
+    if(alloc_fd(fd))
+        exit(1);
+    unlink(addr.sun_path); /* left behind by a previous instance */
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        s_log(LOG_ERR, "Error binding statistics socket %s", addr.sun_path);
+        sockerror("bind");
+        exit(1);
+    }
+    if(listen(fd, 5)) {
+        sockerror("listen");
+        exit(1);
+    }
+#ifdef FD_CLOEXEC
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    s_log(LOG_DEBUG, "Statistics available at %s", addr.sun_path);
+    return fd;
+}
+
+#ifdef USE_FORK
+int stats_pipe_fd(void) {
+    return stats_pipe[0];
+}
+
+void stats_read(void) { /* collect the deltas sent by children */
+    STATS_RECORD rec;
+
+    while(read(stats_pipe[0], &rec, sizeof(STATS_RECORD))==
+            sizeof(STATS_RECORD))
+        stats_add(&rec.opt->stats, &rec.stats);
+}
+#endif
+
+    /* serve a single request on the statistics socket */
+    /* returns 1 if the descriptors of stats_fds() changed */
+int stats_accept(int fd) {
+    REPORT report;
+    LOCAL_OPTIONS *opt;
+    STATS *snapshot;
+    STATS_READER *reader;
+    int s, n;
+
+    s=accept(fd, NULL, NULL);
+    if(s<0) /* not a real problem: the peer may have gone */
+        return 0;
+    fcntl(s, F_SETFL, O_NONBLOCK); /* never block the daemon loop */
+    for(n=0, opt=local_options.next; opt; opt=opt->next)
+        n++;
+    snapshot=calloc(n ? n : 1, sizeof(STATS));
+    if(!snapshot) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        close(s);
+        return 0;
+    }
+    enter_critical_section(CRIT_STATS);
+    for(n=0, opt=local_options.next; opt; opt=opt->next)
+        memcpy(snapshot+n++, &opt->stats, sizeof(STATS));
+    leave_critical_section(CRIT_STATS);
+    report.data=NULL;
+    report.len=report.size=0;
+    stats_report(&report, snapshot);
+    free(snapshot);
+    reader=calloc(1, sizeof(STATS_READER));
+    if(!reader) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        if(report.data)
+            free(report.data);
+        close(s);
+        return 0;
+    }
+    reader->fd=s;
+    reader->report=report;
+    reader->timeout=time(NULL)+STATS_TIMEOUT;
+    if(!reader_send(reader)) { /* small reports fit in the socket buffer */
+        reader_free(reader);
+        return 0;
+    }
+    /* the rest is sent by stats_send() when the reader catches up */
+    reader->next=readers;
+    readers=reader;
+    return 1;
+}
+
+    /* continue the reports, called by the daemon loop after s_poll_wait()
+     * returns 1 if the descriptors of stats_fds() changed */
+int stats_send(s_poll_set *fds) {
+    STATS_READER **ptr, *reader;
+    int changed=0;
+    time_t now;
+
+    now=time(NULL);
+    ptr=&readers;
+    while((reader=*ptr)) {
+        if(s_poll_canwrite(fds, reader->fd) && !reader_send(reader)) {
+            /* finished or failed */
+        } else if(now<reader->timeout) {
+            ptr=&reader->next;
+            continue;
+        }
+        *ptr=reader->next;
+        reader_free(reader);
+        changed=1;
+    }
+    return changed;
+}
+
+    /* add the descriptors of the reports in progress */
+void stats_fds(s_poll_set *fds) {
+    STATS_READER *reader;
+
+    for(reader=readers; reader; reader=reader->next)
+        s_poll_add(fds, reader->fd, 0, 1);
+}
+
+    /* seconds until stats_send() drops a reader, -1 for never */
+int stats_timeout(void) {
+    STATS_READER *reader;
+    time_t now, next=0;
+
+    for(reader=readers; reader; reader=reader->next)
+        if(!next || reader->timeout<next)
+            next=reader->timeout;
+    if(!next)
+        return -1;
+    now=time(NULL);
+    return next>now ? (int)(next-now) : 0;
+}
+
+    /* returns 1 while a part of the report is left to send */
+static int reader_send(STATS_READER *reader) {
+    int num;
+
+    while(reader->sent<reader->report.len) {
+        num=write(reader->fd, reader->report.data+reader->sent,
+            reader->report.len-reader->sent);
+        if(num<0) {
+            switch(get_last_error()) {
+            case EINTR:
+                continue;
+            case EWOULDBLOCK:
+#if EAGAIN!=EWOULDBLOCK
+            case EAGAIN:
+#endif
+                return 1; /* the socket buffer is full */
+            default:
+                return 0; /* the peer may have gone */
+            }
+        }
+        reader->sent+=num;
+    }
+    return 0;
+}
+
+static void reader_free(STATS_READER *reader) {
+    if(reader->sent<reader->report.len)
+        s_log(LOG_NOTICE, "Statistics truncated: %d of %d bytes sent",
+            reader->sent, reader->report.len);
+    if(reader->report.data)
+        free(reader->report.data);
+    /* FORK children inherit the socket: shutdown() is seen by the peer */
+    shutdown(reader->fd, SHUT_RDWR);
+    close(reader->fd);
+    free(reader);
+}
+
+    /* Prometheus text format: all samples of a metric form one group */
+static void stats_report(REPORT *r, STATS *snapshot) {
+    static const char *timeout_name[TIMEOUT_TYPES]=
+        {"connect", "busy", "idle", "close"};
+    LOCAL_OPTIONS *opt;
+    STATS *s;
+    char backend[IPLEN];
+    double limit;
+    long count;
+    int i;
+
+    report_printf(r, "# TYPE stunnel_connections_active gauge\n");
+    for(s=snapshot, opt=local_options.next; opt; opt=opt->next, s++)
+        report_printf(r, "stunnel_connections_active{service=\"%s\"} %ld\n",
+            opt->servname, s->connections_active);
+    report_printf(r, "# TYPE stunnel_connections_total counter\n");
+    for(s=snapshot, opt=local_options.next; opt; opt=opt->next, s++)
+        report_printf(r, "stunnel_connections_total{service=\"%s\"} %ld\n",
+            opt->servname, s->connections_total);
+    report_printf(r, "# TYPE stunnel_connections_reset_total counter\n");
+    for(s=snapshot, opt=local_options.next; opt; opt=opt->next, s++)
+        report_printf(r,
+            "stunnel_connections_reset_total{service=\"%s\"} %ld\n",
+            opt->servname, s->connections_reset);
+    report_printf(r, "# TYPE stunnel_bytes_total counter\n");
+    for(s=snapshot, opt=local_options.next; opt; opt=opt->next, s++) {
+        report_printf(r,
+            "stunnel_bytes_total{service=\"%s\",to=\"ssl\"} %.0f\n",
+            opt->servname, s->bytes_to_ssl);
+        report_printf(r,
+            "stunnel_bytes_total{service=\"%s\",to=\"socket\"} %.0f\n",
+            opt->servname, s->bytes_to_sock);
+    }
+    report_printf(r, "# TYPE stunnel_handshakes_total counter\n");
+    for(s=snapshot, opt=local_options.next; opt; opt=opt->next, s++) {
+        report_printf(r,
+            "stunnel_handshakes_total{service=\"%s\",type=\"full\"} %ld\n",
+            opt->servname, s->handshakes_full);
+        report_printf(r,
+            "stunnel_handshakes_total{service=\"%s\",type=\"resumed\"} %ld\n",
+            opt->servname, s->handshakes_resumed);
+        report_printf(r,
+            "stunnel_handshakes_total{service=\"%s\",type=\"failed\"} %ld\n",
+            opt->servname, s->handshakes_failed);
+    }
+    report_printf(r, "# TYPE stunnel_records_total counter\n");
+    for(s=snapshot, opt=local_options.next; opt; opt=opt->next, s++) {
+        report_printf(r,
+            "stunnel_records_total{service=\"%s\",size=\"small\"} %ld\n",
+            opt->servname, s->records_small);
+        report_printf(r,
+            "stunnel_records_total{service=\"%s\",size=\"full\"} %ld\n",
+            opt->servname, s->records_full);
+    }
+    report_printf(r, "# TYPE stunnel_handshake_seconds histogram\n");
+    for(s=snapshot, opt=local_options.next; opt; opt=opt->next, s++) {
+        limit=STATS_BUCKET_MIN;
+        count=0;
+        for(i=0; i<STATS_BUCKETS; i++) {
+            count+=s->handshake_hist[i];
+            if(i<STATS_BUCKETS-1)
+                report_printf(r, "stunnel_handshake_seconds_bucket"
+                    "{service=\"%s\",le=\"%g\"} %ld\n",
+                    opt->servname, limit, count);
+            else
+                report_printf(r, "stunnel_handshake_seconds_bucket"
+                    "{service=\"%s\",le=\"+Inf\"} %ld\n",
+                    opt->servname, count);
+            limit*=2;
+        }
+        report_printf(r,
+            "stunnel_handshake_seconds_sum{service=\"%s\"} %f\n",
+            opt->servname, s->handshake_seconds);
+        report_printf(r,
+            "stunnel_handshake_seconds_count{service=\"%s\"} %ld\n",
+            opt->servname, count);
+    }
+    report_printf(r, "# TYPE stunnel_connect_failures_total counter\n");
+    for(s=snapshot, opt=local_options.next; opt; opt=opt->next, s++) {
+        if(!opt->option.remote) /* no backend to connect */
+            continue;
+        if(opt->option.delayed_lookup) { /* counted in the first slot */
+            report_printf(r, "stunnel_connect_failures_total"
+                "{service=\"%s\",backend=\"%s\"} %ld\n",
+                opt->servname, opt->remote_address, s->connect_failures[0]);
+            continue;
+        }
+        for(i=0; i<opt->remote_addr.num; i++) {
+            s_ntop(backend, &opt->remote_addr.addr[i]);
+            report_printf(r, "stunnel_connect_failures_total"
+                "{service=\"%s\",backend=\"%s\"} %ld\n",
+                opt->servname, backend, s->connect_failures[i]);
+        }
+    }
+    report_printf(r, "# TYPE stunnel_timeouts_total counter\n");
+    for(s=snapshot, opt=local_options.next; opt; opt=opt->next, s++)
+        for(i=0; i<TIMEOUT_TYPES; i++)
+            report_printf(r, "stunnel_timeouts_total"
+                "{service=\"%s\",type=\"%s\"} %ld\n",
+                opt->servname, timeout_name[i], s->timeouts[i]);
+#ifdef LOG_ASYNC
+    report_printf(r, "# TYPE stunnel_log_dropped_total counter\n");
+    report_printf(r, "stunnel_log_dropped_total %lu\n", log_dropped());
+#endif
+}
+
+static void report_printf(REPORT *r, const char *format, ...) {
+    char line[STRLEN], *data;
+    va_list arglist;
+    int len;
+
+    va_start(arglist, format);
+#ifdef HAVE_VSNPRINTF
+    len=vsnprintf(line, STRLEN, format, arglist);
+#else
+    len=vsprintf(line, format, arglist);
+#endif
+    va_end(arglist);
+    if(len<0 || len>=STRLEN)
+        return; /* line truncated: skip it */
+    if(r->len+len>r->size) {
+        data=realloc(r->data, r->size+4*STRLEN);
+        if(!data) {
+            s_log(LOG_ERR, "Memory allocation failed");
+            return;
+        }
+        r->data=data;
+        r->size+=4*STRLEN;
+    }
+    memcpy(r->data+r->len, line, len);
+    r->len+=len;
+}
+
+#endif /* !defined USE_WIN32 */
+
+/* End of stats.c */
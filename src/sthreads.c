@@ -66,6 +66,20 @@ CONTEXT *ready_head=NULL, *ready_tail=NULL;         /* ready to execute */
 CONTEXT *waiting_head=NULL, *waiting_tail=NULL;     /* waiting on poll() */
 int next_id=1;
 
+/* Try to use non-POSIX MAP_ANON on older systems */
+#if !defined MAP_ANONYMOUS && defined MAP_ANON
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+static char *alloc_stack(void);
+static void free_stack(char *);
+
+static char *stack_pool[STACK_POOL_SIZE]; /* released stacks for reuse */
+static int stack_pool_num=0;
+
 unsigned long stunnel_process_id(void) {
     return (unsigned long)getpid();
 }
@@ -74,7 +88,7 @@ unsigned long stunnel_thread_id(void) {
     return ready_head ? ready_head->id : 0;
 }
 
-static CONTEXT *new_context(void) {
+static CONTEXT *new_context(int stack_needed) {
     CONTEXT *ctx;
 
     /* allocate and fill the CONTEXT structure */
@@ -83,22 +97,30 @@ static CONTEXT *new_context(void) {
         s_log(LOG_ERR, "Unable to allocate CONTEXT structure");
         return NULL;
     }
+    ctx->stack=NULL;
+    if(stack_needed) { /* the listening context runs on the process stack */
+        ctx->stack=alloc_stack();
+        if(!ctx->stack) {
+            free(ctx);
+            return NULL;
+        }
+    }
     ctx->id=next_id++;
     ctx->fds=NULL;
     ctx->ready=0;
     /* some manuals claim that initialization of ctx structure is required */
     if(getcontext(&ctx->ctx)<0) {
-        free(ctx);
+        release_context(ctx);
         ioerror("getcontext");
         return NULL;
     }
     ctx->ctx.uc_link=NULL; /* it should never happen */
 #if defined(__sgi) || ARGC==2 /* obsolete ss_sp semantics */
-    ctx->ctx.uc_stack.ss_sp=ctx->stack+STACK_SIZE-8;
+    ctx->ctx.uc_stack.ss_sp=ctx->stack+UCONTEXT_STACK_SIZE-8;
 #else
     ctx->ctx.uc_stack.ss_sp=ctx->stack;
 #endif
-    ctx->ctx.uc_stack.ss_size=STACK_SIZE;
+    ctx->ctx.uc_stack.ss_size=UCONTEXT_STACK_SIZE;
     ctx->ctx.uc_stack.ss_flags=0;
 
     /* attach to the tail of the ready queue */
@@ -111,10 +133,100 @@ static CONTEXT *new_context(void) {
     return ctx;
 }
 
+void release_context(CONTEXT *ctx) {
+    if(ctx->stack)
+        free_stack(ctx->stack);
+    free(ctx);
+}
+
+#ifdef MAP_ANONYMOUS
+
+static int page_size=0;
+
+/* the stack is mapped with a single guard page below its usable area
+ * memory is only committed by the kernel for pages actually touched */
+static char *alloc_stack(void) {
+    char *stack;
+
+    if(stack_pool_num) /* reuse a previously released stack */
+        return stack_pool[--stack_pool_num];
+    if(!page_size)
+        page_size=getpagesize();
+    stack=mmap(NULL, UCONTEXT_STACK_SIZE+page_size, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if(stack==MAP_FAILED) {
+        ioerror("mmap (context stack)");
+        return NULL;
+    }
+    if(mprotect(stack, page_size, PROT_NONE)) /* stack grows down */
+        ioerror("mprotect (guard page)"); /* not critical */
+    return stack+page_size;
+}
+
+static void free_stack(char *stack) {
+    /* give the touched pages back to the kernel, keep the mapping */
+    if(madvise(stack, UCONTEXT_STACK_SIZE, MADV_DONTNEED))
+        ioerror("madvise (context stack)"); /* not critical */
+    if(stack_pool_num<STACK_POOL_SIZE) {
+        stack_pool[stack_pool_num++]=stack;
+        return;
+    }
+    if(munmap(stack-page_size, UCONTEXT_STACK_SIZE+page_size))
+        ioerror("munmap (context stack)");
+}
+
+/* number of bytes of the current context stack committed by the kernel */
+/* stack pages are released on reuse, so this is the high-water mark */
+int stack_usage(void) {
+    unsigned char *vec;
+    int pages, i, used;
+
+    if(!ready_head || !ready_head->stack)
+        return 0;
+    pages=UCONTEXT_STACK_SIZE/page_size;
+    vec=malloc(pages);
+    if(!vec)
+        return 0;
+    used=0;
+    if(!mincore(ready_head->stack, UCONTEXT_STACK_SIZE, (void *)vec))
+        for(i=0; i<pages; i++)
+            if(vec[i]&1)
+                used++;
+    free(vec);
+    return used*page_size;
+}
+
+#else /* MAP_ANONYMOUS */
+
+/* no anonymous mmap() -> no guard page and no lazy commit */
+static char *alloc_stack(void) {
+    char *stack;
+
+    if(stack_pool_num) /* reuse a previously released stack */
+        return stack_pool[--stack_pool_num];
+    stack=malloc(UCONTEXT_STACK_SIZE);
+    if(!stack)
+        s_log(LOG_ERR, "Unable to allocate context stack");
+    return stack;
+}
+
+static void free_stack(char *stack) {
+    if(stack_pool_num<STACK_POOL_SIZE)
+        stack_pool[stack_pool_num++]=stack;
+    else
+        free(stack);
+}
+
+int stack_usage(void) {
+    return 0; /* unknown */
+}
+
+#endif /* MAP_ANONYMOUS */
+
 /* s_log is not initialized here, but we can use log_raw */
 void sthreads_init(void) {
     /* create the first (listening) context and put it in the running queue */
-    if(!new_context()) {
+    if(!new_context(0)) {
         log_raw("Unable create the listening context");
         exit(1);
     }
@@ -124,7 +236,7 @@ int create_client(int ls, int s, void *arg, void *(*cli)(void *)) {
     CONTEXT *ctx;
 
     s_log(LOG_DEBUG, "Creating a new context");
-    ctx=new_context();
+    ctx=new_context(1);
     if(!ctx)
         return -1;
     s_log(LOG_DEBUG, "Context %ld created", ctx->id);
@@ -180,7 +292,9 @@ int create_client(int ls, int s, void *arg, void *(*cli)(void *)) {
 #ifdef USE_PTHREAD
 
 static pthread_mutex_t stunnel_cs[CRIT_SECTIONS];
+#if SSLEAY_VERSION_NUMBER < 0x10100000L
 static pthread_mutex_t lock_cs[CRYPTO_NUM_LOCKS];
+#endif /* OpenSSL 1.1.0 locks internally */
 static pthread_attr_t pth_attr;
 
 void enter_critical_section(SECTION_CODE i) {
@@ -191,6 +305,7 @@ void leave_critical_section(SECTION_CODE i) {
     pthread_mutex_unlock(stunnel_cs+i);
 }
 
+#if SSLEAY_VERSION_NUMBER < 0x10100000L
 static void locking_callback(int mode, int type,
 #ifdef HAVE_OPENSSL
     const /* Callback definition has been changed in openssl 0.9.3 */
@@ -201,6 +316,7 @@ static void locking_callback(int mode, int type,
     else
         pthread_mutex_unlock(lock_cs+type);
 }
+#endif
 
 void sthreads_init(void) {
     int i;
@@ -209,11 +325,13 @@ void sthreads_init(void) {
     for(i=0; i<CRIT_SECTIONS; i++)
         pthread_mutex_init(stunnel_cs+i, NULL);
 
+#if SSLEAY_VERSION_NUMBER < 0x10100000L
     /* Initialize OpenSSL locking callback */
     for(i=0; i<CRYPTO_NUM_LOCKS; i++)
         pthread_mutex_init(lock_cs+i, NULL);
     CRYPTO_set_id_callback(stunnel_thread_id);
     CRYPTO_set_locking_callback(locking_callback);
+#endif
 
     pthread_attr_init(&pth_attr);
     pthread_attr_setdetachstate(&pth_attr, PTHREAD_CREATE_DETACHED);
@@ -262,7 +380,9 @@ int create_client(int ls, int s, void *arg, void *(*cli)(void *)) {
 #ifdef USE_WIN32
 
 static CRITICAL_SECTION stunnel_cs[CRIT_SECTIONS];
+#if SSLEAY_VERSION_NUMBER < 0x10100000L
 static CRITICAL_SECTION lock_cs[CRYPTO_NUM_LOCKS];
+#endif /* OpenSSL 1.1.0 locks internally */
 
 void enter_critical_section(SECTION_CODE i) {
     EnterCriticalSection(stunnel_cs+i);
@@ -272,6 +392,7 @@ void leave_critical_section(SECTION_CODE i) {
     LeaveCriticalSection(stunnel_cs+i);
 }
 
+#if SSLEAY_VERSION_NUMBER < 0x10100000L
 static void locking_callback(int mode, int type,
 #ifdef HAVE_OPENSSL
     const /* Callback definition has been changed in openssl 0.9.3 */
@@ -282,6 +403,7 @@ static void locking_callback(int mode, int type,
     else
         LeaveCriticalSection(lock_cs+type);
 }
+#endif
 
 void sthreads_init(void) {
     int i;
@@ -290,10 +412,12 @@ void sthreads_init(void) {
     for(i=0; i<CRIT_SECTIONS; i++)
         InitializeCriticalSection(stunnel_cs+i);
 
+#if SSLEAY_VERSION_NUMBER < 0x10100000L
     /* Initialize OpenSSL locking callback */
     for(i=0; i<CRYPTO_NUM_LOCKS; i++)
         InitializeCriticalSection(lock_cs+i);
     CRYPTO_set_locking_callback(locking_callback);
+#endif
 }
 
 unsigned long stunnel_process_id(void) {
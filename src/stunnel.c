@@ -38,6 +38,9 @@
 
     /* Prototypes */
 static void daemon_loop(void);
+static int bind_service(LOCAL_OPTIONS *);
+static void start_service(LOCAL_OPTIONS *);
+static void daemon_fds(s_poll_set *, int, int, int);
 static void accept_connection(LOCAL_OPTIONS *);
 static void get_limits(void); /* setup global max_clients and max_fds */
 #if !defined (USE_WIN32) && !defined (__vms)
@@ -45,20 +48,41 @@ static void drop_privileges(void);
 static void daemonize(void);
 static void create_pid(void);
 static void delete_pid(void);
+#endif
+#ifdef USE_UCONTEXT
+static int start_workers(void);
+static int upgrade_workers(void);
+static int fork_worker(int);
+static void bind_cpu(int);
 #endif
 
     /* Error/exceptions handling functions */
 #ifndef USE_WIN32
 static void signal_handler(int);
+static void terminate(int);
+static void reload_handler(int);
+static void reload(void);
+static void upgrade_handler(int);
+static void drain(int);
 #endif
 
 int volatile num_clients=0; /* Current number of clients */
+#ifndef USE_WIN32
+static pid_t loop_pid=0; /* the process running daemon_loop() */
+#endif
+
+#ifdef USE_UCONTEXT
+static int num_workers=0; /* Number of scheduler processes */
+static int worker_num=0; /* Index of this scheduler process */
+static pid_t *worker_pid=NULL; /* Scheduler processes (in the master) */
+#endif
 
     /* Functions */
 
 #ifndef USE_WIN32
 int main(int argc, char* argv[]) { /* execution begins here 8-) */
 
+    upgrade_init(argv); /* before anything is bound */
     main_initialize(argc>1 ? argv[1] : NULL, argc>2 ? argv[2] : NULL);
 
     signal(SIGPIPE, SIG_IGN); /* avoid 'broken pipe' signal */
@@ -83,6 +107,9 @@ void main_initialize(char *arg1, char *arg2) {
     sthreads_init(); /* initialize critical sections & SSL callbacks */
     parse_config(arg1, arg2);
     log_open();
+#ifndef USE_WIN32
+    access_open();
+#endif
     stunnel_info(0);
 }
 
@@ -96,20 +123,34 @@ void main_execute(void) {
         drop_privileges();
 #endif
         num_clients=1;
+        section_hold(&local_options); /* never released */
         client(alloc_client_session(&local_options, 0, 1));
     }
+#ifndef USE_WIN32
+    access_close();
+#endif
     log_close();
 }
 
 static void daemon_loop(void) {
-    SOCKADDR_UNION addr;
     s_poll_set fds;
     LOCAL_OPTIONS *opt;
+    int signal_fd=-1, stats_fd=-1, upgrade_fd=-1, timeout;
+#ifndef USE_WIN32
+    int stats, stats_changed;
+#endif
+#ifdef HAVE_OCSP_STAPLING
+    int ocsp;
+#endif
+    time_t next_check=0;
 
     get_limits();
-    s_poll_zero(&fds);
 #ifndef USE_WIN32
-    s_poll_add(&fds, signal_pipe_init(), 1, 0);
+    signal_fd=signal_pipe_init();
+    if(signal(SIGHUP, SIG_IGN)!=SIG_IGN)
+        signal(SIGHUP, reload_handler);
+    if(signal(SIGUSR2, SIG_IGN)!=SIG_IGN)
+        signal(SIGUSR2, upgrade_handler);
 #endif
 
     if(!local_options.next) {
@@ -121,33 +162,11 @@ static void daemon_loop(void) {
 
     /* bind local ports */
     for(opt=local_options.next; opt; opt=opt->next) {
+        section_hold(opt); /* released when removed by a reload */
         if(!opt->option.accept) /* no need to bind this service */
             continue;
-        memcpy(&addr, &opt->local_addr.addr[0], sizeof(SOCKADDR_UNION));
-        if((opt->fd=socket(addr.sa.sa_family, SOCK_STREAM, 0))<0) {
-            sockerror("local socket");
-            exit(1);
-        }
-        if(alloc_fd(opt->fd))
-            exit(1);
-        if(set_socket_options(opt->fd, 0)<0)
-            exit(1);
-        s_ntop(opt->local_address, &addr);
-        if(bind(opt->fd, &addr.sa, addr_len(addr))) {
-            s_log(LOG_ERR, "Error binding %s to %s",
-                opt->servname, opt->local_address);
-            sockerror("bind");
-            exit(1);
-        }
-        s_log(LOG_DEBUG, "%s bound to %s", opt->servname, opt->local_address);
-        if(listen(opt->fd, 5)) {
-            sockerror("listen");
+        if(bind_service(opt))
             exit(1);
-        }
-#ifdef FD_CLOEXEC
-        fcntl(opt->fd, F_SETFD, FD_CLOEXEC); /* close socket in child execvp */
-#endif
-        s_poll_add(&fds, opt->fd, 1, 0);
     }
 
 #if !defined (USE_WIN32) && !defined (__vms)
@@ -155,32 +174,212 @@ static void daemon_loop(void) {
         daemonize();
     drop_privileges();
     create_pid();
+    upgrade_ready(); /* the old process may stop accepting */
 #endif /* !defined USE_WIN32 && !defined (__vms) */
 
-    /* create exec+connect services */
-    for(opt=local_options.next; opt; opt=opt->next) {
-        if(opt->option.accept) /* skip ordinary (accepting) services */
-            continue;
-        enter_critical_section(CRIT_CLIENTS); /* for multi-cpu machines */
-        ++num_clients;
-        leave_critical_section(CRIT_CLIENTS);
-        create_client(-1, -1, alloc_client_session(opt, -1, -1), client);
+#ifdef USE_UCONTEXT
+    worker_num=start_workers(); /* returns in the scheduler processes only */
+    if(num_workers) { /* a worker */
+        signal_fd=signal_pipe_fd(); /* replaced by fork_worker() */
+        for(opt=local_options.next; opt; opt=opt->next)
+            if(opt->option.accept && opt->fd<0 && bind_service(opt))
+                s_log(LOG_ERR, "Service %s disabled", opt->servname);
     }
+#endif
+#ifndef USE_WIN32
+    loop_pid=getpid(); /* terminating signals are handled by the loop */
+#endif
+
+#ifndef USE_WIN32
+#ifdef USE_UCONTEXT
+    stats_fd=stats_init(num_workers ? worker_num : -1);
+#else
+    stats_fd=stats_init(-1);
+#endif
+#endif
 
+#ifdef LOG_ASYNC
+    log_async_start(); /* no more fork() of the daemon */
+#endif
+
+    /* create exec+connect services */
+    for(opt=local_options.next; opt; opt=opt->next)
+        start_service(opt);
+
+    daemon_fds(&fds, signal_fd, stats_fd, upgrade_fd);
     while(1) {
-        if(s_poll_wait(&fds, -1)<0) { /* non-critical error */
+#ifndef USE_WIN32
+        if(terminate_pending()) /* SIGTERM, SIGQUIT or SIGINT */
+            terminate(terminate_pending());
+        if(reload_pending()) { /* SIGHUP */
+            reload();
+            daemon_fds(&fds, signal_fd, stats_fd, upgrade_fd);
+        }
+        if(upgrade_pending()) { /* SIGUSR2 */
+#ifdef USE_UCONTEXT
+            if(num_workers) /* sent by the master after the upgrade */
+                drain(signal_fd);
+#endif
+            if(upgrade_fd<0)
+                upgrade_fd=upgrade_start();
+            daemon_fds(&fds, signal_fd, stats_fd, upgrade_fd);
+        }
+#endif
+        if(options.cert_check && time(NULL)>=next_check) {
+            for(opt=local_options.next; opt; opt=opt->next)
+                context_check(opt);
+            next_check=time(NULL)+options.cert_check;
+        }
+        timeout=options.cert_check ? /* wake up for the check */
+            options.cert_check : -1;
+#ifdef HAVE_OCSP_STAPLING
+        /* each worker fetches its own copy, the contexts are not shared */
+        if(ocsp_check()) /* refresh the stapled responses */
+            daemon_fds(&fds, signal_fd, stats_fd, upgrade_fd);
+        ocsp=ocsp_timeout();
+        if(ocsp>=0 && (timeout<0 || ocsp<timeout))
+            timeout=ocsp;
+#endif
+#ifndef USE_WIN32
+        stats=stats_timeout(); /* drop the readers that stopped reading */
+        if(stats>=0 && (timeout<0 || stats<timeout))
+            timeout=stats;
+#endif
+        if(s_poll_wait(&fds, timeout)<0) { /* non-critical error */
             log_error(LOG_INFO, get_last_socket_error(),
                 "daemon_loop: s_poll_wait");
             sleep(1); /* to avoid log trashing */
         } else {
+#ifndef USE_WIN32
+#ifdef USE_FORK
+            if(stats_fd>=0 && s_poll_canread(&fds, stats_pipe_fd()))
+                stats_read();
+#endif
+            stats_changed=stats_send(&fds);
+            if(stats_fd>=0 && s_poll_canread(&fds, stats_fd) &&
+                    stats_accept(stats_fd))
+                stats_changed=1;
+#endif
             for(opt=local_options.next; opt; opt=opt->next)
-                if(s_poll_canread(&fds, opt->fd))
+                if(opt->option.accept && opt->fd>=0 &&
+                        s_poll_canread(&fds, opt->fd))
                     accept_connection(opt);
+#ifndef USE_WIN32
+            if(upgrade_fd>=0 && s_poll_canread(&fds, upgrade_fd)) {
+                if(upgrade_wait(upgrade_fd)) /* new process started */
+                    drain(signal_fd);
+                upgrade_fd=-1;
+                daemon_fds(&fds, signal_fd, stats_fd, upgrade_fd);
+            } else if(stats_changed) { /* a report was started or finished */
+                daemon_fds(&fds, signal_fd, stats_fd, upgrade_fd);
+            }
+#endif
         }
     }
     s_log(LOG_ERR, "INTERNAL ERROR: End of infinite loop 8-)");
 }
 
+static int bind_service(LOCAL_OPTIONS *opt) { /* open the listening socket */
+    SOCKADDR_UNION addr;
+#if defined(USE_UCONTEXT) && defined(SO_REUSEPORT)
+    int on=1;
+#endif
+
+    memcpy(&addr, &opt->local_addr.addr[0], sizeof(SOCKADDR_UNION));
+    s_ntop(opt->local_address, &addr);
+#ifndef USE_WIN32
+    if((opt->fd=upgrade_socket(opt->local_address))>=0) {
+        s_log(LOG_DEBUG, "%s inherited %s", opt->servname, opt->local_address);
+        if(alloc_fd(opt->fd)) {
+            opt->fd=-1;
+            return -1;
+        }
+#ifdef FD_CLOEXEC
+        fcntl(opt->fd, F_SETFD, FD_CLOEXEC);
+#endif
+        return 0;
+    }
+#endif
+    if((opt->fd=socket(addr.sa.sa_family, SOCK_STREAM, 0))<0) {
+        sockerror("local socket");
+        return -1;
+    }
+    if(alloc_fd(opt->fd)) {
+        opt->fd=-1;
+        return -1;
+    }
+    if(set_socket_options(opt->fd, 0)<0) {
+        closesocket(opt->fd);
+        opt->fd=-1;
+        return -1;
+    }
+#if defined(USE_UCONTEXT) && defined(SO_REUSEPORT)
+    /* bound by each worker after a reload: share the port */
+    if(num_workers && setsockopt(opt->fd, SOL_SOCKET, SO_REUSEPORT,
+            (void *)&on, sizeof on))
+        sockerror("setsockopt SO_REUSEPORT"); /* not critical */
+#endif
+    if(bind(opt->fd, &addr.sa, addr_len(addr))) {
+        s_log(LOG_ERR, "Error binding %s to %s",
+            opt->servname, opt->local_address);
+        sockerror("bind");
+        closesocket(opt->fd);
+        opt->fd=-1;
+        return -1;
+    }
+    s_log(LOG_DEBUG, "%s bound to %s", opt->servname, opt->local_address);
+    if(listen(opt->fd, 5)) {
+        sockerror("listen");
+        closesocket(opt->fd);
+        opt->fd=-1;
+        return -1;
+    }
+#ifdef FD_CLOEXEC
+    fcntl(opt->fd, F_SETFD, FD_CLOEXEC); /* close socket in child execvp */
+#endif
+    return 0;
+}
+
+static void start_service(LOCAL_OPTIONS *opt) { /* exec+connect service */
+    if(opt->option.accept) /* skip ordinary (accepting) services */
+        return;
+#ifdef USE_UCONTEXT
+    if(worker_num || worker_pid) /* they run in the first worker */
+        return;
+#endif
+    enter_critical_section(CRIT_CLIENTS); /* for multi-cpu machines */
+    ++num_clients;
+    leave_critical_section(CRIT_CLIENTS);
+    create_client(-1, -1, alloc_client_session(opt, -1, -1), client);
+}
+
+    /* signal pipe, statistics and listening sockets of the services */
+static void daemon_fds(s_poll_set *fds, int signal_fd, int stats_fd,
+        int upgrade_fd) {
+    LOCAL_OPTIONS *opt;
+
+    s_poll_zero(fds);
+#ifndef USE_WIN32
+    s_poll_add(fds, signal_fd, 1, 0);
+    if(stats_fd>=0) {
+        s_poll_add(fds, stats_fd, 1, 0);
+        stats_fds(fds); /* readers of the reports in progress */
+    }
+#ifdef USE_FORK
+    if(stats_fd>=0)
+        s_poll_add(fds, stats_pipe_fd(), 1, 0);
+#endif
+    if(upgrade_fd>=0)
+        s_poll_add(fds, upgrade_fd, 1, 0);
+#endif
+    for(opt=local_options.next; opt; opt=opt->next)
+        if(opt->option.accept && opt->fd>=0)
+            s_poll_add(fds, opt->fd, 1, 0);
+#ifdef HAVE_OCSP_STAPLING
+    ocsp_fds(fds); /* responders of the fetches in progress */
+#endif
+}
+
 static void accept_connection(LOCAL_OPTIONS *opt) {
     SOCKADDR_UNION addr;
     char from_address[IPLEN];
@@ -192,6 +391,11 @@ static void accept_connection(LOCAL_OPTIONS *opt) {
         switch(get_last_socket_error()) {
             case EINTR:
                 break; /* retry */
+            case EWOULDBLOCK:
+#if EAGAIN!=EWOULDBLOCK
+            case EAGAIN:
+#endif
+                return; /* accepted by another process */
             case EMFILE:
 #ifdef ENFILE
             case ENFILE:
@@ -228,6 +432,159 @@ static void accept_connection(LOCAL_OPTIONS *opt) {
     leave_critical_section(CRIT_CLIENTS);
 }
 
+#ifdef USE_UCONTEXT
+
+/* each worker is a separate process with its own ucontext scheduler,
+ * so no locking is needed and connections never leave their CPU
+ * the listening sockets are shared and the kernel hands out new
+ * connections to whichever worker calls accept() first
+ * the master reloads too, so a restarted worker only inherits the sockets
+ * of the current services and binds the ones added by a reload */
+static int start_workers(void) {
+    int i, status, draining=0;
+    pid_t pid;
+    struct sigaction sa;
+
+    num_workers=options.workers;
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+    if(!num_workers) /* auto */
+        num_workers=sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(num_workers<=1) {
+        num_workers=0; /* a single scheduler in this process */
+        return 0;
+    }
+    worker_pid=calloc(num_workers, sizeof(pid_t));
+    if(!worker_pid) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        exit(1);
+    }
+    s_log(LOG_NOTICE, "Starting %d workers", num_workers);
+    for(i=0; i<num_workers; i++) {
+        pid=fork_worker(i);
+        if(!pid) /* worker_pid was freed: don't store the result */
+            return i; /* worker process */
+        worker_pid[i]=pid;
+    }
+
+    /* master process: restart workers that died */
+    while(1) {
+        /* reload and upgrade requests interrupt wait(): no SA_RESTART,
+         * installed again because the handlers re-arm with signal() */
+        if(!sigaction(SIGHUP, NULL, &sa) && sa.sa_handler!=SIG_IGN) {
+            sa.sa_handler=reload_handler;
+            sigemptyset(&sa.sa_mask);
+            sa.sa_flags=0;
+            sigaction(SIGHUP, &sa, NULL);
+        }
+        if(!sigaction(SIGUSR2, NULL, &sa) && sa.sa_handler!=SIG_IGN) {
+            sa.sa_handler=upgrade_handler;
+            sigemptyset(&sa.sa_mask);
+            sa.sa_flags=0;
+            sigaction(SIGUSR2, &sa, NULL);
+        }
+        pid=wait(&status);
+        if(pid<0) {
+            if(get_last_error()==EINTR) {
+                if(reload_pending() && !draining)
+                    reload(); /* the sockets of the restarted workers */
+                if(upgrade_pending() && !draining)
+                    draining=upgrade_workers();
+                continue;
+            }
+            if(get_last_error()==ECHILD && draining) {
+                s_log(LOG_NOTICE, "All workers finished");
+#ifdef LOG_ASYNC
+                log_flush();
+#endif
+                exit(0);
+            }
+            ioerror("wait");
+            sleep(1); /* to avoid log trashing */
+            continue;
+        }
+        for(i=0; i<num_workers && worker_pid[i]!=pid; i++)
+            ;
+        if(i==num_workers) /* not a worker */
+            continue;
+        if(draining) { /* replaced by the new process */
+            worker_pid[i]=0;
+            continue;
+        }
+        s_log(LOG_ERR, "Worker %d (PID=%d) died: restarting", i, (int)pid);
+        sleep(1); /* to avoid fork trashing */
+        pid=fork_worker(i);
+        if(!pid)
+            return i; /* worker process */
+        worker_pid[i]=pid;
+    }
+    return 0; /* never reached */
+}
+
+static int upgrade_workers(void) { /* master: start the new binary */
+    int fd, i;
+
+    fd=upgrade_start();
+    if(fd<0 || !upgrade_wait(fd))
+        return 0; /* keep the old workers */
+    options.dpid=0; /* the pid file belongs to the new process */
+    for(i=0; i<num_workers; i++)
+        if(worker_pid[i]>0)
+            kill(worker_pid[i], SIGUSR2); /* drain */
+    s_log(LOG_NOTICE, "Waiting for the workers to finish");
+    return 1;
+}
+
+static int fork_worker(int i) {
+    pid_t pid;
+
+    pid=fork();
+    switch(pid) {
+    case -1: /* error */
+        ioerror("fork");
+        exit(1);
+    case 0: /* worker */
+        free(worker_pid);
+        worker_pid=NULL; /* not the master */
+        signal_pipe_init(); /* signals of this worker only */
+        bind_cpu(i);
+        s_log(LOG_DEBUG, "Worker %d started", i);
+        return 0;
+    default: /* master */
+        return pid;
+    }
+}
+
+static void bind_cpu(int i) { /* keep the worker and its clients on one CPU */
+#ifdef CPU_SET
+    cpu_set_t allowed, set;
+    int cpu, num;
+
+    /* pick the i-th (modulo) CPU we are allowed to run on */
+    if(sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        ioerror("sched_getaffinity"); /* not critical */
+        return;
+    }
+    for(cpu=0, num=0; cpu<CPU_SETSIZE; cpu++)
+        if(CPU_ISSET(cpu, &allowed))
+            num++;
+    if(!num)
+        return;
+    i%=num;
+    for(cpu=0; cpu<CPU_SETSIZE; cpu++)
+        if(CPU_ISSET(cpu, &allowed) && !i--)
+            break;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set))
+        ioerror("sched_setaffinity"); /* not critical */
+    else
+        s_log(LOG_DEBUG, "Worker bound to CPU %d", cpu);
+#endif
+}
+
+#endif /* USE_UCONTEXT */
+
 static void get_limits(void) {
 #ifdef USE_WIN32
     max_clients=0;
@@ -409,10 +766,129 @@ static void delete_pid(void) {
 }
 
 static void signal_handler(int sig) { /* signal handler */
+    if(getpid()==loop_pid) { /* the interrupted code may hold a log lock */
+        signal_terminate(sig); /* log, flush and exit in daemon_loop() */
+        return;
+    }
+    /* inetd mode, the UCONTEXT master and FORK children log synchronously */
+    terminate(sig);
+}
+
+static void terminate(int sig) {
+#ifdef USE_UCONTEXT
+    int i;
+
+    if(worker_pid) /* master process: terminate the workers */
+        for(i=0; i<num_workers; i++)
+            if(worker_pid[i]>0)
+                kill(worker_pid[i], SIGTERM);
+#endif
     s_log(sig==SIGTERM ? LOG_NOTICE : LOG_ERR,
         "Received signal %d; terminating", sig);
+#ifdef LOG_ASYNC
+    log_flush(); /* the queued messages would be lost on exit() */
+#endif
+    access_flush();
     exit(3);
 }
+
+static void reload_handler(int sig) { /* SIGHUP: reload the configuration */
+#ifdef USE_UCONTEXT
+    int i;
+
+    if(worker_pid) /* master process: each worker reloads itself */
+        for(i=0; i<num_workers; i++)
+            if(worker_pid[i]>0)
+                kill(worker_pid[i], SIGHUP);
+#endif
+    signal_reload();
+    signal(SIGHUP, reload_handler);
+}
+
+    /* swap in the services of the reloaded configuration file
+     * the connections keep their old section until they finish */
+static void reload(void) {
+    LOCAL_OPTIONS *retired, *opt, *old;
+
+    s_log(LOG_NOTICE, "Reloading configuration file");
+    if(reload_config(&retired)) {
+        s_log(LOG_ERR, "Reload failed: old configuration kept");
+        return;
+    }
+    for(opt=local_options.next; opt; opt=opt->next) {
+        if(opt->refs) /* unchanged section of the old list */
+            continue;
+        section_hold(opt);
+        if(!opt->option.accept) {
+            start_service(opt);
+            continue;
+        }
+        s_ntop(opt->local_address, &opt->local_addr.addr[0]);
+        for(old=retired; old; old=old->next)
+            if(old->option.accept && old->fd>=0 &&
+                    !strcmp(old->local_address, opt->local_address))
+                break;
+        if(old) { /* no need to rebind: take over the listening socket */
+            opt->fd=old->fd;
+            old->fd=-1;
+            s_log(LOG_DEBUG, "%s kept %s", opt->servname, opt->local_address);
+#ifdef USE_UCONTEXT
+        } else if(worker_pid) { /* master: a socket nobody accepts on */
+            continue; /* bound by each worker, restarted ones included */
+#endif
+        } else if(bind_service(opt)) {
+            s_log(LOG_ERR, "Service %s disabled", opt->servname);
+        }
+    }
+    while(retired) {
+        opt=retired;
+        retired=retired->next;
+        if(opt->option.accept && opt->fd>=0) {
+            closesocket(opt->fd);
+            opt->fd=-1;
+        }
+        section_release(opt); /* freed after its last connection */
+    }
+    s_log(LOG_NOTICE, "Configuration reloaded");
+}
+
+static void upgrade_handler(int sig) { /* SIGUSR2: upgrade the binary */
+    signal_upgrade();
+    signal(SIGUSR2, upgrade_handler);
+}
+
+    /* the new process accepts the connections: finish ours and exit */
+static void drain(int signal_fd) {
+    s_poll_set fds;
+    LOCAL_OPTIONS *opt;
+    time_t deadline;
+
+    options.dpid=0; /* the pid file belongs to the new process */
+    for(opt=local_options.next; opt; opt=opt->next)
+        if(opt->option.accept && opt->fd>=0) {
+            closesocket(opt->fd);
+            opt->fd=-1;
+        }
+    s_log(LOG_NOTICE, "Draining %d connection(s)", num_clients);
+    deadline=time(NULL)+options.drain_timeout;
+    s_poll_zero(&fds);
+    s_poll_add(&fds, signal_fd, 1, 0); /* finished FORK children */
+    while(num_clients>0 && time(NULL)<deadline) {
+        s_poll_wait(&fds, 1);
+        if(terminate_pending())
+            terminate(terminate_pending());
+    }
+    if(num_clients>0)
+        s_log(LOG_NOTICE, "Drain timeout: %d connection(s) left",
+            num_clients);
+    else
+        s_log(LOG_NOTICE, "All connections finished");
+#ifdef LOG_ASYNC
+    log_flush(); /* the queued messages would be lost on exit() */
+#endif
+    access_close();
+    exit(0);
+}
 #endif /* !defined USE_WIN32 */
 
 void stunnel_info(int raw) {
@@ -0,0 +1,295 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (c) 1998-2006 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *                 All Rights Reserved
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *   In addition, as a special exception, Michal Trojnara gives
+ *   permission to link the code of this program with the OpenSSL
+ *   library (or with modified versions of OpenSSL that use the same
+ *   license as OpenSSL), and distribute linked combinations including
+ *   the two.  You must obey the GNU General Public License in all
+ *   respects for all of the code used other than OpenSSL.  If you modify
+ *   this file, you may extend this exception to your version of the
+ *   file, but you are not obligated to do so.  If you do not wish to
+ *   do so, delete this exception statement from your version.
+ */
+
+/* On SIGUSR2 the daemon starts a new copy of its binary with the same
+ * arguments and hands over its listening sockets on a UNIX socket pair:
+ * one record of IPLEN bytes with the local address per socket, with the
+ * descriptor attached as SCM_RIGHTS, then an empty record.  The new
+ * process uses the inherited sockets instead of binding its own and
+ * answers with a single byte once it accepts connections.  Only then
+ * the old process closes its listening sockets and drains. */
+
+#include "common.h"
+#include "prototypes.h"
+
+#ifndef USE_WIN32
+
+#define UPGRADE_ENV "STUNNEL_UPGRADE_FD"
+#define UPGRADE_READY 'R'
+
+typedef struct {
+    char address[IPLEN];
+    int fd;
+} UPGRADE_SOCKET;
+
+static char **upgrade_args=NULL; /* for execvp() */
+static int upgrade_channel=-1; /* to the old process */
+static UPGRADE_SOCKET *inherited=NULL;
+static int num_inherited=0;
+
+static char *absolute_path(char *, char *);
+static void upgrade_receive(void);
+static int send_socket(int, char *, int);
+static void upgrade_exec(int);
+
+void upgrade_init(char **argv) {
+    char cwd[PATH_MAX];
+    int i;
+
+    /* the configuration file name is also used by reload_config() */
+    if(getcwd(cwd, sizeof cwd))
+        for(i=0; i<2 && argv[i]; i++) /* binary and configuration file */
+            if(i || strchr(argv[0], '/')) /* argv[0] may be found in PATH */
+                argv[i]=absolute_path(cwd, argv[i]);
+    upgrade_args=argv;
+    upgrade_receive();
+}
+
+    /* make the binary and the configuration file usable after chdir("/") */
+static char *absolute_path(char *cwd, char *path) {
+    char *retval;
+
+    if(path[0]=='/' || path[0]=='-')
+        return path;
+    retval=malloc(strlen(cwd)+strlen(path)+2);
+    if(!retval)
+        return path;
+    sprintf(retval, "%s/%s", cwd, path);
+    return retval;
+}
+
+    /* new process: collect the sockets passed by the old one */
+static void upgrade_receive(void) {
+    char *env, address[IPLEN], control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    UPGRADE_SOCKET *tmp;
+    int fd;
+
+    env=getenv(UPGRADE_ENV);
+    if(!env)
+        return; /* not started by an upgrade */
+    upgrade_channel=atoi(env);
+    unsetenv(UPGRADE_ENV);
+#ifdef FD_CLOEXEC
+    fcntl(upgrade_channel, F_SETFD, FD_CLOEXEC);
+#endif
+    while(1) {
+        memset(&msg, 0, sizeof msg);
+        iov.iov_base=address;
+        iov.iov_len=IPLEN;
+        msg.msg_iov=&iov;
+        msg.msg_iovlen=1;
+        msg.msg_control=control;
+        msg.msg_controllen=sizeof control;
+        if(recvmsg(upgrade_channel, &msg, MSG_WAITALL)!=IPLEN)
+            return; /* old process gone: bind new sockets */
+        address[IPLEN-1]='\0';
+        if(!address[0])
+            return; /* end of the list */
+        cmsg=CMSG_FIRSTHDR(&msg);
+        if(!cmsg || cmsg->cmsg_level!=SOL_SOCKET ||
+                cmsg->cmsg_type!=SCM_RIGHTS)
+            continue;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        tmp=realloc(inherited, (num_inherited+1)*sizeof(UPGRADE_SOCKET));
+        if(!tmp) {
+            close(fd);
+            continue;
+        }
+        inherited=tmp;
+        strcpy(inherited[num_inherited].address, address);
+        inherited[num_inherited].fd=fd;
+        num_inherited++;
+    }
+}
+
+    /* new process: the listening socket passed for an address or -1 */
+int upgrade_socket(char *address) {
+    int i, fd;
+
+    for(i=0; i<num_inherited; i++)
+        if(inherited[i].fd>=0 && !strcmp(inherited[i].address, address)) {
+            fd=inherited[i].fd;
+            inherited[i].fd=-1;
+            return fd;
+        }
+    return -1;
+}
+
+    /* new process: all services started, the old one can drain */
+void upgrade_ready(void) {
+    char ready=UPGRADE_READY;
+    int i;
+
+    if(upgrade_channel<0)
+        return;
+    for(i=0; i<num_inherited; i++)
+        if(inherited[i].fd>=0) { /* no longer configured */
+            s_log(LOG_DEBUG, "Closing inherited socket %s",
+                inherited[i].address);
+            closesocket(inherited[i].fd);
+        }
+    free(inherited);
+    inherited=NULL;
+    num_inherited=0;
+    if(write(upgrade_channel, &ready, 1)!=1)
+        ioerror("upgrade ready"); /* not critical */
+    close(upgrade_channel);
+    upgrade_channel=-1;
+    s_log(LOG_NOTICE, "Upgrade completed");
+}
+
+    /* old process: start the new binary and pass the listening sockets
+     * returns the socket to wait on for its answer or -1 on error */
+int upgrade_start(void) {
+    LOCAL_OPTIONS *opt;
+    int fd[2], status;
+    pid_t pid;
+
+    if(upgrade_args[1] && !strcasecmp(upgrade_args[1], "-fd")) {
+        s_log(LOG_ERR, "Upgrade is not available");
+        return -1;
+    }
+    s_log(LOG_NOTICE, "Starting %s for upgrade", upgrade_args[0]);
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fd)) {
+        sockerror("socketpair");
+        return -1;
+    }
+    /* the intermediate child exits at once: the new process is not our
+     * child, so its exit is never counted as a finished client */
+    pid=fork();
+    switch(pid) {
+    case -1: /* error */
+        ioerror("fork");
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    case 0: /* child */
+        close(fd[0]);
+        upgrade_exec(fd[1]);
+        _exit(1); /* not reached */
+    }
+    close(fd[1]);
+#ifdef HAVE_WAIT_FOR_PID
+    while(wait_for_pid(pid, &status, 0)<0 && get_last_error()==EINTR)
+        ;
+#else
+    while(wait(&status)!=pid && get_last_error()==EINTR)
+        ;
+#endif
+    for(opt=local_options.next; opt; opt=opt->next)
+        if(opt->option.accept && opt->fd>=0)
+            if(send_socket(fd[0], opt->local_address, opt->fd))
+                break;
+    if(opt || send_socket(fd[0], "", -1)) {
+        s_log(LOG_ERR, "Upgrade failed: cannot pass the listening sockets");
+        close(fd[0]);
+        return -1;
+    }
+#ifdef FD_CLOEXEC
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+#endif
+    return fd[0];
+}
+
+static int send_socket(int channel, char *address, int fd) {
+    char record[IPLEN], control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+
+    memset(record, 0, IPLEN);
+    strcpy(record, address);
+    memset(&msg, 0, sizeof msg);
+    iov.iov_base=record;
+    iov.iov_len=IPLEN;
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    if(fd>=0) {
+        msg.msg_control=control;
+        msg.msg_controllen=sizeof control;
+        cmsg=CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level=SOL_SOCKET;
+        cmsg->cmsg_type=SCM_RIGHTS;
+        cmsg->cmsg_len=CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if(sendmsg(channel, &msg, 0)!=IPLEN) {
+        sockerror("sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+static void upgrade_exec(int channel) { /* intermediate child */
+    char env[STRLEN];
+
+    switch(fork()) {
+    case -1: /* error */
+        _exit(1);
+    case 0: /* new process */
+        break;
+    default:
+        _exit(0);
+    }
+#ifdef LOG_ASYNC
+    log_async_child();
+#endif
+#ifdef FD_CLOEXEC
+    fcntl(channel, F_SETFD, 0); /* the only descriptor kept */
+#endif
+    sprintf(env, UPGRADE_ENV "=%d", channel);
+    putenv(env);
+    execvp(upgrade_args[0], upgrade_args);
+    ioerror(upgrade_args[0]);
+    _exit(1);
+}
+
+    /* old process: 1 if the new process is ready, 0 if it failed */
+int upgrade_wait(int channel) {
+    char ready;
+    int num;
+
+    do {
+        num=read(channel, &ready, 1);
+    } while(num<0 && get_last_error()==EINTR);
+    close(channel);
+    if(num!=1 || ready!=UPGRADE_READY) {
+        s_log(LOG_ERR, "Upgrade failed: the new process did not start");
+        return 0;
+    }
+    return 1;
+}
+
+#endif /* !defined USE_WIN32 */
+
+/* End of upgrade.c */
@@ -0,0 +1,397 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (c) 1998-2006 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *                 All Rights Reserved
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Load generator and echo backend for bench.sh
+ *
+ * stunnel-bench echo <port>
+ *     echo backend: every byte received is sent back
+ * stunnel-bench stream <host:port> <connections> <seconds>
+ *     bulk transfer through echo: reports MB/s per tunnel and aggregate
+ * stunnel-bench pingpong <host:port> <connections> <seconds>
+ *     64-byte request/response: reports p50/p99 round trip latency
+ * stunnel-bench connect <host:port> <connections> <seconds>
+ *     connect, exchange one byte, close: reports connections/s
+ * stunnel-bench idle <host:port> <connections>
+ *     open connections, exchange one byte and keep them open until
+ *     the standard input is closed
+ * stunnel-bench probe <host:port>
+ *     connect without sending anything (works for TLS ports too):
+ *     exits with 0 if the port accepted the connection
+ *
+ * All results are printed as "name value" lines for bench.sh */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define BUFFSIZE        16384
+#define PING_SIZE       64
+#define MAX_SAMPLES     (1024*1024)
+
+typedef struct {
+    int fd;
+    int connected;
+    int sent, received; /* bytes of the current exchange */
+    double start; /* start of the current exchange */
+    double bytes; /* total bytes received */
+} CONN;
+
+static struct sockaddr_in target;
+static char buffer[BUFFSIZE];
+static double *samples;
+static int num_samples=0;
+
+static void fatal(const char *txt) {
+    perror(txt);
+    exit(1);
+}
+
+static double now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+static void setnonblock(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0)|O_NONBLOCK);
+}
+
+static void parse_target(char *arg) {
+    char *port;
+    struct hostent *h;
+
+    port=strrchr(arg, ':');
+    if(!port) {
+        fprintf(stderr, "host:port expected\n");
+        exit(1);
+    }
+    *port++='\0';
+    memset(&target, 0, sizeof(target));
+    target.sin_family=AF_INET;
+    target.sin_port=htons(atoi(port));
+    h=gethostbyname(arg);
+    if(!h) {
+        fprintf(stderr, "Unknown host %s\n", arg);
+        exit(1);
+    }
+    memcpy(&target.sin_addr, h->h_addr, sizeof(target.sin_addr));
+}
+
+static void conn_open(CONN *c) {
+    int on=1;
+
+    c->fd=socket(AF_INET, SOCK_STREAM, 0);
+    if(c->fd<0)
+        fatal("socket");
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (void *)&on, sizeof(on));
+    setnonblock(c->fd);
+    if(connect(c->fd, (struct sockaddr *)&target, sizeof(target)) &&
+            errno!=EINPROGRESS)
+        fatal("connect");
+    c->connected=0;
+    c->sent=c->received=0;
+    c->start=now();
+}
+
+static void conn_close(CONN *c) {
+    close(c->fd);
+    c->fd=-1;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x=*(const double *)a, y=*(const double *)b;
+
+    return x<y ? -1 : x>y ? 1 : 0;
+}
+
+static void add_sample(double t) {
+    if(num_samples<MAX_SAMPLES)
+        samples[num_samples++]=t;
+}
+
+static void print_percentiles(void) {
+    if(!num_samples)
+        return;
+    qsort(samples, num_samples, sizeof(double), cmp_double);
+    printf("latency_p50_us %.1f\n", samples[num_samples/2]*1e6);
+    printf("latency_p99_us %.1f\n", samples[num_samples*99/100]*1e6);
+    printf("latency_samples %d\n", num_samples);
+}
+
+/**************************************** echo backend */
+
+static void echo_server(int port) {
+    struct sockaddr_in addr;
+    struct pollfd *ufds;
+    int s, fd, i, n, num, max, on=1;
+
+    s=socket(AF_INET, SOCK_STREAM, 0);
+    if(s<0)
+        fatal("socket");
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (void *)&on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family=AF_INET;
+    addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    addr.sin_port=htons(port);
+    if(bind(s, (struct sockaddr *)&addr, sizeof(addr)))
+        fatal("bind");
+    if(listen(s, 1024))
+        fatal("listen");
+    setnonblock(s);
+    max=1024;
+    ufds=malloc(max*sizeof(struct pollfd));
+    if(!ufds)
+        fatal("malloc");
+    ufds[0].fd=s;
+    ufds[0].events=POLLIN;
+    num=1;
+    while(1) {
+        if(poll(ufds, num, -1)<0) {
+            if(errno==EINTR)
+                continue;
+            fatal("poll");
+        }
+        for(i=num-1; i>0; i--) {
+            if(!ufds[i].revents)
+                continue;
+            n=read(ufds[i].fd, buffer, BUFFSIZE);
+            if(n<0 && (errno==EAGAIN || errno==EINTR))
+                continue;
+            /* the echo is written with a blocking write to keep it simple */
+            if(n<=0 || write(ufds[i].fd, buffer, n)!=n) {
+                close(ufds[i].fd);
+                ufds[i]=ufds[--num];
+            }
+        }
+        if(ufds[0].revents) {
+            while((fd=accept(s, NULL, NULL))>=0) {
+                if(num==max) {
+                    max*=2;
+                    ufds=realloc(ufds, max*sizeof(struct pollfd));
+                    if(!ufds)
+                        fatal("realloc");
+                }
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+                    (void *)&on, sizeof(on));
+                ufds[num].fd=fd;
+                ufds[num].events=POLLIN;
+                ufds[num].revents=0;
+                num++;
+            }
+        }
+    }
+}
+
+/**************************************** load generator */
+
+typedef enum {MODE_STREAM, MODE_PINGPONG, MODE_CONNECT, MODE_IDLE} MODE;
+
+static void load(MODE mode, int num, int seconds) {
+    CONN *c;
+    struct pollfd *ufds;
+    double start, stop, elapsed, total=0.0, per_min=-1.0, per_max=0.0;
+    int i, n, ready=0, connections=0, errors=0, size, closed;
+    char ch;
+
+    c=calloc(num, sizeof(CONN));
+    ufds=calloc(num+1, sizeof(struct pollfd));
+    if(!c || !ufds)
+        fatal("calloc");
+    size=mode==MODE_STREAM ? BUFFSIZE : mode==MODE_PINGPONG ? PING_SIZE : 1;
+    memset(buffer, 'x', BUFFSIZE);
+    for(i=0; i<num; i++)
+        conn_open(c+i);
+    start=now();
+    stop=start+seconds;
+    while(mode==MODE_IDLE || now()<stop) {
+        for(i=0; i<num; i++) {
+            ufds[i].fd=c[i].fd;
+            ufds[i].events=0;
+            if(!c[i].connected || (c[i].sent<size &&
+                    (mode!=MODE_IDLE || !c[i].received)))
+                ufds[i].events|=POLLOUT;
+            if(c[i].connected)
+                ufds[i].events|=POLLIN;
+        }
+        n=num;
+        if(mode==MODE_IDLE && ready==num) { /* wait for EOF on stdin */
+            ufds[n].fd=0;
+            ufds[n].events=POLLIN;
+            n++;
+        }
+        if(poll(ufds, n, 100)<0) {
+            if(errno==EINTR)
+                continue;
+            fatal("poll");
+        }
+        if(n>num && ufds[num].revents) {
+            if(read(0, &ch, 1)<=0)
+                break; /* stdin closed: idle mode finished */
+        }
+        for(i=0; i<num; i++) {
+            if(!ufds[i].revents)
+                continue;
+            if(!c[i].connected && (ufds[i].revents&(POLLOUT|POLLERR|POLLHUP))) {
+                c[i].connected=1;
+                c[i].start=now();
+            }
+            if(ufds[i].revents&POLLOUT && c[i].sent<size) {
+                n=write(c[i].fd, buffer, size-c[i].sent);
+                if(n>0)
+                    c[i].sent+=n;
+            }
+            if(!(ufds[i].revents&(POLLIN|POLLERR|POLLHUP)))
+                continue;
+            n=read(c[i].fd, buffer, BUFFSIZE);
+            if(n<0 && (errno==EAGAIN || errno==EINTR))
+                continue;
+            closed=n<=0;
+            if(n>0) {
+                c[i].received+=n;
+                c[i].bytes+=n;
+                total+=n;
+            }
+            if(mode==MODE_STREAM && c[i].sent==size &&
+                    c[i].received>=size) { /* keep the pipe full */
+                c[i].sent-=size;
+                c[i].received-=size;
+            } else if(c[i].received>=size && c[i].sent==size) {
+                /* one exchange completed */
+                if(mode==MODE_PINGPONG)
+                    add_sample(now()-c[i].start);
+                if(mode==MODE_CONNECT) {
+                    add_sample(now()-c[i].start);
+                    connections++;
+                    conn_close(c+i);
+                    conn_open(c+i);
+                    continue;
+                }
+                if(mode==MODE_IDLE) {
+                    if(c[i].received==size) {
+                        ready++;
+                        if(ready==num) {
+                            printf("idle_ready %d\n", num);
+                            fflush(stdout);
+                        }
+                    }
+                    continue;
+                }
+                c[i].sent=c[i].received=0;
+                c[i].start=now();
+            }
+            if(closed) {
+                errors++;
+                conn_close(c+i);
+                conn_open(c+i);
+            }
+        }
+    }
+    elapsed=now()-start;
+    if(mode==MODE_STREAM) {
+        for(i=0; i<num; i++) {
+            if(per_min<0 || c[i].bytes<per_min)
+                per_min=c[i].bytes;
+            if(c[i].bytes>per_max)
+                per_max=c[i].bytes;
+        }
+        printf("stream_bytes %.0f\n", total);
+        printf("stream_mbps_total %.2f\n", total/elapsed/1e6);
+        printf("stream_mbps_per_tunnel %.2f\n", total/num/elapsed/1e6);
+        printf("stream_mbps_per_tunnel_min %.2f\n", per_min/elapsed/1e6);
+        printf("stream_mbps_per_tunnel_max %.2f\n", per_max/elapsed/1e6);
+    }
+    if(mode==MODE_CONNECT)
+        printf("connect_per_sec %.1f\n", connections/elapsed);
+    if(mode!=MODE_STREAM && mode!=MODE_IDLE)
+        print_percentiles();
+    printf("errors %d\n", errors);
+    for(i=0; i<num; i++)
+        if(c[i].fd>=0)
+            close(c[i].fd);
+    free(c);
+    free(ufds);
+}
+
+static void probe(void) { /* is anybody listening? */
+    int fd;
+
+    fd=socket(AF_INET, SOCK_STREAM, 0);
+    if(fd<0)
+        fatal("socket");
+    if(connect(fd, (struct sockaddr *)&target, sizeof(target)))
+        fatal("connect");
+    close(fd);
+    exit(0);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage:\n"
+        "  stunnel-bench echo <port>\n"
+        "  stunnel-bench stream <host:port> <connections> <seconds>\n"
+        "  stunnel-bench pingpong <host:port> <connections> <seconds>\n"
+        "  stunnel-bench connect <host:port> <connections> <seconds>\n"
+        "  stunnel-bench idle <host:port> <connections>\n"
+        "  stunnel-bench probe <host:port>\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    if(argc==3 && !strcmp(argv[1], "echo"))
+        echo_server(atoi(argv[2]));
+    if(argc==3 && !strcmp(argv[1], "probe")) {
+        parse_target(argv[2]);
+        probe();
+    }
+    if(argc<4)
+        usage();
+    samples=malloc(MAX_SAMPLES*sizeof(double));
+    if(!samples)
+        fatal("malloc");
+    parse_target(argv[2]);
+    if(!strcmp(argv[1], "idle"))
+        load(MODE_IDLE, atoi(argv[3]), 0);
+    else if(argc!=5)
+        usage();
+    else if(!strcmp(argv[1], "stream"))
+        load(MODE_STREAM, atoi(argv[3]), atoi(argv[4]));
+    else if(!strcmp(argv[1], "pingpong"))
+        load(MODE_PINGPONG, atoi(argv[3]), atoi(argv[4]));
+    else if(!strcmp(argv[1], "connect"))
+        load(MODE_CONNECT, atoi(argv[3]), atoi(argv[4]));
+    else
+        usage();
+    return 0;
+}
+
+/* End of bench.c */
@@ -0,0 +1,207 @@
+#!/bin/sh
+#
+# stunnel benchmark driver (run with "make bench")
+#
+# Starts an echo backend, an stunnel server section in front of it and
+# an stunnel client section in front of the server, all on loopback, and
+# measures:
+#   - full and resumed handshakes/s (openssl s_time against the server)
+#   - connections/s through the client+server tunnel
+#   - MB/s per tunnel and aggregate (bulk echo through the tunnel)
+#   - p50/p99 forwarding latency (64-byte request/response)
+#   - CPU seconds per GB forwarded and RSS per idle connection
+#   - time to parse a configuration file with many service sections
+#
+# Environment:
+#   BENCH_STUNNEL   stunnel binaries to compare, e.g. one build per threading
+#                   model (default: ../src/stunnel)
+#   BENCH_TIME      seconds per measurement (default: 10)
+#   BENCH_CONNS     concurrent tunnels for the aggregate tests (default: 64)
+#   BENCH_IDLE      idle connections for the memory test (default: 250, mind ulimit -n)
+#   BENCH_PORT      first of three loopback ports to use (default: 15000)
+#   BENCH_SECTIONS  service sections of the parsed config (default: 10000)
+#   OPENSSL         openssl binary (default: openssl)
+#
+# CPU and memory figures are read from /proc and ps, so they are only
+# reported on Linux.
+
+srcdir=`dirname $0`
+BENCH=${BENCH:-./stunnel-bench}
+BENCH_STUNNEL=${BENCH_STUNNEL:-../src/stunnel}
+BENCH_TIME=${BENCH_TIME:-10}
+BENCH_CONNS=${BENCH_CONNS:-64}
+BENCH_IDLE=${BENCH_IDLE:-250}
+BENCH_PORT=${BENCH_PORT:-15000}
+BENCH_SECTIONS=${BENCH_SECTIONS:-10000}
+OPENSSL=${OPENSSL:-openssl}
+
+BACKEND_PORT=$BENCH_PORT
+SERVER_PORT=`expr $BENCH_PORT + 1`
+CLIENT_PORT=`expr $BENCH_PORT + 2`
+
+DIR=`mktemp -d /tmp/stunnel-bench.XXXXXX` || exit 1
+PIDS=""
+
+cleanup() {
+    for pid in $PIDS; do
+        kill $pid 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf $DIR
+}
+trap cleanup 0
+trap 'exit 1' 1 2 15
+
+# print "name value" for a given key of stunnel-bench output
+result() {
+    sed -n "s/^$1 //p" $2
+}
+
+# utime+stime in clock ticks of a process and its children (FORK threading)
+cpu_ticks() {
+    total=0
+    for pid in $1 `ps -o pid= --ppid $1 2>/dev/null`; do
+        if test -r /proc/$pid/stat; then
+            t=`awk '{print $14+$15}' /proc/$pid/stat`
+            total=`expr $total + $t`
+        fi
+    done
+    echo $total
+}
+
+# resident set size in kB of a process and its children
+rss_kb() {
+    ps -o rss= -p $1 --ppid $1 2>/dev/null | awk '{s+=$1} END {print s+0}'
+}
+
+# a plain TCP connect: the server port speaks TLS and never echoes
+wait_port() {
+    i=0
+    while test $i -lt 50; do
+        if $BENCH probe 127.0.0.1:$1 2>/dev/null; then
+            return 0
+        fi
+        sleep 1
+        i=`expr $i + 1`
+    done
+    echo "Port $1 did not open" >&2
+    exit 1
+}
+
+$OPENSSL req -new -x509 -days 1 -nodes -batch \
+    -config $srcdir/stunnel.cnf \
+    -out $DIR/stunnel.pem -keyout $DIR/stunnel.pem >/dev/null 2>&1 || {
+    echo "Cannot create a test certificate with $OPENSSL" >&2
+    exit 1
+}
+
+# client sections need no certificate, the invalid last line makes stunnel
+# exit right after parsing, before binding any port
+awk -v n=$BENCH_SECTIONS -v port=$BACKEND_PORT 'BEGIN {
+    print "foreground = yes"
+    print "pid ="
+    for(i=0; i<n; i++) {
+        printf("[section%d]\n", i)
+        print "client = yes"
+        printf("accept = 127.0.0.1:%d\n", 20000+i%40000)
+        printf("connect = 127.0.0.1:%d\n", port)
+        print "TIMEOUTidle = 60"
+    }
+    print "endOfBenchmark = yes"
+}' >$DIR/sections.conf
+
+$BENCH echo $BACKEND_PORT &
+PIDS="$PIDS $!"
+
+for STUNNEL in $BENCH_STUNNEL; do
+    THREADING=`$STUNNEL -version 2>&1 | sed -n 's/.*Threading:\([A-Z0-9]*\).*/\1/p'`
+    echo "=== $STUNNEL ($THREADING threading)"
+
+    START=`date +%s.%N`
+    $STUNNEL $DIR/sections.conf >/dev/null 2>&1
+    END=`date +%s.%N`
+    awk -v s=$START -v e=$END -v n=$BENCH_SECTIONS \
+        'BEGIN { printf("config parse (%d sections): %.3f s\n", n, e-s) }'
+
+    cat >$DIR/server.conf <<EOT
+foreground = yes
+pid =
+debug = 3
+cert = $DIR/stunnel.pem
+[bench-server]
+accept = 127.0.0.1:$SERVER_PORT
+connect = 127.0.0.1:$BACKEND_PORT
+EOT
+    cat >$DIR/client.conf <<EOT
+foreground = yes
+pid =
+debug = 3
+client = yes
+[bench-client]
+accept = 127.0.0.1:$CLIENT_PORT
+connect = 127.0.0.1:$SERVER_PORT
+EOT
+    $STUNNEL $DIR/server.conf 2>$DIR/server.log &
+    SERVER_PID=$!
+    $STUNNEL $DIR/client.conf 2>$DIR/client.log &
+    CLIENT_PID=$!
+    PIDS="$PIDS $SERVER_PID $CLIENT_PID"
+    wait_port $SERVER_PORT
+    wait_port $CLIENT_PORT
+
+    # handshakes: openssl s_time prints "N connections in T real seconds"
+    for mode in new reuse; do
+        $OPENSSL s_time -connect 127.0.0.1:$SERVER_PORT -$mode \
+            -time $BENCH_TIME >$DIR/s_time.out 2>&1
+        awk -v mode=$mode '/connections in .* real seconds/ {
+            printf("handshakes/s (%s): %.1f\n", \
+                mode=="new" ? "full" : "resumed", $1/$4); exit }' \
+            $DIR/s_time.out
+    done
+
+    $BENCH connect 127.0.0.1:$CLIENT_PORT $BENCH_CONNS $BENCH_TIME \
+        >$DIR/connect.out
+    echo "tunnel connections/s: `result connect_per_sec $DIR/connect.out`"
+
+    $BENCH pingpong 127.0.0.1:$CLIENT_PORT 1 $BENCH_TIME >$DIR/ping.out
+    echo "latency p50/p99 (us): `result latency_p50_us $DIR/ping.out`/`result latency_p99_us $DIR/ping.out`"
+
+    for conns in 1 $BENCH_CONNS; do
+        CPU_BEFORE=`expr \`cpu_ticks $SERVER_PID\` + \`cpu_ticks $CLIENT_PID\``
+        $BENCH stream 127.0.0.1:$CLIENT_PORT $conns $BENCH_TIME \
+            >$DIR/stream.out
+        CPU_AFTER=`expr \`cpu_ticks $SERVER_PID\` + \`cpu_ticks $CLIENT_PID\``
+        echo "stream $conns tunnel(s): `result stream_mbps_per_tunnel $DIR/stream.out` MB/s per tunnel, `result stream_mbps_total $DIR/stream.out` MB/s aggregate"
+        if test -r /proc/$SERVER_PID/stat; then
+            awk -v ticks=`expr $CPU_AFTER - $CPU_BEFORE` \
+                -v hz=`getconf CLK_TCK` \
+                -v bytes=`result stream_bytes $DIR/stream.out` \
+                'BEGIN { if(bytes>0) printf("CPU per GB: %.2f s\n", \
+                    ticks/hz/(bytes/1e9)) }'
+        fi
+    done
+
+    RSS_BEFORE=`expr \`rss_kb $SERVER_PID\` + \`rss_kb $CLIENT_PID\``
+    mkfifo $DIR/idle.in
+    $BENCH idle 127.0.0.1:$CLIENT_PORT $BENCH_IDLE <$DIR/idle.in \
+        >$DIR/idle.out &
+    IDLE_PID=$!
+    exec 3>$DIR/idle.in
+    i=0
+    while test $i -lt 60 && ! grep idle_ready $DIR/idle.out >/dev/null 2>&1; do
+        sleep 1
+        i=`expr $i + 1`
+    done
+    RSS_AFTER=`expr \`rss_kb $SERVER_PID\` + \`rss_kb $CLIENT_PID\``
+    exec 3>&-
+    wait $IDLE_PID
+    rm -f $DIR/idle.in
+    awk -v before=$RSS_BEFORE -v after=$RSS_AFTER -v n=$BENCH_IDLE \
+        'BEGIN { printf("RSS per connection: %.1f kB\n", (after-before)/n) }'
+
+    kill $SERVER_PID $CLIENT_PID 2>/dev/null
+    wait $SERVER_PID $CLIENT_PID 2>/dev/null
+done
+
+# not the exit status of the stunnel processes killed above
+exit 0
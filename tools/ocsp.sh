@@ -0,0 +1,157 @@
+#!/bin/sh
+#
+# stunnel OCSP stapling check (run with "make ocsp")
+#
+# Creates a test CA and a server certificate, starts "openssl ocsp" as the
+# responder for the CA and an stunnel server section with the OCSP option,
+# and checks that "openssl s_client -status" receives a stapled response
+# with the "good" status.
+#
+# Environment:
+#   OCSP_STUNNEL    stunnel binaries to check, e.g. one build per threading
+#                   model (default: ../src/stunnel)
+#   OCSP_PORT       first of three loopback ports to use (default: 15010)
+#   OPENSSL         openssl binary (default: openssl)
+#
+# The exit status is 0 if all the binaries stapled the response.
+
+BENCH=${BENCH:-./stunnel-bench}
+OCSP_STUNNEL=${OCSP_STUNNEL:-../src/stunnel}
+OCSP_PORT=${OCSP_PORT:-15010}
+OPENSSL=${OPENSSL:-openssl}
+
+RESPONDER_PORT=$OCSP_PORT
+SERVER_PORT=`expr $OCSP_PORT + 1`
+UNUSED_PORT=`expr $OCSP_PORT + 2` # only the handshake is checked
+
+DIR=`mktemp -d /tmp/stunnel-ocsp.XXXXXX` || exit 1
+PIDS=""
+
+cleanup() {
+    for pid in $PIDS; do
+        kill $pid 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf $DIR
+}
+trap cleanup 0
+trap 'exit 1' 1 2 15
+
+# a plain TCP connect, as in bench.sh
+# not for the responder: it exits on a connection without a request
+wait_port() {
+    i=0
+    while test $i -lt 50; do
+        if $BENCH probe 127.0.0.1:$1 2>/dev/null; then
+            return 0
+        fi
+        sleep 1
+        i=`expr $i + 1`
+    done
+    echo "Port $1 did not open" >&2
+    exit 1
+}
+
+cat >$DIR/ca.cnf <<EOT
+[req]
+distinguished_name = dn
+[dn]
+[ca]
+basicConstraints = critical, CA:TRUE
+keyUsage = keyCertSign, cRLSign, digitalSignature
+[server]
+basicConstraints = CA:FALSE
+EOT
+
+# the CA signs both the server certificate and the OCSP responses
+(
+    $OPENSSL req -new -x509 -days 1 -nodes -newkey rsa:2048 \
+        -config $DIR/ca.cnf -extensions ca -subj "/CN=stunnel OCSP test CA" \
+        -out $DIR/ca.pem -keyout $DIR/ca.key &&
+    $OPENSSL req -new -nodes -newkey rsa:2048 \
+        -config $DIR/ca.cnf -subj "/CN=localhost" \
+        -out $DIR/server.csr -keyout $DIR/server.key &&
+    $OPENSSL x509 -req -days 1 -set_serial 0x1000 \
+        -extfile $DIR/ca.cnf -extensions server \
+        -CA $DIR/ca.pem -CAkey $DIR/ca.key \
+        -in $DIR/server.csr -out $DIR/server.crt
+) >/dev/null 2>&1 || {
+    echo "Cannot create the test certificates with $OPENSSL" >&2
+    exit 1
+}
+# the issuer certificate has to follow the server certificate
+cat $DIR/server.crt $DIR/ca.pem $DIR/server.key >$DIR/stunnel.pem
+chmod 600 $DIR/stunnel.pem
+
+# index.txt of "openssl ca": status, expiry, revocation, serial, file, subject
+EXPIRY=`$OPENSSL x509 -enddate -noout -in $DIR/server.crt | \
+    sed 's/notAfter=//' | \
+    awk '{ split("Jan Feb Mar Apr May Jun Jul Aug Sep Oct Nov Dec", m, " ")
+        for(i=1; i<=12; i++) if(m[i]==$1) mon=i
+        split($3, t, ":")
+        printf("%02d%02d%02d%s%s%sZ\n", $4%100, mon, $2, t[1], t[2], t[3]) }'`
+printf "V\t%s\t\t1000\tunknown\t/CN=localhost\n" $EXPIRY >$DIR/index.txt
+
+$OPENSSL ocsp -index $DIR/index.txt -port $RESPONDER_PORT \
+    -CA $DIR/ca.pem -rsigner $DIR/ca.pem -rkey $DIR/ca.key -nmin 10 \
+    >$DIR/responder.log 2>&1 &
+PIDS="$PIDS $!"
+i=0
+until $OPENSSL ocsp -issuer $DIR/ca.pem -cert $DIR/server.crt \
+        -CAfile $DIR/ca.pem -url http://127.0.0.1:$RESPONDER_PORT/ \
+        2>/dev/null | grep ": good" >/dev/null; do
+    if test $i -ge 50; then
+        echo "OCSP responder on port $RESPONDER_PORT did not start" >&2
+        cat $DIR/responder.log >&2
+        exit 1
+    fi
+    sleep 1
+    i=`expr $i + 1`
+done
+
+STATUS=0
+for STUNNEL in $OCSP_STUNNEL; do
+    cat >$DIR/server.conf <<EOT
+foreground = yes
+pid =
+debug = 6
+cert = $DIR/stunnel.pem
+[ocsp-server]
+accept = 127.0.0.1:$SERVER_PORT
+connect = 127.0.0.1:$UNUSED_PORT
+OCSP = http://127.0.0.1:$RESPONDER_PORT/
+EOT
+    $STUNNEL $DIR/server.conf 2>$DIR/server.log &
+    SERVER_PID=$!
+    PIDS="$PIDS $SERVER_PID"
+    wait_port $SERVER_PORT
+
+    # the response is fetched in the background after startup
+    RESULT="no stapled response"
+    i=0
+    while test $i -lt 10; do
+        echo | $OPENSSL s_client -connect 127.0.0.1:$SERVER_PORT -status \
+            >$DIR/s_client.out 2>&1
+        if grep "OCSP Response Status: successful" $DIR/s_client.out \
+                >/dev/null; then
+            if grep "Cert Status: good" $DIR/s_client.out >/dev/null; then
+                RESULT=ok
+            else
+                RESULT="unexpected certificate status"
+            fi
+            break
+        fi
+        sleep 1
+        i=`expr $i + 1`
+    done
+    echo "$STUNNEL: $RESULT"
+    if test "$RESULT" != ok; then
+        cat $DIR/server.log
+        STATUS=1
+    fi
+
+    kill $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+done
+
+exit $STATUS